@@ -0,0 +1,346 @@
+#include <async.h>
+#include <executor.h>
+#define ASYNC_TRACK_ALLOCATIONS
+#include <tracking.h>
+#include <view.h>
+#include <work_stealing_pool.h>
+
+#include <benchmark/benchmark.h>
+
+#include <array>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace async;
+
+//------------------------------------------------------------------------------
+// Every benchmark reports its heap allocations per iteration.
+
+// Records allocations/op for the lifetime of a benchmark's loop.
+struct CountAllocations
+{
+  explicit CountAllocations(benchmark::State& s) : state(s) {}
+
+  ~CountAllocations()
+  {
+    state.counters["allocs/op"] = benchmark::Counter(
+        static_cast<double>(scope.allocations()),
+        benchmark::Counter::kAvgIterations);
+  }
+
+  benchmark::State& state;
+  tracking::Scope scope;
+};
+
+int Inc(int i)
+{
+  return i + 1;
+}
+
+//------------------------------------------------------------------------------
+// The basic combinators, built and run on one thread
+
+static void BM_Pure(benchmark::State& state)
+{
+  CountAllocations c(state);
+  for (auto _ : state)
+  {
+    int r = 0;
+    pure(42)([&r] (int i) { r = i; });
+    benchmark::DoNotOptimize(r);
+  }
+}
+BENCHMARK(BM_Pure);
+
+static void BM_Fmap(benchmark::State& state)
+{
+  CountAllocations c(state);
+  for (auto _ : state)
+  {
+    int r = 0;
+    fmap(Inc, pure(1))([&r] (int i) { r = i; });
+    benchmark::DoNotOptimize(r);
+  }
+}
+BENCHMARK(BM_Fmap);
+
+// Eight fmaps, which fuse into one stage.
+static void BM_FmapChain(benchmark::State& state)
+{
+  CountAllocations c(state);
+  for (auto _ : state)
+  {
+    int r = 0;
+    auto a = fmap(Inc, fmap(Inc, fmap(Inc, fmap(Inc,
+               fmap(Inc, fmap(Inc, fmap(Inc, fmap(Inc, pure(0)))))))));
+    a([&r] (int i) { r = i; });
+    benchmark::DoNotOptimize(r);
+  }
+}
+BENCHMARK(BM_FmapChain);
+
+static void BM_Apply(benchmark::State& state)
+{
+  CountAllocations c(state);
+  for (auto _ : state)
+  {
+    int r = 0;
+    async::apply(pure(Inc), pure(1))([&r] (int i) { r = i; });
+    benchmark::DoNotOptimize(r);
+  }
+}
+BENCHMARK(BM_Apply);
+
+static void BM_Bind(benchmark::State& state)
+{
+  CountAllocations c(state);
+  for (auto _ : state)
+  {
+    int r = 0;
+    auto a = pure(1) >= [] (int i) { return pure(i + 1); };
+    a([&r] (int i) { r = i; });
+    benchmark::DoNotOptimize(r);
+  }
+}
+BENCHMARK(BM_Bind);
+
+static void BM_Sequence(benchmark::State& state)
+{
+  CountAllocations c(state);
+  for (auto _ : state)
+  {
+    int r = 0;
+    auto a = pure(1) > [] () { return pure(2); };
+    a([&r] (int i) { r = i; });
+    benchmark::DoNotOptimize(r);
+  }
+}
+BENCHMARK(BM_Sequence);
+
+static void BM_And(benchmark::State& state)
+{
+  CountAllocations c(state);
+  for (auto _ : state)
+  {
+    int r = 0;
+    (pure(1) && pure(2))([&r] (std::pair<int, int> p) { r = p.first + p.second; });
+    benchmark::DoNotOptimize(r);
+  }
+}
+BENCHMARK(BM_And);
+
+static void BM_Or(benchmark::State& state)
+{
+  CountAllocations c(state);
+  for (auto _ : state)
+  {
+    bool r = false;
+    (pure(1) || pure(2))([&r] (const Either<int, int>& e) { r = e.isRight(); });
+    benchmark::DoNotOptimize(r);
+  }
+}
+BENCHMARK(BM_Or);
+
+// A long chain of erased binds, through the trampoline.
+Async<int> Countdown(int n)
+{
+  if (n == 0)
+    return pure(0);
+  return pure(n - 1) >= Countdown;
+}
+
+static void BM_BindChain(benchmark::State& state)
+{
+  CountAllocations c(state);
+  const int n = static_cast<int>(state.range(0));
+  for (auto _ : state)
+  {
+    int r = -1;
+    Countdown(n)([&r] (int i) { r = i; });
+    benchmark::DoNotOptimize(r);
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_BindChain)->Arg(16)->Arg(1024);
+
+static void BM_Erased(benchmark::State& state)
+{
+  CountAllocations c(state);
+  for (auto _ : state)
+  {
+    int r = 0;
+    Async<int> a = fmap(Inc, pure(1));
+    a([&r] (int i) { r = i; });
+    benchmark::DoNotOptimize(r);
+  }
+}
+BENCHMARK(BM_Erased);
+
+//------------------------------------------------------------------------------
+// N-ary joins and races
+
+static void BM_WhenAll4(benchmark::State& state)
+{
+  CountAllocations c(state);
+  for (auto _ : state)
+  {
+    int r = 0;
+    when_all(pure(1), pure(2), pure(3), pure(4))(
+        [&r] (std::tuple<int, int, int, int> t) { r = std::get<3>(t); });
+    benchmark::DoNotOptimize(r);
+  }
+}
+BENCHMARK(BM_WhenAll4);
+
+static void BM_WhenAllRange(benchmark::State& state)
+{
+  std::vector<Async<int>> asyncs;
+  for (int i = 0; i < state.range(0); ++i)
+    asyncs.push_back(pure(i));
+  auto a = when_all(std::move(asyncs));
+
+  CountAllocations c(state);
+  for (auto _ : state)
+  {
+    size_t r = 0;
+    a([&r] (std::vector<int> v) { r = v.size(); });
+    benchmark::DoNotOptimize(r);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_WhenAllRange)->Arg(4)->Arg(64)->Arg(1024);
+
+static void BM_WhenAny4(benchmark::State& state)
+{
+  CountAllocations c(state);
+  for (auto _ : state)
+  {
+    size_t r = 0;
+    when_any(pure(1), pure(2), pure(3), pure(4))(
+        [&r] (const OneOf<int, int, int, int>& o) { r = o.index(); });
+    benchmark::DoNotOptimize(r);
+  }
+}
+BENCHMARK(BM_WhenAny4);
+
+//------------------------------------------------------------------------------
+// Payloads: a 64KB message through erased stages, passed on by value or lent
+
+struct Message
+{
+  std::array<char, 65536> bytes;
+};
+
+Message Stamp(Message m)
+{
+  m.bytes[0] = 1;
+  return m;
+}
+
+const Message& Inspect(const Message& m)
+{
+  benchmark::DoNotOptimize(m.bytes[0]);
+  return m;
+}
+
+static void BM_PayloadByValue(benchmark::State& state)
+{
+  Async<Message> a = pure(Message{});
+  Async<Message> b = fmap(Stamp, std::move(a));
+  Async<Message> c = fmap(Stamp, std::move(b));
+  CountAllocations count(state);
+  for (auto _ : state)
+  {
+    char r = 0;
+    c([&r] (const Message& m) { r = m.bytes[0]; });
+    benchmark::DoNotOptimize(r);
+  }
+}
+BENCHMARK(BM_PayloadByValue);
+
+static void BM_PayloadBorrowed(benchmark::State& state)
+{
+  Async<const Message&> a = pure(Message{});
+  Async<const Message&> b = fmap(Inspect, std::move(a));
+  Async<const Message&> c = fmap(Inspect, std::move(b));
+  CountAllocations count(state);
+  for (auto _ : state)
+  {
+    char r = 0;
+    c([&r] (const Message& m) { r = m.bytes[0]; });
+    benchmark::DoNotOptimize(r);
+  }
+}
+BENCHMARK(BM_PayloadBorrowed);
+
+static void BM_PayloadView(benchmark::State& state)
+{
+  auto v = view(std::vector<char>(65536));
+  CountAllocations count(state);
+  for (auto _ : state)
+  {
+    size_t r = 0;
+    when_all(pure(v), pure(v.subview(1024)))(
+        [&r] (std::tuple<View<char>, View<char>> t) { r = std::get<1>(t).size(); });
+    benchmark::DoNotOptimize(r);
+  }
+}
+BENCHMARK(BM_PayloadView);
+
+//------------------------------------------------------------------------------
+// Executors: the round trip to a pool, and join throughput as the pool grows
+
+// Wait for n completions.
+struct Latch
+{
+  explicit Latch(int n) : remaining(n) {}
+  void countDown() { remaining.fetch_sub(1, std::memory_order_release); }
+  void wait()
+  {
+    while (remaining.load(std::memory_order_acquire) > 0)
+      std::this_thread::yield();
+  }
+
+  std::atomic<int> remaining;
+};
+
+template <typename Pool>
+static void BM_ViaRoundTrip(benchmark::State& state)
+{
+  Pool pool(1);
+  CountAllocations c(state);
+  for (auto _ : state)
+  {
+    Latch done(1);
+    via(pool, pure(1))([&done] (int) { done.countDown(); });
+    done.wait();
+  }
+}
+BENCHMARK_TEMPLATE(BM_ViaRoundTrip, ThreadPool)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_ViaRoundTrip, WorkStealingPool)->UseRealTime();
+
+// Many two-way joins whose branches complete on the pool's threads.
+template <typename Pool>
+static void BM_JoinThroughput(benchmark::State& state)
+{
+  const int joins = 256;
+  Pool pool(static_cast<size_t>(state.range(0)));
+  CountAllocations c(state);
+  for (auto _ : state)
+  {
+    Latch done(joins);
+    for (int i = 0; i < joins; ++i)
+      when_all(via(pool, pure(i)), via(pool, pure(i)))(
+          [&done] (std::tuple<int, int>) { done.countDown(); });
+    done.wait();
+  }
+  state.SetItemsProcessed(state.iterations() * joins);
+}
+BENCHMARK_TEMPLATE(BM_JoinThroughput, ThreadPool)
+  ->RangeMultiplier(2)->Range(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_JoinThroughput, WorkStealingPool)
+  ->RangeMultiplier(2)->Range(1, 8)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,329 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// Choosing where an Async graph's memory comes from.
+//
+// The combinators allocate when they're started: join state for apply,
+// when_all, race and when_any, and boxes for continuations too big to erase
+// inline. All of it comes from the MemoryResource that is current on the
+// starting thread, or from the global heap if there isn't one. The resource is
+// made current the same way as a stop token: with_allocator (in async.h) or a
+// ResourceScope sets it, and bind and sequence reinstate the one that was
+// current when they were started. An Arena serves a request's whole graph with
+// bump allocation and frees it all at once when it's destroyed; a Pool
+// recycles what's freed, for a graph that is run again and again (plan.h).
+
+namespace async
+{
+  // Somewhere to allocate memory from.
+  class MemoryResource
+  {
+  public:
+    virtual ~MemoryResource() = default;
+    virtual void* allocate(size_t bytes, size_t align) = 0;
+    virtual void deallocate(void* p, size_t bytes, size_t align) = 0;
+  };
+
+  // A bump allocator. Allocation is a compare-and-swap on the current block,
+  // from any thread; deallocation does nothing, and everything is freed when
+  // the arena is destroyed, so it must outlive everything allocated from it.
+  class Arena : public MemoryResource
+  {
+    struct alignas(std::max_align_t) Block
+    {
+      Block(Block* n, size_t s) : next(n), size(s), used(0) {}
+
+      char* data() { return reinterpret_cast<char*>(this + 1); }
+
+      Block* next;
+      size_t size;
+      std::atomic<size_t> used;
+    };
+
+  public:
+    explicit Arena(size_t blockSize = 4096)
+      : m_blockSize(blockSize), m_allocated(0)
+    {
+      m_current.store(newBlock(nullptr, blockSize), std::memory_order_relaxed);
+    }
+
+    ~Arena()
+    {
+      Block* b = m_current.load(std::memory_order_relaxed);
+      while (b)
+      {
+        Block* next = b->next;
+        b->~Block();
+        ::operator delete(b);
+        b = next;
+      }
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t bytes, size_t align) override
+    {
+      for (;;)
+      {
+        Block* b = m_current.load(std::memory_order_acquire);
+        const uintptr_t base = reinterpret_cast<uintptr_t>(b->data());
+        size_t used = b->used.load(std::memory_order_relaxed);
+        for (;;)
+        {
+          size_t start = ((base + used + align - 1) & ~uintptr_t(align - 1)) - base;
+          if (start + bytes > b->size)
+            break;
+          if (b->used.compare_exchange_weak(used, start + bytes,
+                                            std::memory_order_relaxed))
+          {
+            m_allocated.fetch_add(bytes, std::memory_order_relaxed);
+            return b->data() + start;
+          }
+        }
+        grow(b, bytes + align);
+      }
+    }
+
+    void deallocate(void*, size_t, size_t) override {}
+
+    // the total number of bytes handed out
+    size_t bytesAllocated() const
+    {
+      return m_allocated.load(std::memory_order_relaxed);
+    }
+
+  private:
+    static Block* newBlock(Block* next, size_t size)
+    {
+      return new (::operator new(sizeof(Block) + size)) Block(next, size);
+    }
+
+    // Only the first thread to find a block full replaces it.
+    void grow(Block* full, size_t atLeast)
+    {
+      std::lock_guard<std::mutex> g(m_mutex);
+      if (m_current.load(std::memory_order_relaxed) == full)
+        m_current.store(newBlock(full, std::max(m_blockSize, atLeast)),
+                        std::memory_order_release);
+    }
+
+    size_t m_blockSize;
+    std::atomic<Block*> m_current;
+    std::atomic<size_t> m_allocated;
+    std::mutex m_mutex;
+  };
+
+  // A recycling allocator. Freed blocks go on a free list for their size class
+  // (powers of two from 16 bytes to 4KB), and allocations of that class are
+  // served from it; larger blocks come from the heap and go straight back.
+  // Nothing on the free lists is returned to the heap until the pool is
+  // destroyed, so a pool that serves the same graph over and over stops
+  // allocating once it has seen the graph's peak. It must outlive everything
+  // allocated from it.
+  class Pool : public MemoryResource
+  {
+    static const size_t MIN_SHIFT = 4;
+    static const size_t CLASSES = 9;
+
+    struct FreeBlock
+    {
+      FreeBlock* next;
+    };
+
+    struct FreeList
+    {
+      std::mutex mutex;
+      FreeBlock* head = nullptr;
+    };
+
+  public:
+    Pool() : m_blocks(0) {}
+
+    ~Pool()
+    {
+      for (auto& l : m_lists)
+        while (FreeBlock* b = l.head)
+        {
+          l.head = b->next;
+          ::operator delete(b);
+        }
+    }
+
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+
+    void* allocate(size_t bytes, size_t align) override
+    {
+      size_t c = sizeClass(bytes, align);
+      if (c == CLASSES)
+        return allocateLarge(bytes, align);
+      {
+        FreeList& l = m_lists[c];
+        std::lock_guard<std::mutex> g(l.mutex);
+        if (FreeBlock* b = l.head)
+        {
+          l.head = b->next;
+          return b;
+        }
+      }
+      m_blocks.fetch_add(1, std::memory_order_relaxed);
+      return ::operator new(size_t(1) << (c + MIN_SHIFT));
+    }
+
+    void deallocate(void* p, size_t bytes, size_t align) override
+    {
+      size_t c = sizeClass(bytes, align);
+      if (c == CLASSES)
+        return deallocateLarge(p, align);
+      FreeList& l = m_lists[c];
+      std::lock_guard<std::mutex> g(l.mutex);
+      l.head = new (p) FreeBlock{ l.head };
+    }
+
+    // the number of blocks the free lists have taken from the heap
+    size_t blocksAllocated() const
+    {
+      return m_blocks.load(std::memory_order_relaxed);
+    }
+
+  private:
+    // the smallest class that fits, or CLASSES if none does (or the block
+    // needs more alignment than the heap gives)
+    static size_t sizeClass(size_t bytes, size_t align)
+    {
+      if (align > alignof(std::max_align_t))
+        return CLASSES;
+      size_t c = 0;
+      while (c < CLASSES && (size_t(1) << (c + MIN_SHIFT)) < bytes)
+        ++c;
+      return c;
+    }
+
+    // Over-aligned blocks are carved out of larger ones, with the address of
+    // the allocation just before the block.
+    static void* allocateLarge(size_t bytes, size_t align)
+    {
+      if (align <= alignof(std::max_align_t))
+        return ::operator new(bytes);
+      void* raw = ::operator new(bytes + align + sizeof(void*));
+      uintptr_t p = (reinterpret_cast<uintptr_t>(raw) + sizeof(void*) + align - 1) &
+                    ~uintptr_t(align - 1);
+      reinterpret_cast<void**>(p)[-1] = raw;
+      return reinterpret_cast<void*>(p);
+    }
+
+    static void deallocateLarge(void* p, size_t align)
+    {
+      if (align <= alignof(std::max_align_t))
+        return ::operator delete(p);
+      ::operator delete(static_cast<void**>(p)[-1]);
+    }
+
+    FreeList m_lists[CLASSES];
+    std::atomic<size_t> m_blocks;
+  };
+
+  // A standard allocator over a MemoryResource, or over the global heap if it
+  // has none.
+  template <typename T>
+  struct ResourceAllocator
+  {
+    using value_type = T;
+
+    explicit ResourceAllocator(MemoryResource* r = nullptr) noexcept
+      : resource(r)
+    {}
+
+    template <typename U>
+    ResourceAllocator(const ResourceAllocator<U>& other) noexcept
+      : resource(other.resource)
+    {}
+
+    T* allocate(size_t n)
+    {
+      if (resource)
+        return static_cast<T*>(resource->allocate(n * sizeof(T), alignof(T)));
+      return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) noexcept
+    {
+      if (resource)
+        resource->deallocate(p, n * sizeof(T), alignof(T));
+      else
+        ::operator delete(p);
+    }
+
+    MemoryResource* resource;
+  };
+
+  template <typename T, typename U>
+  inline bool operator==(const ResourceAllocator<T>& a,
+                         const ResourceAllocator<U>& b)
+  {
+    return a.resource == b.resource;
+  }
+
+  template <typename T, typename U>
+  inline bool operator!=(const ResourceAllocator<T>& a,
+                         const ResourceAllocator<U>& b)
+  {
+    return !(a == b);
+  }
+
+  namespace detail
+  {
+    inline MemoryResource*& currentResourceRef()
+    {
+      thread_local MemoryResource* r = nullptr;
+      return r;
+    }
+  }
+
+  // The resource in effect for Asyncs being started on this thread, or nullptr
+  // for the global heap.
+  inline MemoryResource* currentResource()
+  {
+    return detail::currentResourceRef();
+  }
+
+  // Makes a resource current for the lifetime of the scope.
+  class ResourceScope
+  {
+  public:
+    explicit ResourceScope(MemoryResource* r)
+      : m_saved(detail::currentResourceRef())
+    {
+      detail::currentResourceRef() = r;
+    }
+
+    ~ResourceScope()
+    {
+      detail::currentResourceRef() = m_saved;
+    }
+
+    ResourceScope(const ResourceScope&) = delete;
+    ResourceScope& operator=(const ResourceScope&) = delete;
+
+  private:
+    MemoryResource* m_saved;
+  };
+
+  // make_shared, from the current resource
+  template <typename T, typename... Args>
+  inline std::shared_ptr<T> allocateShared(Args&&... args)
+  {
+    return std::allocate_shared<T>(ResourceAllocator<T>(currentResource()),
+                                   std::forward<Args>(args)...);
+  }
+}
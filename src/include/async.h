@@ -1,40 +1,224 @@
 #pragma once
 
+#include "allocator.h"
+#include "cancellation.h"
 #include "either.h"
 #include "function_traits.h"
+#include "one_of.h"
+#include "trace.h"
+#include "trampoline.h"
+#include "unique_function.h"
 
-#include <functional>
+#include <atomic>
 #include <memory>
-#include <mutex>
+#include <new>
+#include <tuple>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 //------------------------------------------------------------------------------
 // The async monad
 
 //------------------------------------------------------------------------------
 // Simple type representing an asynchronous value which can be retrieved by
-// passing a continuation to receive it.
+// passing a continuation to receive it. Both are move-only UniqueFunctions:
+// neither an Async nor a continuation is ever copied by the combinators, so
+// reusing an Async means moving it (or building it again). The statically typed
+// AsyncOps that the combinators return (below) are copyable whenever everything
+// they capture is.
 
 template <typename T>
 struct Continuation
 {
-  using type = std::function<void (std::decay_t<T>)>;
+  using type = UniqueFunction<void (std::decay_t<T>)>;
 };
 
 template <>
 struct Continuation<void>
 {
-  using type = std::function<void ()>;
+  using type = UniqueFunction<void ()>;
+};
+
+// An Async<T&&> or Async<const T&> lends its value rather than passing it: the
+// continuation gets a reference to a value the producer owns, valid for the
+// duration of the call, so a large payload reaches its consumer through erased
+// stages without being moved or copied. fmap passes one on by reference (and a
+// function may return a reference into it, to project part of it); bind and
+// sequence start their next stage later, so they take their own copy first (a
+// move, for T&&). The joins and races store their results, and so take Asyncs
+// of values: to share a payload among several consumers, pass a View (view.h).
+template <typename T>
+struct Continuation<T&&>
+{
+  using type = UniqueFunction<void (T&&)>;
+};
+
+template <typename T>
+struct Continuation<const T&>
+{
+  using type = UniqueFunction<void (const T&)>;
 };
 
 template <typename T>
 using ContinuationT = typename Continuation<T>::type;
 
 template <typename T>
-using Async = std::function<void (ContinuationT<T>)>;
+using Async = UniqueFunction<void (ContinuationT<T>)>;
+
+//------------------------------------------------------------------------------
+// A statically typed Async. Impl is the concrete callable that takes a
+// continuation; the combinators all return AsyncOps, so a fixed-shape pipeline
+// is a single concrete type whose stages call each other directly and can be
+// inlined. It is only type-erased (to Async<T>) on request: by calling erase(),
+// or by storing it in an Async<T>.
+//
+// An AsyncOp can also be invoked as const, which leaves it as it was built, so
+// that it can be run again, or by several threads at once (this is how an
+// AsyncPlan runs its graph; see plan.h). The combinators' stages support that
+// directly, by copying what they'd otherwise move; a stage that can't be
+// invoked as const (a mutable lambda) is copied for the invocation instead.
 
 namespace async
 {
+  namespace detail
+  {
+    template <typename Impl, typename C, typename = void>
+    struct IsConstInvocable : std::false_type {};
+
+    template <typename Impl, typename C>
+    struct IsConstInvocable<Impl, C, decltype(void(
+        std::declval<const Impl&>()(std::declval<C>())))> : std::true_type {};
+
+    template <typename Impl, typename C>
+    inline void invokeConst(const Impl& impl, C&& cont, std::true_type)
+    {
+      impl(std::forward<C>(cont));
+    }
+
+    template <typename Impl, typename C>
+    inline void invokeConst(const Impl& impl, C&& cont, std::false_type)
+    {
+      Impl copy(impl);
+      copy(std::forward<C>(cont));
+    }
+  }
+}
+
+template <typename Impl, typename T>
+struct AsyncOp
+{
+  using type = T;
+
+  explicit AsyncOp(Impl&& impl) : m_impl(std::move(impl)) {}
+
+  // Invoking an AsyncOp lets its stages move what they captured into the
+  // continuations they build, rather than copy it, so it runs once, whether
+  // it's invoked as an lvalue or an rvalue. Invoked as const, they copy
+  // instead, leaving the op as built, so that it can be invoked again.
+  template <typename C>
+  inline void operator()(C&& cont) &
+  {
+    m_impl(std::forward<C>(cont));
+  }
+
+  template <typename C>
+  inline void operator()(C&& cont) &&
+  {
+    std::move(m_impl)(std::forward<C>(cont));
+  }
+
+  template <typename C>
+  inline void operator()(C&& cont) const &
+  {
+    async::detail::invokeConst(m_impl, std::forward<C>(cont),
+                               async::detail::IsConstInvocable<Impl, C>());
+  }
+
+  Async<T> erase() && { return Async<T>(std::move(*this)); }
+  Async<T> erase() const & { return Async<T>(AsyncOp(*this)); }
+
+  Impl m_impl;
+};
+
+namespace async
+{
+  template <typename T, typename Impl>
+  inline AsyncOp<std::decay_t<Impl>, T> makeAsyncOp(Impl&& impl)
+  {
+    return AsyncOp<std::decay_t<Impl>, T>(std::forward<Impl>(impl));
+  }
+
+  namespace detail
+  {
+    // How a stage hands on something it captured: a move, unless the stage is
+    // being invoked as const, when it's a copy.
+    template <typename T>
+    inline T&& take(T& t) { return std::move(t); }
+
+    template <typename T>
+    inline T take(const T& t) { return t; }
+
+    // The Impl of a combinator's AsyncOp: a body, and what it captures. The
+    // body is a lambda that is passed the captures (then the continuation) as
+    // lvalues, which are const when the stage is invoked as const, so the same
+    // body serves both ways of running it.
+    template <typename Body, typename... Caps>
+    struct Stage
+    {
+      template <typename C>
+      inline void operator()(C&& cont)
+      {
+        call(*this, std::forward<C>(cont), std::index_sequence_for<Caps...>());
+      }
+
+      template <typename C>
+      inline void operator()(C&& cont) const
+      {
+        call(*this, std::forward<C>(cont), std::index_sequence_for<Caps...>());
+      }
+
+      template <typename S, typename C, size_t... I>
+      static inline void call(S& self, C&& cont, std::index_sequence<I...>)
+      {
+        self.m_body(std::get<I>(self.m_caps)..., std::forward<C>(cont));
+      }
+
+      Body m_body;
+      std::tuple<Caps...> m_caps;
+    };
+  }
+
+  // An AsyncOp whose stage is body, over the given captures, e.g.
+  //   makeStage<B>([] (auto& f1, auto& aa1, auto&& cont) { ... }, f, aa)
+  template <typename T, typename Body, typename... Caps>
+  inline auto makeStage(Body&& body, Caps&&... caps)
+  {
+    using S = detail::Stage<std::decay_t<Body>, std::decay_t<Caps>...>;
+    return AsyncOp<S, T>(
+        S{ std::forward<Body>(body),
+           std::tuple<std::decay_t<Caps>...>(std::forward<Caps>(caps)...) });
+  }
+
+  namespace detail
+  {
+    // Uninitialized storage for a T, so that join state can hold results in
+    // place. Whoever owns the Slot tracks whether it has been constructed.
+    template <typename T>
+    struct Slot
+    {
+      template <typename... Args>
+      inline void construct(Args&&... args)
+      {
+        new (&m_storage) T(std::forward<Args>(args)...);
+      }
+
+      inline T& get() { return *reinterpret_cast<T*>(&m_storage); }
+      inline void destroy() { get().~T(); }
+
+      std::aligned_storage_t<sizeof(T), alignof(T)> m_storage;
+    };
+  }
 
   // FromAsync<T>::type is defined if T is an Async
   template <typename T>
@@ -47,18 +231,24 @@ namespace async
   {
   };
 
-  template <typename T>
-  struct FromAsync<std::function<void (std::function<void (T)>)>>
+  template <typename T, size_t N, size_t M>
+  struct FromAsync<UniqueFunction<void (UniqueFunction<void (T), N>), M>>
   {
     using type = T;
   };
 
-  template <>
-  struct FromAsync<std::function<void (std::function<void ()>)>>
+  template <size_t N, size_t M>
+  struct FromAsync<UniqueFunction<void (UniqueFunction<void (), N>), M>>
   {
     using type = void;
   };
 
+  template <typename Impl, typename T>
+  struct FromAsync<AsyncOp<Impl, T>>
+  {
+    using type = T;
+  };
+
   template <typename T>
   using FromAsyncT = typename FromAsync<T>::type;
 
@@ -66,15 +256,89 @@ namespace async
   // captured value.
   // a -> m a
   template <typename A>
-  inline Async<A> pure(A&& a)
+  inline auto pure(A&& a)
+  {
+    return makeStage<std::decay_t<A>>(
+        [] (auto& a1, auto&& cont)
+        {
+          cont(detail::take(a1));
+        }, std::forward<A>(a));
+  }
+
+  namespace detail
   {
-    return [a1 = std::forward<A>(a)]
-      (ContinuationT<A>&& cont) mutable
+    // Two functions applied one after the other: g(f(a)).
+    template <typename G, typename F>
+    struct Composed
+    {
+      G g;
+      F f;
+    };
+
+    template <typename F>
+    struct Apply
+    {
+      template <typename A>
+      static inline decltype(auto) call(F&& f, A&& a)
+      {
+        return function_traits<F>::apply(std::move(f), std::forward<A>(a));
+      }
+    };
+
+    template <typename G, typename F>
+    struct Apply<Composed<G, F>>
     {
-      // Problem: how do we know whether or not the lambda itself is an rvalue
-      // (i.e. whether we can safely move the capture)?
-      cont(std::move(a1));
+      template <typename A>
+      static inline decltype(auto) call(Composed<G, F>&& gf, A&& a)
+      {
+        return Apply<G>::call(std::move(gf.g),
+                              Apply<F>::call(std::move(gf.f), std::forward<A>(a)));
+      }
+    };
+
+    // The Impl of an fmap's AsyncOp. It's a named type (rather than a lambda)
+    // so that fmap can recognise its own output, and fuse with it. Like any
+    // other stage, it moves the function into the continuation, unless it's
+    // invoked as const, when it copies it.
+    template <typename F, typename AA>
+    struct FmapImpl
+    {
+      using A = FromAsyncT<AA>;
+
+      template <typename C>
+      inline void operator()(C&& cont)
+      {
+        aa([c = std::forward<C>(cont), f2 = std::move(f)] (A&& a) mutable {
+            c(Apply<F>::call(std::move(f2), std::forward<A>(a)));
+          });
+      }
+
+      template <typename C>
+      inline void operator()(C&& cont) const
+      {
+        aa([c = std::forward<C>(cont), f2 = f] (A&& a) mutable {
+            c(Apply<F>::call(std::move(f2), std::forward<A>(a)));
+          });
+      }
+
+      F f;
+      AA aa;
     };
+
+    template <typename T>
+    struct IsFmap : std::false_type {};
+
+    template <typename F, typename AA, typename T>
+    struct IsFmap<AsyncOp<FmapImpl<F, AA>, T>> : std::true_type {};
+
+    // Whether fmap(g, aa) can be fused with aa, an fmap(f, a) itself, into
+    // fmap(g . f, a). g mustn't return a reference, which could be to the
+    // result of f: that lives only as long as the call to the continuation
+    // when the stages are apart, but not past the call to g when they're fused.
+    template <typename G, typename AA>
+    using CanFuse = std::integral_constant<bool,
+      IsFmap<std::decay_t<AA>>::value &&
+      !std::is_reference<typename function_traits<G>::template appliedType<G>>::value>;
   }
 
   // Fmap a function into an async context: the new async will pass the existing
@@ -88,20 +352,38 @@ namespace async
             std::enable_if_t<
               std::is_convertible<
                 FromAsyncT<AA>,
-                typename function_traits<F>::template Arg<0>::type>::value, int> = 0>
-  inline Async<typename function_traits<F>::appliedType> fmap(
-      F&& f, AA&& aa)
+                typename function_traits<F>::template Arg<0>::type>::value &&
+              !detail::CanFuse<F, AA>::value, int> = 0>
+  inline auto fmap(F&& f, AA&& aa)
   {
-    using A = FromAsyncT<AA>;
-    using C = ContinuationT<typename function_traits<F>::appliedType>;
+    using B = typename function_traits<F>::template appliedType<F>;
+    using Impl = detail::FmapImpl<std::decay_t<F>, std::decay_t<AA>>;
 
-    return [f1 = std::forward<F>(f), aa1 = std::forward<AA>(aa)]
-      (C&& cont)
-    {
-      aa1([c = std::forward<C>(cont), f2 = std::move(f1)] (A&& a) {
-          c(function_traits<F>::apply(std::move(f2), std::forward<A>(a)));
-        });
-    };
+    return makeAsyncOp<B>(Impl{ std::forward<F>(f), std::forward<AA>(aa) });
+  }
+
+  // Fmap over an fmap fuses the two: fmap(g, fmap(f, a)) is fmap(g . f, a), a
+  // single stage that calls g(f(a)), so a chain of fmaps is one continuation
+  // hop however long it is.
+  template <typename G, typename AA,
+            // constraint: as above, and AA is an fmap that can be fused
+            std::enable_if_t<
+              std::is_convertible<
+                FromAsyncT<AA>,
+                typename function_traits<G>::template Arg<0>::type>::value &&
+              detail::CanFuse<G, AA>::value, int> = 0>
+  inline auto fmap(G&& g, AA&& aa)
+  {
+    using B = typename function_traits<G>::template appliedType<G>;
+    using Inner = decltype(aa.m_impl);
+    using Impl = detail::FmapImpl<detail::Composed<std::decay_t<G>, decltype(Inner::f)>,
+                                  decltype(Inner::aa)>;
+
+    // the inner stage's function and source are moved out of an rvalue
+    auto&& inner = std::forward<AA>(aa).m_impl;
+    using I = decltype(inner);
+    return makeAsyncOp<B>(
+        Impl{ { std::forward<G>(g), std::forward<I>(inner).f }, std::forward<I>(inner).aa });
   }
 
   // Apply an async function to an async argument: this is more involved. We
@@ -117,58 +399,92 @@ namespace async
               std::is_convertible<
                 FromAsyncT<AA>,
                 typename function_traits<FromAsyncT<AF>>::template Arg<0>::type>::value, int> = 0>
-  inline Async<typename function_traits<FromAsyncT<AF>>::appliedType> apply(
-      AF&& af, AA&& aa)
+  inline auto apply(AF&& af, AA&& aa)
   {
     using A = FromAsyncT<AA>;
     using F = FromAsyncT<AF>;
-    using C = ContinuationT<typename function_traits<F>::appliedType>;
+    using B = typename function_traits<F>::template appliedType<F>;
 
-    struct Data
-    {
-      std::unique_ptr<F> pf;
-      std::unique_ptr<A> pa;
-      std::mutex m;
-    };
-    std::shared_ptr<Data> pData = std::make_shared<Data>();
+    return makeStage<B>(
+        [] (auto& af1, auto& aa1, auto&& cont)
+        {
+          using C = std::decay_t<decltype(cont)>;
 
-    return [pData, af1 = std::forward<AF>(af), aa1 = std::forward<AA>(aa)]
-      (C&& cont)
-    {
-      af1([pData, cont] (F&& f) {
-          bool have_a = false;
+          // The join state is one allocation holding the continuation and a
+          // slot for each side, made fresh for each invocation. A single
+          // atomic state word records which sides have arrived: each side
+          // stores its value then sets its bit, and the side that finds the
+          // other's bit already set is the last, so it calls the continuation.
+          struct Data : TracePolicy::Node
           {
-            // if we don't have a already, store f
-            std::lock_guard<std::mutex> g(pData->m);
-            have_a = static_cast<bool>(pData->pa);
-            if (!have_a)
-              pData->pf = std::make_unique<F>(std::forward<F>(f));
-          }
-          // if we have both sides, call the continuation and we're done
-          if (have_a)
-            cont(function_traits<F>::apply(std::forward<F>(f), std::move(*pData->pa)));
-        });
+            enum : unsigned { HAVE_F = 1, HAVE_A = 2 };
 
-      aa1([pData, c = std::forward<C>(cont)] (A&& a) {
-          bool have_f = false;
-          {
-            // if we don't have f already, store a
-            std::lock_guard<std::mutex> g(pData->m);
-            have_f = static_cast<bool>(pData->pf);
-            if (!have_f)
-              pData->pa = std::make_unique<A>(std::forward<A>(a));
-          }
-          // if we have both sides, call the continuation and we're done
-          if (have_f)
-            c(function_traits<F>::apply(std::move(*pData->pf), std::forward<A>(a)));
-        });
-    };
+            explicit Data(C&& c)
+              : TracePolicy::Node("apply"), cont(std::move(c)), state(0)
+            {}
+            ~Data()
+            {
+              unsigned s = state.load(std::memory_order_acquire);
+              if (s & HAVE_F)
+                f.destroy();
+              if (s & HAVE_A)
+                a.destroy();
+            }
+
+            bool has(unsigned bit) const
+            {
+              return (state.load(std::memory_order_acquire) & bit) != 0;
+            }
+
+            // returns true if the other side had already arrived
+            bool arrive(unsigned bit)
+            {
+              return state.fetch_or(bit, std::memory_order_acq_rel) != 0;
+            }
+
+            C cont;
+            detail::Slot<F> f;
+            detail::Slot<A> a;
+            std::atomic<unsigned> state;
+          };
+          std::shared_ptr<Data> pData =
+            allocateShared<Data>(std::forward<decltype(cont)>(cont));
+
+          af1([pData] (F&& f) {
+              TracePolicy::arrive(*pData, 0);
+              // if a is already here, we're last and don't need to store f
+              if (pData->has(Data::HAVE_A))
+                return pData->cont(function_traits<F>::apply(
+                        std::forward<F>(f), std::move(pData->a.get())));
+
+              pData->f.construct(std::forward<F>(f));
+              if (pData->arrive(Data::HAVE_F))
+                pData->cont(function_traits<F>::apply(
+                        std::move(pData->f.get()), std::move(pData->a.get())));
+            });
+
+          aa1([pData = std::move(pData)] (A&& a) {
+              TracePolicy::arrive(*pData, 1);
+              // if f is already here, we're last and don't need to store a
+              if (pData->has(Data::HAVE_F))
+                return pData->cont(function_traits<F>::apply(
+                        std::move(pData->f.get()), std::forward<A>(a)));
+
+              pData->a.construct(std::forward<A>(a));
+              if (pData->arrive(Data::HAVE_A))
+                pData->cont(function_traits<F>::apply(
+                        std::move(pData->f.get()), std::move(pData->a.get())));
+            });
+        }, std::forward<AF>(af), std::forward<AA>(aa));
   }
 
   // Bind an async value to a function returning async. We need to call the
   // async, passing a continuation that calls the function on the argument, then
   // passes the new continuation to that async value. A can't be void here; use
-  // sequence instead for that case.
+  // sequence instead for that case. The second async is started under the stop
+  // token and memory resource that were current when the bind was, and not at
+  // all if that token has been stopped in the meantime. It's started through
+  // bounce(), so that long synchronous chains run in constant stack space.
   // m a -> (a -> m b) - > m b
   template <typename F, typename AA,
             // constraint: whatever's inside the Async<A> must be admissible as
@@ -178,19 +494,30 @@ namespace async
               std::is_convertible<
                 FromAsyncT<AA>,
                 typename function_traits<F>::template Arg<0>::type>::value, int> = 0>
-  inline typename function_traits<F>::appliedType bind(
-      AA&& aa, F&& f)
+  inline auto bind(AA&& aa, F&& f)
   {
     using A = FromAsyncT<AA>;
-    using AB = typename function_traits<F>::appliedType;
-    using C = typename function_traits<AB>::template Arg<0>::bareType;
+    using B = FromAsyncT<typename function_traits<F>::template appliedType<F>>;
 
-    return [f1 = std::forward<F>(f), aa1 = std::forward<AA>(aa)]
-      (C&& cont)
-    {
-      aa1([c = std::forward<C>(cont), f2 = std::move(f1)] (A&& a) {
-          f2(std::forward<A>(a))(c); });
-    };
+    return makeStage<B>(
+        [] (auto& f1, auto& aa1, auto&& cont)
+        {
+          using C = decltype(cont);
+          aa1([c = std::forward<C>(cont), f2 = detail::take(f1),
+               token = currentStopToken(), r = currentResource()]
+              (A&& a) mutable {
+              // don't start the next stage if we've been cancelled
+              if (token.stopRequested())
+                return;
+              bounce([c = std::move(c), f2 = std::move(f2),
+                      token = std::move(token), r, a = std::forward<A>(a)]
+                     () mutable {
+                  StopScope scope(std::move(token));
+                  ResourceScope rscope(r);
+                  f2(std::move(a))(TracePolicy::stage("bind", std::move(c)));
+                });
+            });
+        }, std::forward<F>(f), std::forward<AA>(aa));
   }
 
   // Sequence is like bind, but it drops the result of the first async. We need
@@ -199,32 +526,52 @@ namespace async
   template <typename F, typename AA, typename A>
   struct sequence
   {
-    using AB = typename function_traits<F>::appliedType;
-    inline AB operator()(AA&& aa, F&& f)
+    using B = FromAsyncT<typename function_traits<F>::template appliedType<F>>;
+    inline auto operator()(AA&& aa, F&& f)
     {
-      using C = typename function_traits<AB>::template Arg<0>::bareType;
-      return [f1 = std::forward<F>(f), aa1 = std::forward<Async<A>>(aa)]
-        (C&& cont)
-      {
-        aa1([c = std::forward<C>(cont), f2 = std::move(f1)] (A&&) {
-            f2()(c); });
-      };
+      return makeStage<B>(
+          [] (auto& f1, auto& aa1, auto&& cont)
+          {
+            using C = decltype(cont);
+            aa1([c = std::forward<C>(cont), f2 = detail::take(f1),
+                 token = currentStopToken(), r = currentResource()]
+                (A&&) mutable {
+                if (token.stopRequested())
+                  return;
+                bounce([c = std::move(c), f2 = std::move(f2),
+                        token = std::move(token), r] () mutable {
+                    StopScope scope(std::move(token));
+                    ResourceScope rscope(r);
+                    f2()(TracePolicy::stage("sequence", std::move(c)));
+                  });
+              });
+          }, std::forward<F>(f), std::forward<AA>(aa));
     }
   };
 
   template <typename F, typename AA>
   struct sequence<F, AA, void>
   {
-    using AB = typename function_traits<F>::appliedType;
-    inline AB operator()(AA&& aa, F&& f)
+    using B = FromAsyncT<typename function_traits<F>::template appliedType<F>>;
+    inline auto operator()(AA&& aa, F&& f)
     {
-      using C = typename function_traits<AB>::template Arg<0>::bareType;
-      return [f1 = std::forward<F>(f), aa1 = std::forward<Async<void>>(aa)]
-        (C&& cont)
-      {
-        aa1([c = std::forward<C>(cont), f2 = std::move(f1)] () {
-            f2()(c); });
-      };
+      return makeStage<B>(
+          [] (auto& f1, auto& aa1, auto&& cont)
+          {
+            using C = decltype(cont);
+            aa1([c = std::forward<C>(cont), f2 = detail::take(f1),
+                 token = currentStopToken(), r = currentResource()]
+                () mutable {
+                if (token.stopRequested())
+                  return;
+                bounce([c = std::move(c), f2 = std::move(f2),
+                        token = std::move(token), r] () mutable {
+                    StopScope scope(std::move(token));
+                    ResourceScope rscope(r);
+                    f2()(TracePolicy::stage("sequence", std::move(c)));
+                  });
+              });
+          }, std::forward<F>(f), std::forward<AA>(aa));
     }
   };
 
@@ -251,15 +598,15 @@ namespace async
   template <typename AT,
             // constraint: AT must be an Async<T>
             typename = async::FromAsyncT<AT>>
-  inline Async<Void> ignore(AT&& at)
+  inline auto ignore(AT&& at)
   {
-    using C = ContinuationT<Void>;
-    return [at1 = std::forward<AT>(at)]
-      (C&& cont)
-    {
-      at1([c = std::forward<C>(cont)] () {
-          c(Void()); });
-    };
+    return makeStage<Void>(
+        [] (auto& at1, auto&& cont)
+        {
+          using C = decltype(cont);
+          at1([c = std::forward<C>(cont)] () mutable {
+              c(Void()); });
+        }, std::forward<AT>(at));
   }
 
   // Run two Asyncs concurrently, joining their results with a function.
@@ -279,7 +626,7 @@ namespace async
                 typename function_traits<F>::template Arg<1>::type>::value, int> = 0>
   inline auto concurrently(AA&& aa, AB&& ab, F&& f)
   {
-    return apply(fmap(std::forward<F>(f), std::forward<AA>(aa)), std::forward<AB>(ab));
+    return async::apply(fmap(std::forward<F>(f), std::forward<AA>(aa)), std::forward<AB>(ab));
   }
 
   template <typename F, typename AA, typename AB, typename A, typename B>
@@ -326,63 +673,309 @@ namespace async
     }
   };
 
+  namespace detail
+  {
+    // Join state for when_all: the continuation, a slot for each result, and
+    // one atomic countdown. Each branch stores its result in place and counts
+    // down; the branch that brings the count to zero calls the continuation.
+    template <typename C, typename... T>
+    struct WhenAllData : TracePolicy::Node
+    {
+      explicit WhenAllData(C&& c)
+        : TracePolicy::Node("when_all"), cont(std::move(c)), arrived{},
+          remaining(sizeof...(T))
+      {}
+
+      ~WhenAllData() { destroy(std::index_sequence_for<T...>()); }
+
+      // Async<void> branches arrive with no argument, and store a Void
+      template <size_t I, typename... U>
+      inline void arrive(U&&... u)
+      {
+        TracePolicy::arrive(*this, I);
+        std::get<I>(slots).construct(std::forward<U>(u)...);
+        arrived[I] = true;
+        if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+          complete(std::index_sequence_for<T...>());
+      }
+
+      template <size_t... I>
+      inline void complete(std::index_sequence<I...>)
+      {
+        cont(std::tuple<T...>(std::move(std::get<I>(slots).get())...));
+      }
+
+      template <size_t... I>
+      inline void destroy(std::index_sequence<I...>)
+      {
+        // the flags are only written by each branch before it counts down, so
+        // they're visible to whoever releases the last reference
+        int dummy[] = { 0, (arrived[I] ? (std::get<I>(slots).destroy(), 0) : 0)... };
+        static_cast<void>(dummy);
+      }
+
+      C cont;
+      std::tuple<Slot<T>...> slots;
+      bool arrived[sizeof...(T)];
+      std::atomic<size_t> remaining;
+    };
+
+    template <typename D, typename Tuple, size_t... I>
+    inline void startAll(const std::shared_ptr<D>& pData, Tuple& asyncs,
+                         std::index_sequence<I...>)
+    {
+      int dummy[] = { 0, (std::get<I>(asyncs)([pData] (auto&&... t) {
+            pData->template arrive<I>(std::forward<decltype(t)>(t)...);
+          }), 0)... };
+      static_cast<void>(dummy);
+    }
+
+    // The results of a join over a range, in order. They're written straight
+    // into the vector that is delivered, which is allocated up front, so that
+    // completing the join costs nothing more. Branches write their own elements
+    // concurrently, which a vector<bool> can't allow, and the elements must
+    // exist beforehand; so for bool, or a T that can't be default-constructed
+    // and assigned, each result is instead held in a Slot and moved out at the
+    // end.
+    template <typename T,
+              bool InPlace = std::is_default_constructible<T>::value &&
+                             std::is_move_assignable<T>::value &&
+                             !std::is_same<T, bool>::value>
+    struct RangeResults
+    {
+      explicit RangeResults(size_t n) : values(n) {}
+
+      inline void set(size_t) {}
+
+      template <typename U>
+      inline void set(size_t i, U&& u) { values[i] = std::forward<U>(u); }
+
+      inline std::vector<T> release() { return std::move(values); }
+
+      std::vector<T> values;
+    };
+
+    template <typename T>
+    struct RangeResults<T, false>
+    {
+      struct Result
+      {
+        Slot<T> value;
+        bool arrived = false;
+      };
+
+      explicit RangeResults(size_t n)
+        : results(n, ResourceAllocator<Result>(currentResource()))
+      {}
+
+      ~RangeResults()
+      {
+        for (size_t i = 0; i < results.size(); ++i)
+          if (results[i].arrived)
+            results[i].value.destroy();
+      }
+
+      template <typename... U>
+      inline void set(size_t i, U&&... u)
+      {
+        results[i].value.construct(std::forward<U>(u)...);
+        results[i].arrived = true;
+      }
+
+      inline std::vector<T> release()
+      {
+        std::vector<T> v;
+        v.reserve(results.size());
+        for (size_t i = 0; i < results.size(); ++i)
+          v.push_back(std::move(results[i].value.get()));
+        return v;
+      }
+
+      std::vector<Result, ResourceAllocator<Result>> results;
+    };
+
+    // The same for a range of Asyncs of the same type.
+    template <typename C, typename T>
+    struct WhenAllRangeData : TracePolicy::Node
+    {
+      WhenAllRangeData(C&& c, size_t n)
+        : TracePolicy::Node("when_all"), cont(std::move(c)), results(n),
+          remaining(n)
+      {}
+
+      template <typename... U>
+      inline void arrive(size_t i, U&&... u)
+      {
+        TracePolicy::arrive(*this, static_cast<unsigned>(i));
+        results.set(i, std::forward<U>(u)...);
+        if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+          cont(results.release());
+      }
+
+      C cont;
+      RangeResults<T> results;
+      std::atomic<size_t> remaining;
+    };
+  }
+
+  // Run any number of Asyncs concurrently, collecting their results in a
+  // tuple. Async<void> results are represented as Void. Unlike chaining
+  // operator&&, this is a single join with one shared countdown, and the
+  // results are stored in place until the last one arrives.
+  template <typename... AA,
+            // constraint: each AA must be an Async
+            typename = std::tuple<FromAsyncT<AA>...>>
+  inline auto when_all(AA&&... aa)
+  {
+    static_assert(sizeof...(AA) > 0, "when_all needs at least one Async");
+    using R = std::tuple<IgnoreVoidT<FromAsyncT<AA>>...>;
+
+    return makeStage<R>(
+        [] (auto& asyncs, auto&& cont)
+        {
+          using C = std::decay_t<decltype(cont)>;
+          using D = detail::WhenAllData<C, IgnoreVoidT<FromAsyncT<AA>>...>;
+          std::shared_ptr<D> pData =
+            allocateShared<D>(std::forward<decltype(cont)>(cont));
+          detail::startAll(pData, asyncs, std::index_sequence_for<AA...>());
+        }, std::make_tuple(std::forward<AA>(aa)...));
+  }
+
+  // Run a range of Asyncs of the same type concurrently, collecting their
+  // results in order.
+  template <typename AA,
+            // constraint: AA must be an Async<A>
+            typename A = FromAsyncT<AA>>
+  inline auto when_all(std::vector<AA> asyncs)
+  {
+    using T = IgnoreVoidT<A>;
+
+    return makeStage<std::vector<T>>(
+        [] (auto& asyncs, auto&& cont)
+        {
+          if (asyncs.empty())
+            return cont(std::vector<T>());
+
+          using C = std::decay_t<decltype(cont)>;
+          using D = detail::WhenAllRangeData<C, T>;
+          std::shared_ptr<D> pData = allocateShared<D>(
+              std::forward<decltype(cont)>(cont), asyncs.size());
+          for (size_t i = 0; i < asyncs.size(); ++i)
+          {
+            asyncs[i]([pData, i] (auto&&... t) {
+                pData->arrive(i, std::forward<decltype(t)>(t)...);
+              });
+          }
+        }, std::move(asyncs));
+  }
+
+  namespace detail
+  {
+    // Shared state for race (and when_any): the continuation, the stop state
+    // for the branches, and one atomic first-wins flag, all in one allocation.
+    // The stop state is handed out through shared_ptrs that alias the whole
+    // block.
+    template <typename C>
+    struct RaceData : TracePolicy::Node
+    {
+      RaceData(C&& c, const char* name)
+        : TracePolicy::Node(name), cont(std::move(c)),
+          outer(currentStopToken()), done(false)
+      {}
+
+      // true for exactly one caller: the winner
+      inline bool claim(unsigned branch)
+      {
+        bool won = !done.exchange(true, std::memory_order_acq_rel);
+        if (won)
+          TracePolicy::win(*this, branch);
+        else
+          TracePolicy::lose(*this, branch);
+        return won;
+      }
+
+      // the winner stops the other branches, then calls the continuation under
+      // the token that was current outside the race
+      template <typename R>
+      inline void win(R&& r)
+      {
+        stopState.requestStop();
+        StopScope scope(std::move(outer));
+        cont(std::forward<R>(r));
+      }
+
+      C cont;
+      StopToken outer;
+      StopState stopState;
+      StopCallback link;
+      std::atomic<bool> done;
+    };
+
+    // Race state D (a RaceData, or join state built on one, as in result.h)
+    // whose stop state is linked to the current token, and a token for it that
+    // keeps the whole block alive.
+    template <typename D, typename... Args>
+    inline std::shared_ptr<D> makeRaceData(Args&&... args)
+    {
+      auto pData = allocateShared<D>(std::forward<Args>(args)...);
+      pData->link = linkToCurrent(
+          std::shared_ptr<StopState>(pData, &pData->stopState));
+      return pData;
+    }
+
+    template <typename D>
+    inline StopToken raceToken(const std::shared_ptr<D>& pData)
+    {
+      return StopToken(std::shared_ptr<StopState>(pData, &pData->stopState));
+    }
+  }
+
   // The zero element of the Async monoid. It never calls its continuation.
   template <typename T = Void>
-  inline Async<T> zero()
+  inline auto zero()
   {
-    return [] (ContinuationT<T>) {};
+    return makeAsyncOp<T>([] (auto&&) {});
   }
 
   // Race two Asyncs: call the continuation with the result of the first one
-  // that completes. Problem: how to cancel the other one, how to clean up in
-  // case of ORing with zero.
+  // that completes. Both sides are started under a stop token that is stopped
+  // as soon as there is a winner (or when the enclosing token is), so the loser
+  // can abandon its work; if the first side wins immediately, the second isn't
+  // started at all.
   template <typename AA, typename AB,
             // constraint: AA must be an Async<A>, AB must be an Async<B>
             typename A = FromAsyncT<AA>, typename B = FromAsyncT<AB>>
-  inline Async<Either<A,B>> race(AA&& aa, AB&& ab)
+  inline auto race(AA&& aa, AB&& ab)
   {
-    struct Data
-    {
-      Data() : done(false) {}
-      bool done;
-      std::mutex m;
-    };
-    std::shared_ptr<Data> pData = std::make_shared<Data>();
+    return makeStage<Either<A,B>>(
+        [] (auto& aa1, auto& ab1, auto&& cont)
+        {
+          using C = std::decay_t<decltype(cont)>;
+          auto pData = detail::makeRaceData<detail::RaceData<C>>(
+              std::forward<decltype(cont)>(cont), "race");
+          StopScope scope(detail::raceToken(pData));
 
-    using C = ContinuationT<Either<A,B>>;
-    return [pData, aa1 = std::forward<AA>(aa), ab1 = std::forward<AB>(ab)]
-      (C&& cont)
-    {
-      aa1([pData, c = std::forward<C>(cont)] (A&& a) {
-          bool done = false;
-          {
-            std::lock_guard<std::mutex> g(pData->m);
-            done = pData->done;
-            pData->done = true;
-          }
-          if (!done)
-            c(Either<A,B>(std::forward<A>(a), true));
-        });
+          aa1([pData] (A&& a) {
+              if (pData->claim(0))
+                pData->win(Either<A,B>(std::forward<A>(a), true));
+            });
 
-      ab1([pData, c = std::forward<C>(cont)] (B&& b) {
-          bool done = false;
-          {
-            std::lock_guard<std::mutex> g(pData->m);
-            done = pData->done;
-            pData->done = true;
-          }
-          if (!done)
-            c(Either<A,B>(std::forward<B>(b)));
-        });
-    };
+          if (pData->stopState.stopRequested())
+            return;
+
+          ab1([pData = std::move(pData)] (B&& b) {
+              if (pData->claim(1))
+                pData->win(Either<A,B>(std::forward<B>(b)));
+            });
+        }, std::forward<AA>(aa), std::forward<AB>(ab));
   }
 
   template <typename AA, typename AB, typename A, typename B>
   struct runRace
   {
-    inline Async<Either<A,B>> operator()(AA&& aa, AB&& ab)
+    inline auto operator()(AA&& aa, AB&& ab)
     {
-      return race<AA, AB>(
+      return race(
           std::forward<AA>(aa), std::forward<AB>(ab));
     }
   };
@@ -390,9 +983,9 @@ namespace async
   template <typename AA, typename AB, typename A>
   struct runRace<AA, AB, A, void>
   {
-    inline Async<Either<A,Void>> operator()(AA&& aa, AB&& ab)
+    inline auto operator()(AA&& aa, AB&& ab)
     {
-      return race<AA, Async<Void>>(
+      return race(
           std::forward<AA>(aa), ignore(std::forward<AB>(ab)));
     }
   };
@@ -400,9 +993,9 @@ namespace async
   template <typename AA, typename AB, typename B>
   struct runRace<AA, AB, void, B>
   {
-    inline Async<Either<Void, B>> operator()(AA&& aa, AB&& ab)
+    inline auto operator()(AA&& aa, AB&& ab)
     {
-      return race<Async<Void>, AB>(
+      return race(
           ignore(std::forward<AA>(aa)), std::forward<AB>(ab));
     }
   };
@@ -410,12 +1003,114 @@ namespace async
   template <typename AA, typename AB>
   struct runRace<AA, AB, void, void>
   {
-    inline Async<Either<Void, Void>> operator()(AA&& aa, AB&& ab)
+    inline auto operator()(AA&& aa, AB&& ab)
     {
-      return race<Async<Void>, Async<Void>>(
+      return race(
           ignore(std::forward<AA>(aa)), ignore(std::forward<AB>(ab)));
     }
   };
+
+  namespace detail
+  {
+    // Start each branch of a when_any in order, stopping early if one of them
+    // wins immediately. Async<void> branches win with a Void.
+    template <typename R, typename D, typename Tuple, size_t... I>
+    inline void startAny(const std::shared_ptr<D>& pData, Tuple& asyncs,
+                         std::index_sequence<I...>)
+    {
+      bool dummy[] = { true, (!pData->stopState.stopRequested() &&
+        (std::get<I>(asyncs)([pData] (auto&&... t) {
+            if (pData->claim(I))
+              pData->win(R(InPlaceIndex<I>(), std::forward<decltype(t)>(t)...));
+          }), true))... };
+      static_cast<void>(dummy);
+    }
+  }
+
+  // Race any number of Asyncs: call the continuation with a OneOf holding the
+  // result of the first one that completes, tagged with its index. All the
+  // branches share one first-wins flag and one stop token, which is stopped as
+  // soon as there is a winner, as with race.
+  template <typename... AA,
+            // constraint: each AA must be an Async
+            typename = std::tuple<FromAsyncT<AA>...>>
+  inline auto when_any(AA&&... aa)
+  {
+    static_assert(sizeof...(AA) > 0, "when_any needs at least one Async");
+    using R = OneOf<IgnoreVoidT<FromAsyncT<AA>>...>;
+
+    return makeStage<R>(
+        [] (auto& asyncs, auto&& cont)
+        {
+          using C = std::decay_t<decltype(cont)>;
+          auto pData = detail::makeRaceData<detail::RaceData<C>>(
+              std::forward<decltype(cont)>(cont), "when_any");
+          StopScope scope(detail::raceToken(pData));
+          detail::startAny<R>(pData, asyncs, std::index_sequence_for<AA...>());
+        }, std::make_tuple(std::forward<AA>(aa)...));
+  }
+
+  // Race a range of Asyncs of the same type: call the continuation with the
+  // index and result of the first one that completes. An empty range never
+  // completes, like zero.
+  template <typename AA,
+            // constraint: AA must be an Async<A>
+            typename A = FromAsyncT<AA>>
+  inline auto when_any(std::vector<AA> asyncs)
+  {
+    using T = IgnoreVoidT<A>;
+    using R = std::pair<size_t, T>;
+
+    return makeStage<R>(
+        [] (auto& asyncs, auto&& cont)
+        {
+          using C = std::decay_t<decltype(cont)>;
+          auto pData = detail::makeRaceData<detail::RaceData<C>>(
+              std::forward<decltype(cont)>(cont), "when_any");
+          StopScope scope(detail::raceToken(pData));
+          for (size_t i = 0;
+               i < asyncs.size() && !pData->stopState.stopRequested(); ++i)
+          {
+            asyncs[i]([pData, i] (auto&&... t) {
+                if (pData->claim(static_cast<unsigned>(i)))
+                  pData->win(R(i, T(std::forward<decltype(t)>(t)...)));
+              });
+          }
+        }, std::move(asyncs));
+  }
+
+  // Start an Async with a memory resource current: the join state of the
+  // combinators inside it, and any continuations they box, are allocated from
+  // it, including in the stages that bind and sequence start later on other
+  // threads. The resource must outlive the Async's execution. (Erasing the
+  // Async itself allocates when it's built; use a ResourceScope for that.)
+  template <typename AA,
+            // constraint: AA must be an Async<A>
+            typename A = FromAsyncT<AA>>
+  inline auto with_allocator(MemoryResource& r, AA&& aa)
+  {
+    return makeStage<A>(
+        [] (auto& r, auto& aa1, auto&& cont)
+        {
+          ResourceScope scope(r);
+          aa1(std::forward<decltype(cont)>(cont));
+        }, &r, std::forward<AA>(aa));
+  }
+
+  // Mark an Async as a stage of its own for tracing, from when it's started to
+  // when it calls its continuation. The policy defaults to the library's (see
+  // trace.h), but needn't be the same.
+  template <typename Policy = TracePolicy, typename AA,
+            // constraint: AA must be an Async<A>
+            typename A = FromAsyncT<AA>>
+  inline auto traced(const char* name, AA&& aa)
+  {
+    return makeStage<A>(
+        [] (auto& name, auto& aa1, auto&& cont)
+        {
+          aa1(Policy::stage(name, std::forward<decltype(cont)>(cont)));
+        }, name, std::forward<AA>(aa));
+  }
 }
 
 // Syntactic sugar: >= is Haskell's >>=, and > is Haskell's >>.
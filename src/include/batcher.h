@@ -0,0 +1,191 @@
+#pragma once
+
+#include "async.h"
+#include "cancellation.h"
+#include "executor.h"
+#include "timer.h"
+#include "unique_function.h"
+
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Coalescing independent lookups into bulk requests.
+//
+// A Batcher wraps a bulk loader (a function from a vector of keys to an
+// Async<vector<V>> of the same length and order) and hands out an Async<V> per
+// key. Keys requested until the batch reaches its size cap, or until its window
+// closes, go to the loader together, and each value is passed back to the
+// continuation that asked for its key. The window starts when the first key of
+// a batch arrives, and is timed on a TimerWheel.
+//
+// A batch is sent from whichever thread fills it. If its window closes first,
+// the wheel's thread only takes the batch, and hands it to the executor the
+// Batcher was given to send: a slow loader, or a loader whose continuations run
+// inline, would otherwise hold up every other timer on the wheel. So the loader
+// may be called from several threads at once. It runs under an empty stop token
+// and on the global heap, since it serves many requests. A batch still open
+// when the Batcher is destroyed is sent then.
+
+namespace async
+{
+  template <typename K, typename V>
+  class Batcher
+  {
+  public:
+    using Loader = UniqueFunction<Async<std::vector<V>> (std::vector<K>)>;
+    using Clock = TimerWheel::Clock;
+
+    // batches whose windows close are sent on ex, which must outlive the
+    // Batcher
+    template <typename E,
+              // constraint: E is an executor
+              std::enable_if_t<IsExecutor<E>::value, int> = 0>
+    Batcher(E& ex, Loader loader, size_t maxBatch = 64,
+            Clock::duration window = std::chrono::milliseconds(1),
+            TimerWheel& wheel = defaultTimerWheel())
+      : m_state(std::make_shared<State>(
+                  [ex = &ex] (UniqueFunction<void ()> f) {
+                    ex->execute(std::move(f));
+                  },
+                  std::move(loader), maxBatch, window, wheel))
+    {}
+
+    ~Batcher()
+    {
+      if (m_state)
+        flush();
+    }
+
+    Batcher(Batcher&&) = default;
+    Batcher(const Batcher&) = delete;
+    Batcher& operator=(const Batcher&) = delete;
+
+    // An Async for one key's value. Each invocation requests the key again.
+    auto load(K key) const
+    {
+      return makeAsyncOp<V>(
+          [s = m_state, key = std::move(key)] (auto&& cont)
+          {
+            enqueue(s, K(key), ContinuationT<V>(std::forward<decltype(cont)>(cont)));
+          });
+    }
+
+    // Send the open batch now, without waiting for its window.
+    void flush()
+    {
+      Batch ready;
+      {
+        std::lock_guard<std::mutex> g(m_state->mutex);
+        ready = take(*m_state);
+      }
+      dispatch(*m_state, std::move(ready));
+    }
+
+  private:
+    struct Batch
+    {
+      std::vector<K> keys;
+      std::vector<ContinuationT<V>> waiters;
+      // stops the window's timer if the batch is sent before it fires
+      std::shared_ptr<StopState> window;
+    };
+
+    struct State
+    {
+      State(UniqueFunction<void (UniqueFunction<void ()>)> d, Loader l,
+            size_t max, Clock::duration w, TimerWheel& tw)
+        : post(std::move(d)), loader(std::move(l)), maxBatch(max ? max : 1)
+        , window(w), wheel(&tw)
+      {}
+
+      UniqueFunction<void (UniqueFunction<void ()>)> post;
+      Loader loader;
+      const size_t maxBatch;
+      const Clock::duration window;
+      TimerWheel* const wheel;
+
+      std::mutex mutex;
+      Batch open;
+      // counts the batches sent
+      uint64_t generation = 0;
+    };
+
+    static Batch take(State& s)
+    {
+      Batch b = std::move(s.open);
+      s.open = Batch();
+      ++s.generation;
+      return b;
+    }
+
+    static void enqueue(const std::shared_ptr<State>& s, K&& key,
+                        ContinuationT<V>&& cont)
+    {
+      Batch ready;
+      std::shared_ptr<StopState> window;
+      uint64_t generation = 0;
+      {
+        std::lock_guard<std::mutex> g(s->mutex);
+        s->open.keys.push_back(std::move(key));
+        s->open.waiters.push_back(std::move(cont));
+        if (s->open.keys.size() >= s->maxBatch)
+          ready = take(*s);
+        else if (s->open.keys.size() == 1)
+        {
+          window = s->open.window = std::make_shared<StopState>();
+          generation = s->generation;
+        }
+      }
+
+      // The timer may lose a race with a full batch, so it checks that its own
+      // batch is still open.
+      if (window)
+      {
+        std::weak_ptr<State> weak = s;
+        s->wheel->schedule(s->window, [weak, generation] () {
+            if (auto state = weak.lock())
+            {
+              Batch expired;
+              {
+                std::lock_guard<std::mutex> g(state->mutex);
+                if (state->generation != generation)
+                  return;
+                expired = take(*state);
+              }
+              state->post([state, b = std::move(expired)] () mutable {
+                  dispatch(*state, std::move(b));
+                });
+            }
+          }, StopSource(std::move(window)).token());
+      }
+      dispatch(*s, std::move(ready));
+    }
+
+    // One bulk call; its results are scattered back by index.
+    static void dispatch(State& s, Batch&& b)
+    {
+      if (b.window)
+        StopSource(std::move(b.window)).requestStop();
+      if (b.keys.empty())
+        return;
+
+      StopScope scope{StopToken()};
+      ResourceScope rscope(nullptr);
+      s.loader(std::move(b.keys))(
+          [waiters = std::move(b.waiters)] (std::vector<V> values) mutable {
+            assert(values.size() == waiters.size() &&
+                   "a Batcher's loader must return one value per key");
+            for (size_t i = 0; i < waiters.size(); ++i)
+              waiters[i](std::move(values[i]));
+          });
+    }
+
+    std::shared_ptr<State> m_state;
+  };
+}
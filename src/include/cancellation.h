@@ -0,0 +1,233 @@
+#pragma once
+
+#include "unique_function.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Cooperative cancellation for Asyncs.
+//
+// A StopSource can request a stop; StopTokens observe it, and StopCallbacks
+// register a function to be called when it happens. Tokens are threaded through
+// Async execution implicitly: the token in effect while an Async is being
+// started is available from async::currentStopToken(), so a leaf Async can
+// capture it when it's invoked and then check it, or register a StopCallback to
+// abandon its work. Combinators that start an Async from inside a continuation
+// (bind and sequence) reinstate the token that was current when they were
+// started, and race gives its branches a token that it stops once a winner is
+// known.
+
+namespace async
+{
+  // The state shared by a StopSource and its tokens.
+  class StopState
+  {
+  public:
+    StopState() : m_stopped(false), m_nextId(1) {}
+
+    bool stopRequested() const
+    {
+      return m_stopped.load(std::memory_order_acquire);
+    }
+
+    // Returns true if this call made the request. The callbacks are run on the
+    // requesting thread, outside the lock.
+    bool requestStop()
+    {
+      std::vector<std::pair<size_t, UniqueFunction<void ()>>> callbacks;
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        if (m_stopped.load(std::memory_order_relaxed))
+          return false;
+        m_stopped.store(true, std::memory_order_release);
+        callbacks.swap(m_callbacks);
+      }
+      for (auto& c : callbacks)
+        c.second();
+      return true;
+    }
+
+    // Returns an id for removal, or 0 if the stop was already requested, in
+    // which case f has been called immediately.
+    size_t addCallback(UniqueFunction<void ()>&& f)
+    {
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        if (!m_stopped.load(std::memory_order_relaxed))
+        {
+          size_t id = m_nextId++;
+          m_callbacks.emplace_back(id, std::move(f));
+          return id;
+        }
+      }
+      f();
+      return 0;
+    }
+
+    void removeCallback(size_t id)
+    {
+      std::lock_guard<std::mutex> g(m_mutex);
+      auto i = std::find_if(m_callbacks.begin(), m_callbacks.end(),
+                            [id] (const auto& c) { return c.first == id; });
+      if (i != m_callbacks.end())
+        m_callbacks.erase(i);
+    }
+
+  private:
+    std::atomic<bool> m_stopped;
+    std::mutex m_mutex;
+    std::vector<std::pair<size_t, UniqueFunction<void ()>>> m_callbacks;
+    size_t m_nextId;
+  };
+
+  // Observes a StopSource. A default-constructed token can never be stopped,
+  // and costs nothing to copy.
+  class StopToken
+  {
+  public:
+    StopToken() = default;
+    explicit StopToken(std::shared_ptr<StopState> state)
+      : m_state(std::move(state))
+    {}
+
+    bool stopPossible() const { return static_cast<bool>(m_state); }
+    bool stopRequested() const { return m_state && m_state->stopRequested(); }
+
+    const std::shared_ptr<StopState>& state() const { return m_state; }
+
+  private:
+    std::shared_ptr<StopState> m_state;
+  };
+
+  class StopSource
+  {
+  public:
+    StopSource() : m_state(std::make_shared<StopState>()) {}
+    explicit StopSource(std::shared_ptr<StopState> state)
+      : m_state(std::move(state))
+    {}
+
+    StopToken token() const { return StopToken(m_state); }
+    bool stopRequested() const { return m_state->stopRequested(); }
+    bool requestStop() const { return m_state->requestStop(); }
+
+  private:
+    std::shared_ptr<StopState> m_state;
+  };
+
+  // Calls a function when a stop is requested on a token, for as long as the
+  // StopCallback exists. If the stop has already been requested, the function
+  // is called from the constructor. Note that a callback may already be running
+  // on another thread when the StopCallback is destroyed, so it should only
+  // capture things it owns.
+  class StopCallback
+  {
+  public:
+    StopCallback() = default;
+
+    template <typename F>
+    StopCallback(const StopToken& token, F&& f)
+    {
+      if (token.stopPossible())
+      {
+        m_state = token.state();
+        m_id = m_state->addCallback(std::forward<F>(f));
+      }
+    }
+
+    StopCallback(StopCallback&& other) noexcept
+      : m_state(std::move(other.m_state)), m_id(other.m_id)
+    {
+      other.m_id = 0;
+    }
+
+    StopCallback& operator=(StopCallback&& other) noexcept
+    {
+      if (this != &other)
+      {
+        reset();
+        m_state = std::move(other.m_state);
+        m_id = other.m_id;
+        other.m_id = 0;
+      }
+      return *this;
+    }
+
+    ~StopCallback() { reset(); }
+
+  private:
+    void reset()
+    {
+      if (m_id)
+        m_state->removeCallback(m_id);
+      m_state.reset();
+      m_id = 0;
+    }
+
+    std::shared_ptr<StopState> m_state;
+    size_t m_id = 0;
+  };
+
+  namespace detail
+  {
+    inline StopToken& currentStopTokenRef()
+    {
+      thread_local StopToken t;
+      return t;
+    }
+  }
+
+  // The token in effect for Asyncs being started on this thread.
+  inline StopToken currentStopToken()
+  {
+    return detail::currentStopTokenRef();
+  }
+
+  // Makes a token current for the lifetime of the scope.
+  class StopScope
+  {
+  public:
+    explicit StopScope(StopToken token)
+      : m_saved(std::move(detail::currentStopTokenRef()))
+    {
+      detail::currentStopTokenRef() = std::move(token);
+    }
+
+    ~StopScope()
+    {
+      detail::currentStopTokenRef() = std::move(m_saved);
+    }
+
+    StopScope(const StopScope&) = delete;
+    StopScope& operator=(const StopScope&) = delete;
+
+  private:
+    StopToken m_saved;
+  };
+
+  // Arranges for a stop to be requested on child when one is requested on the
+  // current token, for as long as the returned StopCallback exists. Only a weak
+  // reference to the child is kept.
+  inline StopCallback linkToCurrent(const std::shared_ptr<StopState>& child)
+  {
+    std::weak_ptr<StopState> weakChild = child;
+    return StopCallback(currentStopToken(), [weakChild] () {
+        if (auto s = weakChild.lock())
+          s->requestStop();
+      });
+  }
+
+  // Makes a StopSource that is also stopped when the current token is; the
+  // returned StopCallback keeps the link alive.
+  inline std::pair<StopSource, StopCallback> linkedStopSource()
+  {
+    StopSource source;
+    StopCallback link = linkToCurrent(source.token().state());
+    return std::make_pair(std::move(source), std::move(link));
+  }
+}
@@ -2,147 +2,278 @@
 
 #include "function_traits.h"
 
+#include <new>
+#include <type_traits>
+#include <utility>
+
 //------------------------------------------------------------------------------
 // The either monad
 
+// The storage for an Either is chosen by what its alternatives need. When both
+// are trivially copyable, so is the Either: its special members are the
+// defaulted ones, and it can be passed in registers and moved with memcpy. When
+// both are also empty (like Either<Void, Void>), there is nothing to store but
+// the tag. Otherwise the special members are written out to construct, assign
+// and destroy the active alternative. In every case the tag is one byte.
+
+namespace either
+{
+  namespace detail
+  {
+    enum class Tag : unsigned char { LEFT, RIGHT };
+
+    struct InLeft {};
+    struct InRight {};
+
+    enum class StorageKind { EMPTY, TRIVIAL, GENERAL };
+
+    template <typename L, typename R>
+    using IsTrivialPair = std::integral_constant<
+      bool,
+      std::is_trivially_copyable<L>::value && std::is_trivially_copyable<R>::value>;
+
+    template <typename L, typename R>
+    using StorageKindOf = std::integral_constant<
+      StorageKind,
+      !IsTrivialPair<L, R>::value ? StorageKind::GENERAL :
+      std::is_empty<L>::value && std::is_empty<R>::value &&
+      std::is_default_constructible<L>::value &&
+      std::is_default_constructible<R>::value ? StorageKind::EMPTY :
+      StorageKind::TRIVIAL>;
+
+    template <typename L, typename R, StorageKind K = StorageKindOf<L, R>::value>
+    struct EitherStorage;
+
+    // Both alternatives are empty and trivial, so any value of either is as
+    // good as any other: the members are shared, and only the tag is stored.
+    template <typename L, typename R>
+    struct EitherStorage<L, R, StorageKind::EMPTY>
+    {
+      template <typename... Args>
+      explicit EitherStorage(InLeft, Args&&...) noexcept : m_tag(Tag::LEFT) {}
+      template <typename... Args>
+      explicit EitherStorage(InRight, Args&&...) noexcept : m_tag(Tag::RIGHT) {}
+
+      bool isRight() const { return m_tag == Tag::RIGHT; }
+
+      Tag m_tag;
+      static L m_left;
+      static R m_right;
+    };
+
+    template <typename L, typename R>
+    L EitherStorage<L, R, StorageKind::EMPTY>::m_left;
+
+    template <typename L, typename R>
+    R EitherStorage<L, R, StorageKind::EMPTY>::m_right;
+
+    // Both alternatives are trivially copyable: so is the union, and the
+    // implicit special members do the right thing.
+    template <typename L, typename R>
+    struct EitherStorage<L, R, StorageKind::TRIVIAL>
+    {
+      template <typename... Args>
+      explicit EitherStorage(InLeft, Args&&... args)
+        : m_tag(Tag::LEFT), m_left(std::forward<Args>(args)...)
+      {}
+
+      template <typename... Args>
+      explicit EitherStorage(InRight, Args&&... args)
+        : m_tag(Tag::RIGHT), m_right(std::forward<Args>(args)...)
+      {}
+
+      bool isRight() const { return m_tag == Tag::RIGHT; }
+
+      Tag m_tag;
+      union
+      {
+        L m_left;
+        R m_right;
+      };
+    };
+
+    template <typename L, typename R>
+    struct EitherStorage<L, R, StorageKind::GENERAL>
+    {
+      template <typename... Args>
+      explicit EitherStorage(InLeft, Args&&... args)
+        : m_tag(Tag::LEFT), m_left(std::forward<Args>(args)...)
+      {}
+
+      template <typename... Args>
+      explicit EitherStorage(InRight, Args&&... args)
+        : m_tag(Tag::RIGHT), m_right(std::forward<Args>(args)...)
+      {}
+
+      // copy constructor
+      EitherStorage(const EitherStorage& other)
+        noexcept(std::is_nothrow_copy_constructible<L>() &&
+                 std::is_nothrow_copy_constructible<R>())
+        : m_tag(other.m_tag)
+      {
+        if (other.isRight())
+          new (&m_right) R(other.m_right);
+        else
+          new (&m_left) L(other.m_left);
+      }
+
+      // move constructor
+      EitherStorage(EitherStorage&& other)
+        noexcept(std::is_nothrow_move_constructible<L>() &&
+                 std::is_nothrow_move_constructible<R>())
+        : m_tag(other.m_tag)
+      {
+        if (other.isRight())
+          new (&m_right) R(std::move(other.m_right));
+        else
+          new (&m_left) L(std::move(other.m_left));
+      }
+
+      // copy assignment
+      EitherStorage& operator=(const EitherStorage& other)
+        noexcept(std::is_nothrow_copy_assignable<L>() &&
+                 std::is_nothrow_copy_assignable<R>() &&
+                 std::is_nothrow_copy_constructible<L>() &&
+                 std::is_nothrow_copy_constructible<R>() &&
+                 std::is_nothrow_move_constructible<L>() &&
+                 std::is_nothrow_move_constructible<R>())
+      {
+        // if the tags match, a plain copy of the data member
+        if (isRight() == other.isRight())
+        {
+          if (isRight())
+            m_right = other.m_right;
+          else
+            m_left = other.m_left;
+          return *this;
+        }
+
+        // otherwise a copy is made first, so that if it throws, *this is
+        // unchanged, and moved in
+        EitherStorage tmp(other);
+        return *this = std::move(tmp);
+      }
+
+      // move assignment
+      EitherStorage& operator=(EitherStorage&& other)
+        noexcept(std::is_nothrow_move_assignable<L>() &&
+                 std::is_nothrow_move_assignable<R>() &&
+                 std::is_nothrow_move_constructible<L>() &&
+                 std::is_nothrow_move_constructible<R>())
+      {
+        // if the tags match, a plain move of the data member
+        if (isRight() == other.isRight())
+        {
+          if (isRight())
+            m_right = std::move(other.m_right);
+          else
+            m_left = std::move(other.m_left);
+          return *this;
+        }
+
+        if (other.isRight())
+          replace(m_left, m_right, Tag::RIGHT, std::move(other.m_right));
+        else
+          replace(m_right, m_left, Tag::LEFT, std::move(other.m_left));
+        return *this;
+      }
+
+      ~EitherStorage() { destroy(); }
+
+      bool isRight() const { return m_tag == Tag::RIGHT; }
+
+      Tag m_tag;
+      union
+      {
+        L m_left;
+        R m_right;
+      };
+
+    private:
+      void destroy()
+      {
+        if (isRight())
+          m_right.~R();
+        else
+          m_left.~L();
+      }
+
+      // Replace the active member, old, with the other one, moved from value.
+      // If that move can throw, old is moved aside first, and put back if it
+      // does, so that there's always a member for the destructor to destroy.
+      template <typename Old, typename New>
+      void replace(Old& old, New& slot, Tag tag, New&& value)
+      {
+        replace(old, slot, tag, std::move(value),
+                std::is_nothrow_move_constructible<New>());
+      }
+
+      template <typename Old, typename New>
+      void replace(Old& old, New& slot, Tag tag, New&& value, std::true_type)
+      {
+        old.~Old();
+        new (&slot) New(std::move(value));
+        m_tag = tag;
+      }
+
+      template <typename Old, typename New>
+      void replace(Old& old, New& slot, Tag tag, New&& value, std::false_type)
+      {
+        Old backup(std::move(old));
+        old.~Old();
+        try
+        {
+          new (&slot) New(std::move(value));
+        }
+        catch (...)
+        {
+          restore(old, std::move(backup));
+          throw;
+        }
+        m_tag = tag;
+      }
+
+      // With nothing to fall back on, a throw here terminates.
+      template <typename T>
+      static void restore(T& slot, T&& backup) noexcept
+      {
+        new (&slot) T(std::move(backup));
+      }
+    };
+  }
+}
+
 template <typename Left, typename Right>
-struct Either
+struct Either : either::detail::EitherStorage<Left, Right>
 {
   using L = Left;
   using R = Right;
+  using Tag = either::detail::Tag;
+  using Storage = either::detail::EitherStorage<Left, Right>;
 
   // copy construct from a right value
   explicit Either(const R& r)
     noexcept(std::is_nothrow_copy_constructible<R>())
-    : m_tag(Tag::RIGHT)
-    , m_right(r)
+    : Storage(either::detail::InRight(), r)
   {}
 
   // move construct from a right value
   explicit Either(R&& r)
     noexcept(std::is_nothrow_move_constructible<R>())
-    : m_tag(Tag::RIGHT)
-    , m_right(std::move(r))
+    : Storage(either::detail::InRight(), std::move(r))
   {}
 
   // copy construct from a left value
   Either(const L& l, bool)
     noexcept(std::is_nothrow_copy_constructible<L>())
-    : m_tag(Tag::LEFT)
-    , m_left(l)
+    : Storage(either::detail::InLeft(), l)
   {}
 
   // move construct from a left value
   Either(L&& l, bool)
     noexcept(std::is_nothrow_move_constructible<L>())
-    : m_tag(Tag::LEFT)
-    , m_left(std::move(l))
+    : Storage(either::detail::InLeft(), std::move(l))
   {}
-
-  // copy constructor
-  Either(const Either& other)
-    noexcept(std::is_nothrow_copy_constructible<L>() &&
-             std::is_nothrow_copy_constructible<R>())
-    : m_tag(other.m_tag)
-  {
-    if (other.isRight())
-      new (&m_right) R(other.m_right);
-    else
-      new (&m_left) L(other.m_left);
-  }
-
-  // move constructor
-  Either(const Either&& other)
-    noexcept(std::is_nothrow_move_constructible<L>() &&
-             std::is_nothrow_move_constructible<R>())
-    : m_tag(other.m_tag)
-  {
-    if (other.isRight())
-      new (&m_right) R(std::move(other.m_right));
-    else
-      new (&m_left) L(std::move(other.m_left));
-  }
-
-  // copy assignment
-  Either& operator=(const Either& other)
-    noexcept(std::is_nothrow_copy_assignable<L>() &&
-             std::is_nothrow_copy_assignable<R>() &&
-             std::is_nothrow_copy_constructible<L>() &&
-             std::is_nothrow_copy_constructible<R>())
-  {
-    // if the tags match, a plain copy of the data member
-    if (isRight() == other.isRight())
-    {
-      if (isRight())
-        m_right = other.m_right;
-      else
-        m_left = other.m_left;
-      return *this;
-    }
-
-    // explicit deletion
-    if (isRight())
-      m_right.~R();
-    else
-      m_left.~L();
-
-    // placement new
-    m_tag = other.m_tag;
-    if (isRight())
-      new (&m_right) R(other.m_right);
-    else
-      new (&m_left) L(other.m_left);
-    return *this;
-  }
-
-  // move assignment
-  Either& operator=(Either&& other)
-    noexcept(std::is_nothrow_move_assignable<L>() &&
-             std::is_nothrow_move_assignable<R>() &&
-             std::is_nothrow_move_constructible<L>() &&
-             std::is_nothrow_move_constructible<R>())
-  {
-    // if the tags match, a plain copy of the data member
-    if (isRight() == other.isRight())
-    {
-      if (isRight())
-        m_right = std::move(other.m_right);
-      else
-        m_left = std::move(other.m_left);
-      return *this;
-    }
-
-    // explicit deletion
-    if (isRight())
-      m_right.~R();
-    else
-      m_left.~L();
-
-    // placement new
-    m_tag = other.m_tag;
-    if (isRight())
-      new (&m_right) R(std::move(other.m_right));
-    else
-      new (&m_left) L(std::move(other.m_left));
-    return *this;
-  }
-
-  ~Either()
-  {
-    if (isRight())
-      m_right.~R();
-    else
-      m_left.~L();
-  }
-
-  enum class Tag { LEFT, RIGHT } m_tag;
-  union
-  {
-    L m_left;
-    R m_right;
-  };
-
-  bool isRight() const { return m_tag == Tag::RIGHT; }
 };
 
 //------------------------------------------------------------------------------
@@ -168,6 +299,8 @@ bool operator!=(const Either<L, R>& a, const Either<L, R>& b)
 
 namespace either
 {
+  // The const& overloads copy the payload into the result; the && overloads
+  // move it through.
   template <typename A, typename F>
   inline Either<A, typename function_traits<F>::returnType> fmap(
       const F& f,
@@ -180,6 +313,18 @@ namespace either
     return Either<A, C>(f(e.m_right));
   }
 
+  template <typename A, typename F>
+  inline Either<A, typename function_traits<F>::returnType> fmap(
+      const F& f,
+      Either<A, typename function_traits<F>::template Arg<0>::bareType>&& e)
+  {
+    using C = typename function_traits<F>::returnType;
+
+    if (!e.isRight())
+      return Either<A, C>(std::move(e.m_left), true);
+    return Either<A, C>(f(std::move(e.m_right)));
+  }
+
   template <typename A, typename F>
   inline typename function_traits<F>::returnType bind(
       const F& f,
@@ -188,10 +333,22 @@ namespace either
     using C = typename function_traits<F>::returnType;
 
     if (!e.isRight())
-      return Either<A, C>(e.m_left, true);
+      return C(e.m_left, true);
     return f(e.m_right);
   }
 
+  template <typename A, typename F>
+  inline typename function_traits<F>::returnType bind(
+      const F& f,
+      Either<A, typename function_traits<F>::template Arg<0>::bareType>&& e)
+  {
+    using C = typename function_traits<F>::returnType;
+
+    if (!e.isRight())
+      return C(std::move(e.m_left), true);
+    return f(std::move(e.m_right));
+  }
+
   template <typename A, typename B>
   inline Either<A, B> pure(B&& b)
   {
@@ -219,6 +376,6 @@ inline typename function_traits<F>::returnType operator>(
   using C = typename function_traits<F>::returnType;
 
   if (!e.isRight())
-    return Either<A, C>(std::forward<A>(e.m_left), true);
+    return C(std::move(e.m_left), true);
   return f();
 }
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "async.h"
+#include "unique_function.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Executors: where continuations run.
+//
+// By default every combinator runs its continuation inline, on whatever thread
+// completed the upstream Async. An executor is any object ex for which
+// ex.execute(f) arranges for the nullary function f to be called at some point;
+// via and on move continuations onto one. Executors are held by reference, so
+// they must outlive the work given to them. See work_stealing_pool.h for the
+// executor intended for running Async graphs.
+
+namespace async
+{
+  // IsExecutor<E>::value is true if E has a suitable execute member
+  template <typename E, typename = void>
+  struct IsExecutor : std::false_type {};
+
+  template <typename E>
+  struct IsExecutor<E, decltype(void(std::declval<E&>().execute(
+                                       std::declval<UniqueFunction<void ()>>())))>
+    : std::true_type {};
+
+  // Runs work immediately, on the calling thread.
+  struct InlineExecutor
+  {
+    template <typename F>
+    inline void execute(F&& f) { f(); }
+  };
+
+  // A fixed number of threads serving one shared queue. Work still queued when
+  // the pool is destroyed is run before the threads are joined.
+  class ThreadPool
+  {
+  public:
+    explicit ThreadPool(size_t n = std::thread::hardware_concurrency())
+    {
+      if (n == 0)
+        n = 1;
+      m_threads.reserve(n);
+      for (size_t i = 0; i < n; ++i)
+        m_threads.emplace_back([this] () { run(); });
+    }
+
+    ~ThreadPool()
+    {
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        m_stopping = true;
+      }
+      m_cv.notify_all();
+      for (auto& t : m_threads)
+        t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void execute(UniqueFunction<void ()> f)
+    {
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        m_queue.push_back(std::move(f));
+      }
+      m_cv.notify_one();
+    }
+
+    size_t size() const { return m_threads.size(); }
+
+  private:
+    void run()
+    {
+      for (;;)
+      {
+        UniqueFunction<void ()> f;
+        {
+          std::unique_lock<std::mutex> g(m_mutex);
+          m_cv.wait(g, [this] () { return m_stopping || !m_queue.empty(); });
+          if (m_queue.empty())
+            return;
+          f = std::move(m_queue.front());
+          m_queue.pop_front();
+        }
+        f();
+      }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<UniqueFunction<void ()>> m_queue;
+    bool m_stopping = false;
+    std::vector<std::thread> m_threads;
+  };
+
+  namespace detail
+  {
+    // Deliver a value (or nothing, for Async<void>) to a continuation on an
+    // executor.
+    template <typename E, typename C>
+    struct ViaContinuation
+    {
+      template <typename... T>
+      inline void operator()(T&&... t)
+      {
+        m_ex->execute(
+            [c = std::move(m_cont), args = std::make_tuple(std::forward<T>(t)...)]
+            () mutable {
+              callWith(c, std::move(args), std::index_sequence_for<T...>());
+            });
+      }
+
+      template <typename F, typename Tuple, size_t... I>
+      static inline void callWith(F& f, Tuple&& t, std::index_sequence<I...>)
+      {
+        f(std::get<I>(std::forward<Tuple>(t))...);
+      }
+
+      E* m_ex;
+      C m_cont;
+    };
+  }
+
+  // Run an Async as usual, but deliver its result on the given executor: every
+  // continuation downstream runs there, until the next hop.
+  template <typename E, typename AA,
+            // constraint: E is an executor, AA is an Async<A>
+            std::enable_if_t<IsExecutor<E>::value, int> = 0,
+            typename A = FromAsyncT<AA>>
+  inline auto via(E& ex, AA&& aa)
+  {
+    return makeStage<A>(
+        [] (auto& ex, auto& aa1, auto&& cont)
+        {
+          using C = std::decay_t<decltype(cont)>;
+          aa1(detail::ViaContinuation<E, C>{ ex, std::forward<decltype(cont)>(cont) });
+        }, &ex, std::forward<AA>(aa));
+  }
+
+  // An Async<void> that completes on the given executor, for hopping onto it
+  // part way through a chain: on(pool) > [] { return pure(work()); }
+  template <typename E,
+            // constraint: E is an executor
+            std::enable_if_t<IsExecutor<E>::value, int> = 0>
+  inline auto on(E& ex)
+  {
+    return makeAsyncOp<void>(
+        [ex = &ex] (auto&& cont)
+        {
+          ex->execute([c = std::forward<decltype(cont)>(cont)] () mutable { c(); });
+        });
+  }
+}
@@ -1,6 +1,6 @@
 #pragma once
 
-#include <functional>
+#include <cstddef>
 #include <tuple>
 #include <type_traits>
 
@@ -11,6 +11,9 @@ struct function_traits
   : public function_traits<decltype(&T::operator())>
 {};
 
+template <typename F, typename Signature>
+struct PartialApplication;
+
 // For a regular function, we destructure its type appropriately
 template <typename R, typename... A>
 struct function_traits<R(A...)>
@@ -26,79 +29,69 @@ struct function_traits<R(A...)>
     using bareType = std::decay_t<type>;
   };
 
-  // Application calls the function
+  // Application (of a callable of type F with this signature) calls it, and
+  // returns exactly what it returns: a reference stays a reference
+  template <typename F>
   using appliedType = R;
 
   template <typename F>
-  static inline auto apply(F&& f, A&&... args)
+  static inline decltype(auto) apply(F&& f, A&&... args)
   {
-    return f(std::forward<A...>(args...));
+    return f(std::forward<A>(args)...);
   }
 };
 
-// Specialization for 2 argument functions, to enable partial application
-template <typename R, typename A1, typename A2>
-struct function_traits<R(A1, A2)>
+// Specialization for 2+ argument functions, to enable partial application
+template <typename R, typename A1, typename A2, typename... A>
+struct function_traits<R(A1, A2, A...)>
 {
   // decay the first arg so we can use a universal ref and not incur a copy
   using A1B = std::decay_t<A1>;
   using returnType = R;
 
-  static const size_t arity = 2;
+  static const size_t arity = 2 + sizeof...(A);
 
   template <size_t n>
   struct Arg
   {
-    using type = std::tuple_element_t<n, std::tuple<A1, A2>>;
+    using type = std::tuple_element_t<n, std::tuple<A1, A2, A...>>;
     using bareType = std::decay_t<type>;
   };
 
-  // (Partial) Application binds the first argument
-  using appliedType = std::function<R(A2)>;
+  // (Partial) Application binds the first argument, giving a concrete closure
+  // that holds the function and the argument: nothing is type-erased, so
+  // currying a function one argument at a time doesn't allocate
+  template <typename F>
+  using appliedType = PartialApplication<std::decay_t<F>, R(A1, A2, A...)>;
 
   template <typename F>
-  static inline auto apply(F&& f, A1B&& a1)
+  static inline appliedType<F> apply(F&& f, A1B&& a1)
   {
-    // in case a1 is an rvalue ref, we need to capture "by forward" and make it
-    // mutable, to call the function with a move
-    return [f1 = std::forward<F>(f), a = std::forward<A1B>(a1)]
-      (A2&& a2) mutable -> R
-    {
-      return f1(std::move(a), std::forward<A2>(a2));
-    };
+    return appliedType<F>(std::forward<F>(f), std::move(a1));
   }
 };
 
-// Specialization for 3+ argument functions, to enable partial application
-template <typename R, typename A1, typename A2, typename... A>
-struct function_traits<R(A1, A2, A...)>
+// A function with its first argument bound. Calling it passes the bound
+// argument on with a move, so like the lambda it replaces, it is meant to be
+// called once. Its operator() has exactly the remaining parameters (taken by
+// reference, as A&&, and forwarded, so that passing through it costs no moves),
+// so its function_traits are those of the remaining signature, and partial
+// application can continue.
+template <typename F, typename R, typename A1, typename... A>
+struct PartialApplication<F, R(A1, A...)>
 {
-  // see decay note above
-  using A1B = std::decay_t<A1>;
-  using returnType = R;
+  template <typename G>
+  PartialApplication(G&& f, std::decay_t<A1>&& a1)
+    : m_f(std::forward<G>(f)), m_a1(std::move(a1))
+  {}
 
-  static const size_t arity = 2 + sizeof...(A);
-
-  template <size_t n>
-  struct Arg
+  R operator()(A&&... args)
   {
-    using type = std::tuple_element_t<n, std::tuple<A1, A2, A...>>;
-    using bareType = std::decay_t<type>;
-  };
-
-  // (Partial) Application binds the first argument
-  using appliedType = std::function<R(A2, A...)>;
-
-  template <typename F>
-  static inline auto apply(F&& f, A1B&& a1)
-  {
-    // see capture-by-forward note above
-    return [f1 = std::forward<F>(f), a = std::forward<A1B>(a1)]
-      (A2&& a2, A&&... args) mutable -> R
-    {
-      return f1(std::move(a), std::forward<A2>(a2), std::forward<A...>(args...));
-    };
+    return m_f(std::move(m_a1), std::forward<A>(args)...);
   }
+
+  F m_f;
+  std::decay_t<A1> m_a1;
 };
 
 // For class member functions, extract the type
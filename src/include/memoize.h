@@ -0,0 +1,221 @@
+#pragma once
+
+#include "async.h"
+#include "function_traits.h"
+#include "shared_async.h"
+#include "unique_function.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Memoization: caching an a -> Async<b> by its argument.
+//
+// memoize(f, capacity) returns a Memoized, a copyable function object that
+// looks the key up in a cache before calling f. What the cache holds for each
+// key is a SharedAsync of f's result, so a caller that arrives while the value
+// is still on its way shares the upstream call already in flight, and one that
+// arrives afterwards is given the value at once. A Memoized can be used
+// wherever its function could, e.g. as a stage of bind.
+//
+// The cache is split into shards, each a hashtable under its own mutex, so
+// lookups of different keys seldom contend. f is called (and its Async built)
+// outside the lock, so it may be called from several threads at once, and must
+// be safe to call concurrently. Callers racing on a miss may each call f, but
+// only one of the Asyncs is cached, and the others are never run. There are
+// never more shards than the capacity, which they divide between them, so the
+// cache never holds more than capacity keys (a capacity of 0 is taken as 1).
+// Each shard evicts with the CLOCK algorithm: a hit marks its entry, and the
+// hand sweeps past marked entries (clearing the mark) to the first unmarked
+// one. Evicting an entry doesn't affect consumers already waiting on it.
+//
+// As with share, f is called, and the upstream Async built and run, under an
+// empty stop token and on the global heap, since it serves every caller.
+// Whatever f delivers is cached, errors included; erase(k) drops a key so that
+// it's fetched again.
+
+namespace async
+{
+  template <typename K, typename B, typename Hash = std::hash<K>>
+  class Memoized
+  {
+  public:
+    using Function = UniqueFunction<Async<B> (K)>;
+
+    Memoized(Function f, size_t capacity, size_t shards = 16)
+      : m_state(std::make_shared<State>(std::move(f), capacity, shards))
+    {}
+
+    SharedAsync<B> operator()(const K& k) const
+    {
+      Shard& s = m_state->shard(k);
+      {
+        std::lock_guard<std::mutex> g(s.mutex);
+        if (auto* e = s.find(k))
+        {
+          m_state->hits.fetch_add(1, std::memory_order_relaxed);
+          return e->value;
+        }
+      }
+
+      m_state->misses.fetch_add(1, std::memory_order_relaxed);
+      SharedAsync<B> value = fetch(k);
+      std::lock_guard<std::mutex> g(s.mutex);
+      // someone else may have got there while the lock was released
+      if (auto* e = s.find(k))
+        return e->value;
+      s.insert(k, value);
+      return value;
+    }
+
+    // Drop a key from the cache.
+    void erase(const K& k) const
+    {
+      Shard& s = m_state->shard(k);
+      std::lock_guard<std::mutex> g(s.mutex);
+      s.erase(k);
+    }
+
+    // the number of keys cached
+    size_t size() const
+    {
+      size_t n = 0;
+      for (auto& s : m_state->shards)
+      {
+        std::lock_guard<std::mutex> g(s->mutex);
+        n += s->index.size();
+      }
+      return n;
+    }
+
+    size_t hits() const { return m_state->hits.load(std::memory_order_relaxed); }
+    size_t misses() const { return m_state->misses.load(std::memory_order_relaxed); }
+
+  private:
+    // f is called, and what it returns shared, with no stop token or memory
+    // resource current: the cached Async serves every caller, and outlives
+    // the context of the one that missed.
+    SharedAsync<B> fetch(const K& k) const
+    {
+      StopScope scope{StopToken()};
+      ResourceScope rscope(nullptr);
+      return share(m_state->f(K(k)));
+    }
+
+    struct Entry
+    {
+      K key;
+      SharedAsync<B> value;
+      bool referenced;
+    };
+
+    struct Shard
+    {
+      explicit Shard(size_t cap) : capacity(cap) { entries.reserve(cap); }
+
+      Entry* find(const K& k)
+      {
+        auto i = index.find(k);
+        if (i == index.end())
+          return nullptr;
+        Entry& e = entries[i->second];
+        e.referenced = true;
+        return &e;
+      }
+
+      void insert(const K& k, const SharedAsync<B>& value)
+      {
+        if (entries.size() < capacity)
+        {
+          index.emplace(k, entries.size());
+          entries.push_back(Entry{ k, value, false });
+          return;
+        }
+        while (entries[hand].referenced)
+        {
+          entries[hand].referenced = false;
+          hand = (hand + 1) % capacity;
+        }
+        Entry& victim = entries[hand];
+        index.erase(victim.key);
+        index.emplace(k, hand);
+        victim = Entry{ k, value, false };
+        hand = (hand + 1) % capacity;
+      }
+
+      // The last entry moves into the erased one's place, which is as good a
+      // place as any on the clock.
+      void erase(const K& k)
+      {
+        auto i = index.find(k);
+        if (i == index.end())
+          return;
+        size_t slot = i->second;
+        index.erase(i);
+        if (slot + 1 != entries.size())
+        {
+          entries[slot] = std::move(entries.back());
+          index[entries[slot].key] = slot;
+        }
+        entries.pop_back();
+        if (hand >= entries.size())
+          hand = 0;
+      }
+
+      std::mutex mutex;
+      size_t capacity;
+      std::vector<Entry> entries;
+      std::unordered_map<K, size_t, Hash> index;
+      size_t hand = 0;
+    };
+
+    struct State
+    {
+      // the first capacity % n shards take one more than the rest
+      State(Function&& fn, size_t capacity, size_t n)
+        : f(std::move(fn))
+      {
+        capacity = std::max<size_t>(capacity, 1);
+        n = std::min(std::max<size_t>(n, 1), capacity);
+        shards.reserve(n);
+        for (size_t i = 0; i < n; ++i)
+          shards.push_back(
+              std::make_unique<Shard>(capacity / n + (i < capacity % n)));
+      }
+
+      // The table in each shard hashes the same keys again, so the shard is
+      // chosen by the high bits of the (mixed) hash, and the table uses the
+      // low.
+      Shard& shard(const K& k)
+      {
+        uint64_t h = static_cast<uint64_t>(Hash()(k)) * 0x9e3779b97f4a7c15ull;
+        return *shards[(h >> 32) % shards.size()];
+      }
+
+      Function f;
+      std::vector<std::unique_ptr<Shard>> shards;
+      std::atomic<size_t> hits{0};
+      std::atomic<size_t> misses{0};
+    };
+
+    std::shared_ptr<State> m_state;
+  };
+
+  // Cache f: a -> Async<b> by its argument, keeping up to capacity results.
+  template <typename F,
+            typename K = typename function_traits<F>::template Arg<0>::bareType,
+            // constraint: F must return an Async<B>
+            typename B = FromAsyncT<typename function_traits<F>::template appliedType<F>>>
+  inline Memoized<K, B> memoize(F&& f, size_t capacity, size_t shards = 16)
+  {
+    return Memoized<K, B>(std::forward<F>(f), capacity, shards);
+  }
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// A flat sum of any number of types: the N-ary generalization of Either, used
+// by when_any. The active alternative is identified by its index, so the same
+// type may appear more than once. If an assignment throws while constructing
+// the new alternative, the OneOf is left valueless, with index() == npos.
+
+template <size_t I>
+using InPlaceIndex = std::integral_constant<size_t, I>;
+
+template <typename... T>
+struct OneOf
+{
+  static_assert(sizeof...(T) > 0, "OneOf needs at least one alternative");
+
+  template <size_t I>
+  using Alternative = std::tuple_element_t<I, std::tuple<T...>>;
+
+  static const size_t npos = static_cast<size_t>(-1);
+
+  // construct alternative I in place
+  template <size_t I, typename... Args>
+  explicit OneOf(InPlaceIndex<I>, Args&&... args)
+    : m_index(I)
+  {
+    new (&m_storage) Alternative<I>(std::forward<Args>(args)...);
+  }
+
+  OneOf(const OneOf& other)
+    : m_index(npos)
+  {
+    copyFrom(other);
+  }
+
+  OneOf(OneOf&& other)
+    noexcept(std::is_nothrow_move_constructible<std::tuple<T...>>())
+    : m_index(npos)
+  {
+    moveFrom(other);
+  }
+
+  // assignment destroys the current alternative before constructing the new
+  // one: unlike Either, it doesn't try to assign when the indices match. A copy
+  // is made first, so that if it throws, *this is unchanged.
+  OneOf& operator=(const OneOf& other)
+  {
+    if (this != &other)
+    {
+      OneOf tmp(other);
+      destroy();
+      moveFrom(tmp);
+    }
+    return *this;
+  }
+
+  OneOf& operator=(OneOf&& other)
+    noexcept(std::is_nothrow_move_constructible<std::tuple<T...>>())
+  {
+    if (this != &other)
+    {
+      destroy();
+      moveFrom(other);
+    }
+    return *this;
+  }
+
+  ~OneOf() { destroy(); }
+
+  size_t index() const { return m_index; }
+
+  // access to the active alternative; it's an error to ask for another one
+  template <size_t I>
+  Alternative<I>& get() &
+  {
+    return *reinterpret_cast<Alternative<I>*>(&m_storage);
+  }
+
+  template <size_t I>
+  const Alternative<I>& get() const &
+  {
+    return *reinterpret_cast<const Alternative<I>*>(&m_storage);
+  }
+
+  template <size_t I>
+  Alternative<I>&& get() &&
+  {
+    return std::move(*reinterpret_cast<Alternative<I>*>(&m_storage));
+  }
+
+private:
+  template <typename U>
+  static void copyImpl(void* dst, const void* src)
+  {
+    new (dst) U(*static_cast<const U*>(src));
+  }
+
+  template <typename U>
+  static void moveImpl(void* dst, void* src)
+  {
+    new (dst) U(std::move(*static_cast<U*>(src)));
+  }
+
+  template <typename U>
+  static void destroyImpl(void* p)
+  {
+    static_cast<U*>(p)->~U();
+  }
+
+  // m_index is only set once the alternative is constructed, so if that
+  // throws, the OneOf is valueless and destroy() has nothing to do
+  void copyFrom(const OneOf& other)
+  {
+    static void (*const copiers[])(void*, const void*) = { &copyImpl<T>... };
+    if (other.m_index != npos)
+      copiers[other.m_index](&m_storage, &other.m_storage);
+    m_index = other.m_index;
+  }
+
+  void moveFrom(OneOf& other)
+  {
+    static void (*const movers[])(void*, void*) = { &moveImpl<T>... };
+    if (other.m_index != npos)
+      movers[other.m_index](&m_storage, &other.m_storage);
+    m_index = other.m_index;
+  }
+
+  void destroy()
+  {
+    static void (*const destroyers[])(void*) = { &destroyImpl<T>... };
+    if (m_index != npos)
+      destroyers[m_index](&m_storage);
+    m_index = npos;
+  }
+
+  size_t m_index;
+  std::aligned_storage_t<std::max({sizeof(T)...}), std::max({alignof(T)...})> m_storage;
+};
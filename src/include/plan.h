@@ -0,0 +1,111 @@
+#pragma once
+
+#include "allocator.h"
+#include "async.h"
+#include "unique_function.h"
+
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// Plans: Async graphs built once and run many times.
+//
+// Invoking an AsyncOp runs it in place, and some stages give up what they
+// captured as they go (pure moves its value into the continuation), so an op
+// invoked twice doesn't see the graph it was built as the second time, and
+// invoked on two threads at once, races with itself. prepare(a) turns a
+// copyable op into an AsyncPlan, which keeps the graph as built and invokes it
+// as const: each stage copies out what it would otherwise have moved, so any
+// number of runs may overlap, from any threads, and none of them copies the
+// graph itself. (A stage that can only be invoked mutably, like one made from
+// a mutable lambda, is copied as its run reaches it.) The plan's join state,
+// like that of any Async, is created fresh as each run starts.
+//
+// It is allocated from a Pool that belongs to the plan, which is current for
+// the whole run (bind and sequence reinstate it in the stages they start
+// later), along with anything the run boxes, including its continuation. What
+// one run frees the next reuses, so once the pool has warmed up, running a plan
+// doesn't touch the heap. The plan (its last copy) must outlive its runs.
+
+namespace async
+{
+  namespace detail
+  {
+    template <typename T>
+    struct PlanGraph
+    {
+      virtual ~PlanGraph() = default;
+      virtual void start(ContinuationT<T>&& c) const = 0;
+    };
+
+    template <typename T, typename AA>
+    struct PlanGraphImpl : PlanGraph<T>
+    {
+      explicit PlanGraphImpl(AA&& aa) : m_aa(std::move(aa)) {}
+
+      void start(ContinuationT<T>&& c) const override
+      {
+        m_aa(std::move(c));
+      }
+
+      AA m_aa;
+    };
+
+    template <typename T>
+    struct PlanState
+    {
+      std::unique_ptr<const PlanGraph<T>> graph;
+      Pool pool;
+    };
+  }
+}
+
+// A handle on a prepared graph: each invocation is a fresh run. Copies share
+// the graph and its pool.
+template <typename T>
+class AsyncPlan
+{
+public:
+  using type = T;
+
+  explicit AsyncPlan(std::shared_ptr<async::detail::PlanState<T>> state)
+    : m_state(std::move(state))
+  {}
+
+  template <typename C>
+  inline void operator()(C&& cont) const
+  {
+    async::ResourceScope scope(&m_state->pool);
+    m_state->graph->start(ContinuationT<T>(std::forward<C>(cont)));
+  }
+
+  async::Pool& pool() const { return m_state->pool; }
+
+private:
+  std::shared_ptr<async::detail::PlanState<T>> m_state;
+};
+
+namespace async
+{
+  template <typename T>
+  struct FromAsync<AsyncPlan<T>>
+  {
+    using type = T;
+  };
+
+  // Prepare an Async graph to be run many times.
+  template <typename AA,
+            // constraint: AA must be an Async<A>
+            typename A = FromAsyncT<AA>>
+  inline AsyncPlan<A> prepare(AA&& aa)
+  {
+    using G = std::decay_t<AA>;
+    static_assert(std::is_copy_constructible<G>::value,
+                  "a plan is built from a copyable Async: AsyncOps whose "
+                  "captures are copyable, rather than erased Asyncs");
+    auto state = std::make_shared<detail::PlanState<A>>();
+    state->graph.reset(new detail::PlanGraphImpl<A, G>(G(std::forward<AA>(aa))));
+    return AsyncPlan<A>(std::move(state));
+  }
+}
@@ -0,0 +1,946 @@
+#pragma once
+
+#include "async.h"
+#include "cancellation.h"
+#include "either.h"
+#include "executor.h"
+#include "result.h"
+#include "unique_function.h"
+#include "view.h"
+
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// I/O: read, write, accept and connect as leaf Asyncs, served by a Reactor.
+// This header is Linux-only, and nothing else in the library depends on it.
+//
+// Each operation is an AsyncResult<T, std::error_code>: a read or write
+// delivers the number of bytes transferred (0 from a read is end of file), an
+// accept the new socket, and a connect a Void. A Reactor runs a thread of its
+// own that talks to the kernel. Its preferred backend is io_uring (driven
+// through the raw system calls, so there is no dependency on liburing): the
+// operations started since the reactor last woke up are written to the
+// submission ring together, and submitted with one io_uring_enter. Where
+// io_uring isn't available, the reactor falls back on epoll, registering
+// interest in each fd and performing the operation once it's ready; sockets
+// given to that backend should be non-blocking. (The operations share their
+// names with the POSIX calls, so call them as async::read and so on.)
+//
+// Starting an operation queues it and wakes the reactor. A BatchScope (or
+// batched(a), which starts a under one) holds back the wake-up until the scope
+// ends, so that everything an Async graph starts at once -- the branches of a
+// when_all, or both sides of an && -- goes to the kernel in one submission.
+//
+// Completions run on the reactor's thread, unless it was given an executor, in
+// which case they're dispatched there. An operation is stopped through the
+// stop token it was started under: its continuation is then destroyed without
+// being called. The buffer of a read or write must stay valid until the
+// operation has retired (until pending() no longer counts it), even once it's
+// stopped: the kernel may still be using it. Operations still pending when the
+// reactor is destroyed are cancelled, and never complete.
+
+namespace async
+{
+  class Reactor;
+
+  namespace detail
+  {
+    // the reactors that a thread's BatchScopes have held back from waking
+    struct BatchState
+    {
+      unsigned depth = 0;
+      std::vector<Reactor*> deferred;
+    };
+
+    inline BatchState& batchState()
+    {
+      static thread_local BatchState s;
+      return s;
+    }
+  }
+
+  class Reactor
+  {
+  public:
+    enum class Backend { AUTO, IO_URING, EPOLL };
+
+    enum class Kind : uint8_t { READ, WRITE, ACCEPT, CONNECT };
+
+    // An operation, as the leaf Asyncs describe it. For a read or write, data
+    // and size are the buffer; for a connect, addr and addrLen the peer. keep
+    // is held until the operation retires.
+    struct Request
+    {
+      Kind kind = Kind::READ;
+      int fd = -1;
+      void* data = nullptr;
+      size_t size = 0;
+      sockaddr_storage addr{};
+      socklen_t addrLen = 0;
+      std::shared_ptr<const void> keep;
+    };
+
+    // AUTO uses io_uring if the kernel allows it, and epoll otherwise; asking
+    // for IO_URING explicitly throws a std::system_error if it's unavailable.
+    explicit Reactor(Backend b = Backend::AUTO)
+    {
+      init(b);
+      m_thread = std::thread([this] () { run(); });
+    }
+
+    // dispatch completions on an executor, which must outlive the reactor
+    template <typename E,
+              // constraint: E is an executor
+              std::enable_if_t<IsExecutor<E>::value, int> = 0>
+    explicit Reactor(E& ex, Backend b = Backend::AUTO)
+      : m_dispatch([ex = &ex] (UniqueFunction<void ()> f) {
+          ex->execute(std::move(f));
+        })
+    {
+      init(b);
+      m_thread = std::thread([this] () { run(); });
+    }
+
+    ~Reactor()
+    {
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        m_stopping = true;
+      }
+      signal();
+      m_thread.join();
+
+      std::vector<std::shared_ptr<Op>> dropped;
+      dropped.swap(m_queue);
+      for (Op* op : m_inflight)
+        dropped.push_back(std::move(op->self));
+      m_fds.clear();
+      dropped.clear();
+
+      if (m_backend == Backend::IO_URING)
+        m_ring.close();
+      else
+        ::close(m_epoll);
+      ::close(m_wake);
+    }
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    Backend backend() const { return m_backend; }
+
+    // Start req. done is called with its result -- non-negative, or -errno --
+    // unless a stop is requested on token first, in which case done is
+    // destroyed without being called.
+    void submit(Request req, UniqueFunction<void (int)> done,
+                const StopToken& token = StopToken())
+    {
+      auto op = std::make_shared<Op>(std::move(req));
+      op->done = std::move(done);
+      std::weak_ptr<Op> weak = op;
+      op->onStop = StopCallback(token, [this, weak] () {
+          if (auto s = weak.lock())
+            stop(std::move(s));
+        });
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        if (op->stopped || m_stopping)
+          return;
+        op->state = State::QUEUED;
+        m_queue.push_back(std::move(op));
+        ++m_pending;
+      }
+      detail::BatchState& b = detail::batchState();
+      if (b.depth == 0)
+        wake();
+      else if (std::find(b.deferred.begin(), b.deferred.end(), this) == b.deferred.end())
+        b.deferred.push_back(this);
+    }
+
+    // the number of operations that haven't yet retired
+    size_t pending() const
+    {
+      std::lock_guard<std::mutex> g(m_mutex);
+      return m_pending;
+    }
+
+    // The number of times operations have been handed to the kernel: calls to
+    // io_uring_enter that submitted something, or rounds of epoll
+    // registrations.
+    size_t submissions() const
+    {
+      return m_submissions.load(std::memory_order_relaxed);
+    }
+
+  private:
+    friend class BatchScope;
+
+    enum class State : uint8_t { NEW, QUEUED, INFLIGHT, DONE };
+
+    struct Op : Request
+    {
+      explicit Op(Request&& r) : Request(std::move(r)) {}
+
+      State state = State::NEW;
+      bool stopped = false;
+      bool cancelling = false;
+      UniqueFunction<void (int)> done;
+      // the reactor's reference, held while the operation is in flight
+      std::shared_ptr<Op> self;
+      StopCallback onStop;
+    };
+
+    // user_data of the io_uring entries that aren't operations
+    static const uint64_t WAKE_TAG = 0;
+    static const uint64_t CANCEL_TAG = 1;
+
+    // The rings, mapped from the kernel. Only the reactor's thread touches
+    // them; the kernel's side of each index is read and written atomically.
+    struct Ring
+    {
+      bool open(unsigned entries)
+      {
+        io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &p));
+        if (fd < 0)
+          return false;
+
+        sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single)
+          sqSize = cqSize = std::max(sqSize, cqSize);
+        sqPtr = map(sqSize, IORING_OFF_SQ_RING);
+        cqPtr = single ? sqPtr : map(cqSize, IORING_OFF_CQ_RING);
+        sqeSize = p.sq_entries * sizeof(io_uring_sqe);
+        sqePtr = map(sqeSize, IORING_OFF_SQES);
+        if (sqPtr == MAP_FAILED || cqPtr == MAP_FAILED || sqePtr == MAP_FAILED)
+        {
+          int e = errno;
+          close();
+          errno = e;
+          return false;
+        }
+
+        char* sq = static_cast<char*>(sqPtr);
+        sqHead = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sqEntries = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_entries);
+        sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        sqes = static_cast<io_uring_sqe*>(sqePtr);
+
+        char* cq = static_cast<char*>(cqPtr);
+        cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+        tail = *sqTail;
+        return true;
+      }
+
+      void* map(size_t size, off_t offset)
+      {
+        return ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, offset);
+      }
+
+      void close()
+      {
+        if (sqePtr && sqePtr != MAP_FAILED)
+          ::munmap(sqePtr, sqeSize);
+        if (cqPtr && cqPtr != MAP_FAILED && cqPtr != sqPtr)
+          ::munmap(cqPtr, cqSize);
+        if (sqPtr && sqPtr != MAP_FAILED)
+          ::munmap(sqPtr, sqSize);
+        sqPtr = cqPtr = sqePtr = nullptr;
+        if (fd >= 0)
+          ::close(fd);
+        fd = -1;
+      }
+
+      // A cleared entry to fill in, or nullptr if the ring is full.
+      io_uring_sqe* get()
+      {
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (tail - head >= sqEntries)
+          return nullptr;
+        unsigned i = tail & sqMask;
+        io_uring_sqe* sqe = &sqes[i];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqArray[i] = i;
+        ++tail;
+        return sqe;
+      }
+
+      // Submit what's been filled in, and wait for at least wait completions.
+      void enter(unsigned wait)
+      {
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+        for (;;)
+        {
+          unsigned submit = tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+          if (submit == 0 && wait == 0)
+            return;
+          long r = ::syscall(__NR_io_uring_enter, fd, submit, wait,
+                             wait ? IORING_ENTER_GETEVENTS : 0u, nullptr, 0);
+          if (r >= 0 || errno != EINTR)
+            return;
+        }
+      }
+
+      int fd = -1;
+      void* sqPtr = nullptr;
+      void* cqPtr = nullptr;
+      void* sqePtr = nullptr;
+      size_t sqSize = 0;
+      size_t cqSize = 0;
+      size_t sqeSize = 0;
+
+      unsigned* sqHead = nullptr;
+      unsigned* sqTail = nullptr;
+      unsigned sqMask = 0;
+      unsigned sqEntries = 0;
+      unsigned* sqArray = nullptr;
+      io_uring_sqe* sqes = nullptr;
+      unsigned tail = 0;
+
+      unsigned* cqHead = nullptr;
+      unsigned* cqTail = nullptr;
+      unsigned cqMask = 0;
+      io_uring_cqe* cqes = nullptr;
+    };
+
+    // what the epoll backend is waiting to do with an fd
+    struct FdState
+    {
+      std::deque<std::shared_ptr<Op>> readers;
+      std::deque<std::shared_ptr<Op>> writers;
+      bool added = false;
+    };
+
+    void init(Backend b)
+    {
+      if (b != Backend::EPOLL)
+      {
+        if (m_ring.open(256))
+        {
+          m_backend = Backend::IO_URING;
+          m_wake = ::eventfd(0, EFD_CLOEXEC);
+          return;
+        }
+        if (b == Backend::IO_URING)
+          throw std::system_error(errno, std::system_category(), "io_uring_setup");
+      }
+      m_backend = Backend::EPOLL;
+      m_epoll = ::epoll_create1(EPOLL_CLOEXEC);
+      m_wake = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      epoll_event e;
+      std::memset(&e, 0, sizeof(e));
+      e.events = EPOLLIN;
+      e.data.fd = m_wake;
+      ::epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake, &e);
+    }
+
+    // Wake the reactor, unless it's already been woken since it last looked
+    // at its queue.
+    void wake()
+    {
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        if (m_woken)
+          return;
+        m_woken = true;
+      }
+      signal();
+    }
+
+    void signal()
+    {
+      uint64_t one = 1;
+      ssize_t n = ::write(m_wake, &one, sizeof(one));
+      static_cast<void>(n);
+    }
+
+    // Called when a stop is requested: a queued operation is dropped at once,
+    // and one in flight is cancelled by the reactor.
+    void stop(std::shared_ptr<Op> op)
+    {
+      std::shared_ptr<Op> self;
+      UniqueFunction<void (int)> done;
+      bool cancel = false;
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        op->stopped = true;
+        if (op->state == State::QUEUED)
+        {
+          auto i = std::find(m_queue.begin(), m_queue.end(), op);
+          self = std::move(*i);
+          m_queue.erase(i);
+          op->state = State::DONE;
+          --m_pending;
+          done = std::move(op->done);
+        }
+        else if (op->state == State::INFLIGHT)
+        {
+          m_cancels.push_back(std::move(op));
+          cancel = true;
+        }
+      }
+      if (cancel)
+        wake();
+    }
+
+    // Take what's been queued since the last round.
+    bool takeQueue(std::vector<std::shared_ptr<Op>>& starting,
+                   std::vector<std::shared_ptr<Op>>& cancels)
+    {
+      std::lock_guard<std::mutex> g(m_mutex);
+      m_woken = false;
+      cancels.swap(m_cancels);
+      if (m_stopping)
+        return false;
+      starting.swap(m_queue);
+      for (auto& op : starting)
+        op->state = State::INFLIGHT;
+      return true;
+    }
+
+    // Retire an operation, and call its continuation if it wasn't stopped.
+    void complete(Op* op, int res)
+    {
+      std::shared_ptr<Op> self = std::move(op->self);
+      m_inflight.erase(op);
+      UniqueFunction<void (int)> done;
+      bool deliver;
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        op->state = State::DONE;
+        deliver = !op->stopped && !m_stopping;
+        --m_pending;
+        done = std::move(op->done);
+      }
+      if (!deliver)
+        return;
+      if (m_dispatch)
+        m_dispatch([done = std::move(done), res] () mutable { done(res); });
+      else
+        done(res);
+    }
+
+    void start(std::shared_ptr<Op>& op)
+    {
+      Op* p = op.get();
+      m_inflight.insert(p);
+      p->self = std::move(op);
+    }
+
+    void run()
+    {
+      if (m_backend == Backend::IO_URING)
+        runRing();
+      else
+        runEpoll();
+    }
+
+    //--------------------------------------------------------------------------
+    // io_uring
+
+    io_uring_sqe* nextSqe()
+    {
+      io_uring_sqe* sqe = m_ring.get();
+      if (!sqe)
+      {
+        // full: submit what's there to make room
+        m_ring.enter(0);
+        sqe = m_ring.get();
+      }
+      return sqe;
+    }
+
+    void prepare(Op* op)
+    {
+      io_uring_sqe* sqe = nextSqe();
+      sqe->fd = op->fd;
+      sqe->user_data = reinterpret_cast<uint64_t>(op);
+      switch (op->kind)
+      {
+        case Kind::READ:
+          sqe->opcode = IORING_OP_READ;
+          sqe->addr = reinterpret_cast<uint64_t>(op->data);
+          sqe->len = static_cast<uint32_t>(op->size);
+          sqe->off = static_cast<uint64_t>(-1);
+          break;
+        case Kind::WRITE:
+          sqe->opcode = IORING_OP_WRITE;
+          sqe->addr = reinterpret_cast<uint64_t>(op->data);
+          sqe->len = static_cast<uint32_t>(op->size);
+          sqe->off = static_cast<uint64_t>(-1);
+          break;
+        case Kind::ACCEPT:
+          sqe->opcode = IORING_OP_ACCEPT;
+          sqe->accept_flags = SOCK_CLOEXEC;
+          break;
+        case Kind::CONNECT:
+          sqe->opcode = IORING_OP_CONNECT;
+          sqe->addr = reinterpret_cast<uint64_t>(&op->addr);
+          sqe->off = op->addrLen;
+          break;
+      }
+    }
+
+    void prepareCancel(Op* op)
+    {
+      if (op->cancelling || op->state != State::INFLIGHT)
+        return;
+      op->cancelling = true;
+      io_uring_sqe* sqe = nextSqe();
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = reinterpret_cast<uint64_t>(op);
+      sqe->user_data = CANCEL_TAG;
+    }
+
+    void runRing()
+    {
+      uint64_t wakeValue = 0;
+      bool wakeArmed = false;
+      std::vector<std::shared_ptr<Op>> starting;
+      std::vector<std::shared_ptr<Op>> cancels;
+      std::vector<io_uring_cqe> completed;
+      for (;;)
+      {
+        bool running = takeQueue(starting, cancels);
+        for (auto& op : starting)
+        {
+          prepare(op.get());
+          start(op);
+        }
+        for (auto& op : cancels)
+          prepareCancel(op.get());
+        if (!running)
+          for (Op* op : m_inflight)
+            prepareCancel(op);
+        bool submitting = !starting.empty() || !cancels.empty();
+        starting.clear();
+        cancels.clear();
+
+        if (running && !wakeArmed)
+        {
+          io_uring_sqe* sqe = nextSqe();
+          sqe->opcode = IORING_OP_READ;
+          sqe->fd = m_wake;
+          sqe->addr = reinterpret_cast<uint64_t>(&wakeValue);
+          sqe->len = sizeof(wakeValue);
+          sqe->user_data = WAKE_TAG;
+          wakeArmed = true;
+        }
+        if (!running && !wakeArmed && m_inflight.empty())
+          break;
+
+        if (submitting)
+          m_submissions.fetch_add(1, std::memory_order_relaxed);
+        m_ring.enter(1);
+
+        unsigned head = *m_ring.cqHead;
+        unsigned tail = __atomic_load_n(m_ring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+          completed.push_back(m_ring.cqes[head & m_ring.cqMask]);
+        __atomic_store_n(m_ring.cqHead, head, __ATOMIC_RELEASE);
+
+        for (const auto& cqe : completed)
+        {
+          if (cqe.user_data == WAKE_TAG)
+            wakeArmed = false;
+          else if (cqe.user_data != CANCEL_TAG)
+            complete(reinterpret_cast<Op*>(cqe.user_data), cqe.res);
+        }
+        completed.clear();
+      }
+    }
+
+    //--------------------------------------------------------------------------
+    // epoll
+
+    static int perform(Op* op)
+    {
+      ssize_t r = 0;
+      switch (op->kind)
+      {
+        case Kind::READ:
+          r = ::read(op->fd, op->data, op->size);
+          break;
+        case Kind::WRITE:
+          r = ::write(op->fd, op->data, op->size);
+          break;
+        case Kind::ACCEPT:
+          r = ::accept4(op->fd, nullptr, nullptr, SOCK_CLOEXEC);
+          break;
+        case Kind::CONNECT:
+        {
+          int err = 0;
+          socklen_t len = sizeof(err);
+          if (::getsockopt(op->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+            return -errno;
+          return -err;
+        }
+      }
+      return r < 0 ? -errno : static_cast<int>(r);
+    }
+
+    // Register interest in what an fd's operations are waiting for (one-shot,
+    // so that readiness is reported once per round), or drop it. An fd that
+    // epoll can't wait on (a regular file) is always ready, so its operations
+    // are performed at once.
+    void update(int fd)
+    {
+      auto i = m_fds.find(fd);
+      if (i == m_fds.end())
+        return;
+      FdState& s = i->second;
+      uint32_t events = (s.readers.empty() ? 0u : uint32_t(EPOLLIN)) |
+                        (s.writers.empty() ? 0u : uint32_t(EPOLLOUT));
+      if (events == 0)
+      {
+        if (s.added)
+          ::epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+        m_fds.erase(i);
+        return;
+      }
+      epoll_event e;
+      std::memset(&e, 0, sizeof(e));
+      e.events = events | EPOLLONESHOT;
+      e.data.fd = fd;
+      if (::epoll_ctl(m_epoll, s.added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &e) == 0)
+      {
+        s.added = true;
+        return;
+      }
+      int err = errno;
+      std::deque<std::shared_ptr<Op>> ops;
+      ops.swap(s.readers);
+      for (auto& op : s.writers)
+        ops.push_back(std::move(op));
+      m_fds.erase(i);
+      for (auto& op : ops)
+        finish(op.get(), err == EPERM ? perform(op.get()) : -err);
+    }
+
+    // Operations are retired at the end of a round, once their fds' interest
+    // has been updated: after that, the fd may be closed (and its number
+    // reused) as soon as the continuation has seen the result.
+    void finish(Op* op, int res)
+    {
+      m_finished.emplace_back(op->self, res);
+    }
+
+    void retireFinished()
+    {
+      for (auto& f : m_finished)
+        complete(f.first.get(), f.second);
+      m_finished.clear();
+    }
+
+    void enqueue(std::shared_ptr<Op>& op)
+    {
+      int fd = op->fd;
+      Op* p = op.get();
+      start(op);
+      if (p->kind == Kind::CONNECT)
+      {
+        if (::connect(fd, reinterpret_cast<const sockaddr*>(&p->addr), p->addrLen) == 0)
+          return finish(p, 0);
+        if (errno != EINPROGRESS)
+          return finish(p, -errno);
+      }
+      FdState& s = m_fds[fd];
+      auto& q = (p->kind == Kind::READ || p->kind == Kind::ACCEPT) ? s.readers : s.writers;
+      q.push_back(p->self);
+    }
+
+    void dequeue(Op* op)
+    {
+      if (op->state != State::INFLIGHT)
+        return;
+      auto i = m_fds.find(op->fd);
+      if (i == m_fds.end())
+        return;
+      for (auto* q : { &i->second.readers, &i->second.writers })
+      {
+        auto j = std::find_if(q->begin(), q->end(),
+                              [op] (const std::shared_ptr<Op>& o) { return o.get() == op; });
+        if (j != q->end())
+        {
+          q->erase(j);
+          finish(op, -ECANCELED);
+          return;
+        }
+      }
+    }
+
+    // Perform the first operation waiting in a direction that's ready.
+    void serve(std::deque<std::shared_ptr<Op>>& q)
+    {
+      if (q.empty())
+        return;
+      int res = perform(q.front().get());
+      if (res == -EAGAIN || res == -EWOULDBLOCK)
+        return;
+      std::shared_ptr<Op> op = std::move(q.front());
+      q.pop_front();
+      finish(op.get(), res);
+    }
+
+    void runEpoll()
+    {
+      std::vector<std::shared_ptr<Op>> starting;
+      std::vector<std::shared_ptr<Op>> cancels;
+      std::vector<int> touched;
+      epoll_event events[64];
+      for (;;)
+      {
+        bool running = takeQueue(starting, cancels);
+        if (!running)
+          break;
+        if (!starting.empty())
+          m_submissions.fetch_add(1, std::memory_order_relaxed);
+        for (auto& op : starting)
+        {
+          touched.push_back(op->fd);
+          enqueue(op);
+        }
+        for (auto& op : cancels)
+        {
+          touched.push_back(op->fd);
+          dequeue(op.get());
+        }
+        starting.clear();
+        cancels.clear();
+        std::sort(touched.begin(), touched.end());
+        touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+        for (int fd : touched)
+          update(fd);
+        touched.clear();
+        retireFinished();
+
+        int n = ::epoll_wait(m_epoll, events, 64, -1);
+        for (int i = 0; i < n; ++i)
+        {
+          int fd = events[i].data.fd;
+          if (fd == m_wake)
+          {
+            uint64_t value;
+            ssize_t r = ::read(m_wake, &value, sizeof(value));
+            static_cast<void>(r);
+            continue;
+          }
+          auto j = m_fds.find(fd);
+          if (j == m_fds.end())
+            continue;
+          uint32_t ev = events[i].events;
+          if (ev & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            serve(j->second.readers);
+          if (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            serve(j->second.writers);
+          update(fd);
+        }
+        retireFinished();
+      }
+    }
+
+    UniqueFunction<void (UniqueFunction<void ()>)> m_dispatch;
+    Backend m_backend = Backend::EPOLL;
+    Ring m_ring;
+    int m_epoll = -1;
+    int m_wake = -1;
+
+    mutable std::mutex m_mutex;
+    std::vector<std::shared_ptr<Op>> m_queue;
+    std::vector<std::shared_ptr<Op>> m_cancels;
+    size_t m_pending = 0;
+    bool m_woken = false;
+    bool m_stopping = false;
+
+    // the reactor thread's own
+    std::unordered_set<Op*> m_inflight;
+    std::unordered_map<int, FdState> m_fds;
+    std::vector<std::pair<std::shared_ptr<Op>, int>> m_finished;
+
+    std::atomic<size_t> m_submissions{0};
+    std::thread m_thread;
+  };
+
+  // While a BatchScope is alive, the operations its thread starts are queued
+  // without waking their reactors; they're woken, and submit everything
+  // together, when the outermost scope ends.
+  class BatchScope
+  {
+  public:
+    BatchScope() { ++detail::batchState().depth; }
+
+    ~BatchScope()
+    {
+      detail::BatchState& b = detail::batchState();
+      if (--b.depth > 0)
+        return;
+      std::vector<Reactor*> deferred;
+      deferred.swap(b.deferred);
+      for (Reactor* r : deferred)
+        r->wake();
+    }
+
+    BatchScope(const BatchScope&) = delete;
+    BatchScope& operator=(const BatchScope&) = delete;
+  };
+
+  // The reactor that the operations use unless they're given another.
+  inline Reactor& defaultReactor()
+  {
+    static Reactor reactor;
+    return reactor;
+  }
+
+  namespace detail
+  {
+    template <typename T, typename F>
+    inline auto ioAsync(Reactor& r, Reactor::Request req, F&& convert)
+    {
+      using R = Either<std::error_code, T>;
+      return makeAsyncOp<R>(
+          [r = &r, req = std::move(req), convert = std::forward<F>(convert)]
+          (auto&& cont)
+          {
+            StopToken token = currentStopToken();
+            if (token.stopRequested())
+              return;
+            r->submit(req,
+                      [c = std::forward<decltype(cont)>(cont), convert] (int res) mutable {
+                        if (res < 0)
+                          c(R(std::error_code(-res, std::system_category()), true));
+                        else
+                          c(R(convert(res)));
+                      },
+                      token);
+          });
+    }
+
+    inline Reactor::Request ioRequest(Reactor::Kind k, int fd, void* data = nullptr,
+                                      size_t size = 0)
+    {
+      Reactor::Request req;
+      req.kind = k;
+      req.fd = fd;
+      req.data = data;
+      req.size = size;
+      return req;
+    }
+
+    inline size_t bytes(int res) { return static_cast<size_t>(res); }
+    inline int accepted(int res) { return res; }
+    inline Void connected(int) { return Void(); }
+  }
+
+  // Read up to size bytes from fd into buf.
+  inline auto read(Reactor& r, int fd, void* buf, size_t size)
+  {
+    return detail::ioAsync<size_t>(
+        r, detail::ioRequest(Reactor::Kind::READ, fd, buf, size), detail::bytes);
+  }
+
+  inline auto read(int fd, void* buf, size_t size)
+  {
+    return read(defaultReactor(), fd, buf, size);
+  }
+
+  // Write up to size bytes from buf to fd.
+  inline auto write(Reactor& r, int fd, const void* buf, size_t size)
+  {
+    return detail::ioAsync<size_t>(
+        r, detail::ioRequest(Reactor::Kind::WRITE, fd, const_cast<void*>(buf), size),
+        detail::bytes);
+  }
+
+  inline auto write(int fd, const void* buf, size_t size)
+  {
+    return write(defaultReactor(), fd, buf, size);
+  }
+
+  // Write from a view, keeping its storage alive until the write retires.
+  inline auto write(Reactor& r, int fd, const View<char>& v)
+  {
+    auto req = detail::ioRequest(Reactor::Kind::WRITE, fd,
+                                 const_cast<char*>(v.data()), v.size());
+    req.keep = v.owner();
+    return detail::ioAsync<size_t>(r, std::move(req), detail::bytes);
+  }
+
+  inline auto write(int fd, const View<char>& v)
+  {
+    return write(defaultReactor(), fd, v);
+  }
+
+  // Accept a connection on a listening socket.
+  inline auto accept(Reactor& r, int fd)
+  {
+    return detail::ioAsync<int>(
+        r, detail::ioRequest(Reactor::Kind::ACCEPT, fd), detail::accepted);
+  }
+
+  inline auto accept(int fd)
+  {
+    return accept(defaultReactor(), fd);
+  }
+
+  // Connect a socket to a peer.
+  inline auto connect(Reactor& r, int fd, const sockaddr* addr, socklen_t len)
+  {
+    auto req = detail::ioRequest(Reactor::Kind::CONNECT, fd);
+    std::memcpy(&req.addr, addr, std::min<size_t>(len, sizeof(req.addr)));
+    req.addrLen = len;
+    return detail::ioAsync<Void>(r, std::move(req), detail::connected);
+  }
+
+  inline auto connect(int fd, const sockaddr* addr, socklen_t len)
+  {
+    return connect(defaultReactor(), fd, addr, len);
+  }
+
+  // Start an Async under a BatchScope, so that the operations it starts at
+  // once are submitted together.
+  template <typename AA,
+            // constraint: AA must be an Async<A>
+            typename A = FromAsyncT<AA>>
+  inline auto batched(AA&& aa)
+  {
+    return makeStage<A>(
+        [] (auto& aa1, auto&& cont)
+        {
+          BatchScope scope;
+          aa1(std::forward<decltype(cont)>(cont));
+        }, std::forward<AA>(aa));
+  }
+}
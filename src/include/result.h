@@ -0,0 +1,376 @@
+#pragma once
+
+#include "async.h"
+#include "cancellation.h"
+#include "either.h"
+#include "trampoline.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Errors: an AsyncResult<T, E> is an Async that delivers an Either<E, T>, with
+// the error on the Left.
+//
+// The combinators in async::result pass errors through untouched: fmap and bind
+// only see values, and an error skips every stage until something recovers it.
+// when_all fails fast: the first error is delivered at once, and the branches
+// still running are stopped (through the stop token they were started under,
+// as with race), rather than waited for. recover handles an error with another
+// AsyncResult, and retry runs an operation again until it succeeds or its
+// attempts are used up.
+
+template <typename T, typename E>
+using AsyncResult = Async<Either<E, T>>;
+
+namespace async
+{
+  namespace result
+  {
+    namespace detail
+    {
+      // ResultTraits<Either<E, T>> names the error and value types
+      template <typename R>
+      struct ResultTraits
+      {
+      };
+
+      template <typename E, typename T>
+      struct ResultTraits<Either<E, T>>
+      {
+        using error = E;
+        using value = T;
+      };
+
+      template <typename AA>
+      using ErrorT = typename ResultTraits<FromAsyncT<AA>>::error;
+
+      template <typename AA>
+      using ValueT = typename ResultTraits<FromAsyncT<AA>>::value;
+    }
+
+    // Lift a value into a successful result.
+    template <typename E, typename T>
+    inline auto success(T&& t)
+    {
+      return pure(Either<E, std::decay_t<T>>(std::forward<T>(t)));
+    }
+
+    // Lift an error into a failed result.
+    template <typename T, typename E>
+    inline auto failure(E&& e)
+    {
+      return pure(Either<std::decay_t<E>, T>(std::forward<E>(e), true));
+    }
+
+    // Apply f to the value, if there is one.
+    template <typename F, typename AA,
+              // constraint: AA must be an AsyncResult
+              typename E = detail::ErrorT<AA>,
+              typename T = detail::ValueT<AA>>
+    inline auto fmap(F&& f, AA&& aa)
+    {
+      using U = std::decay_t<decltype(std::declval<F&>()(std::declval<T&&>()))>;
+      using R = Either<E, U>;
+
+      return makeStage<R>(
+          [] (auto& f1, auto& aa1, auto&& cont)
+          {
+            aa1([c = std::forward<decltype(cont)>(cont),
+                 f2 = async::detail::take(f1)]
+                (Either<E, T>&& e) mutable {
+                if (!e.isRight())
+                  return c(R(std::move(e.m_left), true));
+                c(R(f2(std::move(e.m_right))));
+              });
+          }, std::forward<F>(f), std::forward<AA>(aa));
+    }
+
+    // Bind the value to f, which returns another AsyncResult with the same
+    // error type; an error is passed on without calling f. As with
+    // async::bind, the second stage is started through bounce(), under the
+    // stop token and memory resource that were current when the bind was.
+    template <typename F, typename AA,
+              // constraint: AA must be an AsyncResult
+              typename E = detail::ErrorT<AA>,
+              typename T = detail::ValueT<AA>>
+    inline auto bind(AA&& aa, F&& f)
+    {
+      using AB = decltype(std::declval<F&>()(std::declval<T&&>()));
+      using R = FromAsyncT<AB>;
+      static_assert(std::is_same<detail::ErrorT<AB>, E>::value,
+                    "result::bind can't change the error type; use recover");
+
+      return makeStage<R>(
+          [] (auto& f1, auto& aa1, auto&& cont)
+          {
+            using C = decltype(cont);
+            aa1([c = std::forward<C>(cont), f2 = async::detail::take(f1),
+                 token = currentStopToken(), r = currentResource()]
+                (Either<E, T>&& e) mutable {
+                if (!e.isRight())
+                  return c(R(std::move(e.m_left), true));
+                if (token.stopRequested())
+                  return;
+                bounce([c = std::move(c), f2 = std::move(f2),
+                        token = std::move(token), r, t = std::move(e.m_right)]
+                       () mutable {
+                    StopScope scope(std::move(token));
+                    ResourceScope rscope(r);
+                    f2(std::move(t))(std::move(c));
+                  });
+              });
+          }, std::forward<F>(f), std::forward<AA>(aa));
+    }
+
+    // Handle an error with f, which returns an AsyncResult for the same value
+    // type (and any error type); a value is passed on without calling f.
+    template <typename F, typename AA,
+              // constraint: AA must be an AsyncResult
+              typename E = detail::ErrorT<AA>,
+              typename T = detail::ValueT<AA>>
+    inline auto recover(AA&& aa, F&& f)
+    {
+      using AB = decltype(std::declval<F&>()(std::declval<E&&>()));
+      using R = FromAsyncT<AB>;
+      static_assert(std::is_same<detail::ValueT<AB>, T>::value,
+                    "recover must produce the same value type");
+
+      return makeStage<R>(
+          [] (auto& f1, auto& aa1, auto&& cont)
+          {
+            using C = decltype(cont);
+            aa1([c = std::forward<C>(cont), f2 = async::detail::take(f1),
+                 token = currentStopToken(), r = currentResource()]
+                (Either<E, T>&& e) mutable {
+                if (e.isRight())
+                  return c(R(std::move(e.m_right)));
+                if (token.stopRequested())
+                  return;
+                bounce([c = std::move(c), f2 = std::move(f2),
+                        token = std::move(token), r, err = std::move(e.m_left)]
+                       () mutable {
+                    StopScope scope(std::move(token));
+                    ResourceScope rscope(r);
+                    f2(std::move(err))(std::move(c));
+                  });
+              });
+          }, std::forward<F>(f), std::forward<AA>(aa));
+    }
+
+    namespace detail
+    {
+      template <typename F, typename C>
+      struct RetryData
+      {
+        RetryData(F&& fn, size_t n, C&& c)
+          : f(std::move(fn)), attemptsLeft(n), cont(std::move(c)),
+            token(currentStopToken()), resource(currentResource())
+        {}
+
+        template <typename E, typename T>
+        static void attempt(const std::shared_ptr<RetryData>& pData)
+        {
+          bounce([pData] () {
+              StopScope scope(pData->token);
+              ResourceScope rscope(pData->resource);
+              pData->f()([pData] (Either<E, T>&& e) {
+                  if (e.isRight() || --pData->attemptsLeft == 0)
+                    return pData->cont(std::move(e));
+                  if (pData->token.stopRequested())
+                    return;
+                  attempt<E, T>(pData);
+                });
+            });
+        }
+
+        F f;
+        size_t attemptsLeft;
+        C cont;
+        StopToken token;
+        MemoryResource* resource;
+      };
+    }
+
+    // Call f (which returns an AsyncResult) and run what it returns, up to
+    // attempts times, until it succeeds; the result is the first success, or
+    // the last error. A new Async is made for each attempt. No more attempts
+    // are made once the stop token current at the start is stopped.
+    template <typename F,
+              typename AA = decltype(std::declval<std::decay_t<F>&>()()),
+              // constraint: f must return an AsyncResult
+              typename E = detail::ErrorT<AA>,
+              typename T = detail::ValueT<AA>>
+    inline auto retry(F&& f, size_t attempts)
+    {
+      using G = std::decay_t<F>;
+
+      return makeStage<Either<E, T>>(
+          [] (auto& f1, auto& attempts, auto&& cont)
+          {
+            using C = std::decay_t<decltype(cont)>;
+            using D = detail::RetryData<G, C>;
+            detail::RetryData<G, C>::template attempt<E, T>(
+                allocateShared<D>(async::detail::take(f1), attempts,
+                                  std::forward<decltype(cont)>(cont)));
+          }, std::forward<F>(f), std::max<size_t>(attempts, 1));
+    }
+
+    namespace detail
+    {
+      // Join state for a fail-fast when_all: race's continuation, stop state
+      // and first-wins flag, plus a slot for each value and a countdown. The
+      // first error wins outright; otherwise the last value to arrive does.
+      template <typename C, typename E, typename... T>
+      struct WhenAllData : async::detail::RaceData<C>
+      {
+        explicit WhenAllData(C&& c)
+          : async::detail::RaceData<C>(std::move(c), "result::when_all"),
+            arrived{}, remaining(sizeof...(T))
+        {}
+
+        ~WhenAllData() { destroy(std::index_sequence_for<T...>()); }
+
+        template <size_t I, typename U>
+        inline void arrive(Either<E, U> e)
+        {
+          TracePolicy::arrive(*this, I);
+          if (!e.isRight())
+          {
+            if (this->claim(I))
+              this->win(Either<E, std::tuple<T...>>(std::move(e.m_left), true));
+            return;
+          }
+          std::get<I>(slots).construct(std::move(e.m_right));
+          arrived[I] = true;
+          if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1 &&
+              this->claim(I))
+            complete(std::index_sequence_for<T...>());
+        }
+
+        template <size_t... I>
+        inline void complete(std::index_sequence<I...>)
+        {
+          this->win(Either<E, std::tuple<T...>>(
+              std::tuple<T...>(std::move(std::get<I>(slots).get())...)));
+        }
+
+        template <size_t... I>
+        inline void destroy(std::index_sequence<I...>)
+        {
+          int dummy[] = { 0, (arrived[I] ? (std::get<I>(slots).destroy(), 0) : 0)... };
+          static_cast<void>(dummy);
+        }
+
+        std::tuple<async::detail::Slot<T>...> slots;
+        bool arrived[sizeof...(T)];
+        std::atomic<size_t> remaining;
+      };
+
+      // The same for a range.
+      template <typename C, typename E, typename T>
+      struct WhenAllRangeData : async::detail::RaceData<C>
+      {
+        WhenAllRangeData(C&& c, size_t n)
+          : async::detail::RaceData<C>(std::move(c), "result::when_all"),
+            values(n), remaining(n)
+        {}
+
+        inline void arrive(size_t i, Either<E, T>&& e)
+        {
+          const unsigned branch = static_cast<unsigned>(i);
+          TracePolicy::arrive(*this, branch);
+          if (!e.isRight())
+          {
+            if (this->claim(branch))
+              this->win(Either<E, std::vector<T>>(std::move(e.m_left), true));
+            return;
+          }
+          values.set(i, std::move(e.m_right));
+          if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1 &&
+              this->claim(branch))
+            this->win(Either<E, std::vector<T>>(values.release()));
+        }
+
+        async::detail::RangeResults<T> values;
+        std::atomic<size_t> remaining;
+      };
+
+      // Start each branch in order, until one fails.
+      template <typename D, typename Tuple, size_t... I>
+      inline void startAll(const std::shared_ptr<D>& pData, Tuple& asyncs,
+                           std::index_sequence<I...>)
+      {
+        bool dummy[] = { true, (!pData->stopState.stopRequested() &&
+          (std::get<I>(asyncs)([pData] (auto&& e) {
+              pData->template arrive<I>(std::forward<decltype(e)>(e));
+            }), true))... };
+        static_cast<void>(dummy);
+      }
+    }
+
+    // Run AsyncResults concurrently: the values in a tuple if they all
+    // succeed, or the first error, as soon as there is one. The branches are
+    // started under a stop token that is stopped when the join completes (or
+    // when the enclosing token is), so that an error stops the others.
+    template <typename... AA,
+              // constraint: each AA must be an AsyncResult
+              typename E = std::common_type_t<detail::ErrorT<AA>...>,
+              typename = std::tuple<detail::ValueT<AA>...>>
+    inline auto when_all(AA&&... aa)
+    {
+      static_assert(sizeof...(AA) > 0, "when_all needs at least one Async");
+      static_assert(
+          std::is_same<std::tuple<E, detail::ErrorT<AA>...>,
+                       std::tuple<detail::ErrorT<AA>..., E>>::value,
+          "result::when_all needs one error type");
+      using R = Either<E, std::tuple<detail::ValueT<AA>...>>;
+
+      return makeStage<R>(
+          [] (auto& asyncs, auto&& cont)
+          {
+            using C = std::decay_t<decltype(cont)>;
+            using D = detail::WhenAllData<C, E, detail::ValueT<AA>...>;
+            auto pData = async::detail::makeRaceData<D>(
+                std::forward<decltype(cont)>(cont));
+            StopScope scope(async::detail::raceToken(pData));
+            detail::startAll(pData, asyncs, std::index_sequence_for<AA...>());
+          }, std::make_tuple(std::forward<AA>(aa)...));
+    }
+
+    // The same for a range of AsyncResults of the same type.
+    template <typename AA,
+              // constraint: AA must be an AsyncResult
+              typename E = detail::ErrorT<AA>,
+              typename T = detail::ValueT<AA>>
+    inline auto when_all(std::vector<AA> asyncs)
+    {
+      using R = Either<E, std::vector<T>>;
+
+      return makeStage<R>(
+          [] (auto& asyncs, auto&& cont)
+          {
+            if (asyncs.empty())
+              return cont(R(std::vector<T>()));
+
+            using C = std::decay_t<decltype(cont)>;
+            using D = detail::WhenAllRangeData<C, E, T>;
+            auto pData = async::detail::makeRaceData<D>(
+                std::forward<decltype(cont)>(cont), asyncs.size());
+            StopScope scope(async::detail::raceToken(pData));
+            for (size_t i = 0;
+                 i < asyncs.size() && !pData->stopState.stopRequested(); ++i)
+            {
+              asyncs[i]([pData, i] (Either<E, T>&& e) {
+                  pData->arrive(i, std::move(e));
+                });
+            }
+          }, std::move(asyncs));
+    }
+  }
+}
@@ -0,0 +1,228 @@
+#pragma once
+
+#include "async.h"
+
+#include <atomic>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// Sharing one Async between many consumers.
+//
+// Invoking an Async runs its whole upstream chain, so two consumers of the same
+// expression would do the work twice. share(a) returns a SharedAsync, a
+// copyable handle that runs a once (when it's first invoked) and gives the
+// result to every continuation passed to it, before or after completion.
+// Continuations that arrive while a is in flight are queued on a lock-free
+// list; the rest are called immediately. Each is given the cached value by
+// const reference if it accepts one, and a copy otherwise.
+//
+// The upstream Async is boxed on the global heap, not in the memory resource
+// current where it's shared, and started under an empty stop token with no
+// resource current, rather than under the context of whichever consumer
+// happens to invoke it first, since it serves them all and can outlive any of
+// them.
+
+namespace async
+{
+  namespace detail
+  {
+    // CallableWith<C, std::tuple<Args...>>::value is true if a C lvalue can be
+    // called with Args...
+    template <typename C, typename Args, typename = void>
+    struct CallableWith : std::false_type {};
+
+    template <typename C, typename... Args>
+    struct CallableWith<C, std::tuple<Args...>,
+                        decltype(void(std::declval<C&>()(std::declval<Args>()...)))>
+      : std::true_type {};
+
+    // The cached result of a SharedAsync.
+    template <typename T>
+    struct SharedValue
+    {
+      using Receiver = UniqueFunction<void (const T&)>;
+
+      template <typename C>
+      static Receiver receiver(C&& c)
+      {
+        using D = std::decay_t<C>;
+        return [c = std::forward<C>(c)] (const T& t) mutable {
+          deliver(c, t, CallableWith<D, std::tuple<const T&>>());
+        };
+      }
+
+      template <typename C>
+      static void deliver(C& c, const T& t, std::true_type) { c(t); }
+      template <typename C>
+      static void deliver(C& c, const T& t, std::false_type) { c(T(t)); }
+
+      template <typename... U>
+      void set(U&&... u) { m_value.construct(std::forward<U>(u)...); }
+      void destroy() { m_value.destroy(); }
+      void call(const Receiver& r) { r(m_value.get()); }
+
+      Slot<T> m_value;
+    };
+
+    template <>
+    struct SharedValue<void>
+    {
+      using Receiver = UniqueFunction<void ()>;
+
+      template <typename C>
+      static Receiver receiver(C&& c) { return std::forward<C>(c); }
+
+      void set() {}
+      void destroy() {}
+      void call(const Receiver& r) { r(); }
+    };
+
+    template <typename T>
+    class SharedState
+      : public std::enable_shared_from_this<SharedState<T>>
+    {
+      using Receiver = typename SharedValue<T>::Receiver;
+
+      // The queue is a Treiber stack; once the value is set, the head is
+      // swapped for a sentinel that means "done", and no more are queued.
+      struct Waiter
+      {
+        Receiver receiver;
+        Waiter* next;
+      };
+
+    public:
+      explicit SharedState(Async<T>&& upstream)
+        : m_upstream(std::move(upstream)), m_started(false), m_waiters(nullptr)
+      {}
+
+      ~SharedState()
+      {
+        Waiter* w = m_waiters.load(std::memory_order_acquire);
+        if (w == done())
+        {
+          m_value.destroy();
+          return;
+        }
+        while (w)
+        {
+          Waiter* next = w->next;
+          delete w;
+          w = next;
+        }
+      }
+
+      template <typename C>
+      void subscribe(C&& c)
+      {
+        Waiter* head = m_waiters.load(std::memory_order_acquire);
+        if (head == done())
+          return m_value.call(SharedValue<T>::receiver(std::forward<C>(c)));
+
+        std::unique_ptr<Waiter> w(
+            new Waiter{ SharedValue<T>::receiver(std::forward<C>(c)), head });
+        do
+        {
+          w->next = head;
+          if (m_waiters.compare_exchange_weak(head, w.get(),
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_acquire))
+          {
+            w.release();
+            start();
+            return;
+          }
+        } while (head != done());
+
+        // the value arrived while we were queueing
+        m_value.call(w->receiver);
+      }
+
+    private:
+      Waiter* done() { return reinterpret_cast<Waiter*>(this); }
+
+      void start()
+      {
+        if (m_started.exchange(true, std::memory_order_acq_rel))
+          return;
+        Async<T> upstream = std::move(m_upstream);
+        StopScope scope{StopToken()};
+        ResourceScope rscope(nullptr);
+        upstream([self = this->shared_from_this()] (auto&&... t) {
+            self->complete(std::forward<decltype(t)>(t)...);
+          });
+      }
+
+      // publish the value, then run the queue in the order it was built
+      template <typename... U>
+      void complete(U&&... u)
+      {
+        m_value.set(std::forward<U>(u)...);
+        Waiter* w = m_waiters.exchange(done(), std::memory_order_acq_rel);
+        Waiter* fifo = nullptr;
+        while (w)
+        {
+          Waiter* next = w->next;
+          w->next = fifo;
+          fifo = w;
+          w = next;
+        }
+        while (fifo)
+        {
+          std::unique_ptr<Waiter> current(fifo);
+          fifo = fifo->next;
+          m_value.call(current->receiver);
+        }
+      }
+
+      Async<T> m_upstream;
+      std::atomic<bool> m_started;
+      std::atomic<Waiter*> m_waiters;
+      SharedValue<T> m_value;
+    };
+  }
+}
+
+// A handle on a shared Async: copies share the one execution and result.
+template <typename T>
+class SharedAsync
+{
+public:
+  using type = T;
+
+  explicit SharedAsync(std::shared_ptr<async::detail::SharedState<T>> state)
+    : m_state(std::move(state))
+  {}
+
+  template <typename C>
+  inline void operator()(C&& cont) const
+  {
+    m_state->subscribe(std::forward<C>(cont));
+  }
+
+private:
+  std::shared_ptr<async::detail::SharedState<T>> m_state;
+};
+
+namespace async
+{
+  template <typename T>
+  struct FromAsync<SharedAsync<T>>
+  {
+    using type = T;
+  };
+
+  // Run an Async at most once, for any number of consumers.
+  template <typename AA,
+            // constraint: AA must be an Async<A>
+            typename A = FromAsyncT<AA>>
+  inline SharedAsync<A> share(AA&& aa)
+  {
+    ResourceScope rscope(nullptr);
+    return SharedAsync<A>(std::make_shared<detail::SharedState<A>>(
+        Async<A>(std::forward<AA>(aa))));
+  }
+}
@@ -0,0 +1,437 @@
+#pragma once
+
+#include "async.h"
+#include "either.h"
+#include "trampoline.h"
+#include "unique_function.h"
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Streams: an AsyncStream<T> delivers any number of values, on demand.
+//
+// A stream is pulled: nextChunk(n) is an Async for up to n elements (at least
+// one), or for an empty chunk once the stream has ended, and next() is an Async
+// for just one. Nothing is produced until it's asked for, which is where the
+// backpressure comes from. Elements move in chunks, so each continuation call
+// can carry a whole page of them; map, filter and take work a chunk at a time
+// too. buffer(n) reads ahead of the consumer, and merge interleaves several
+// streams as their elements arrive.
+//
+// Only one pull may be outstanding on a stream at once: pull again from the
+// continuation of the last one. The operators consume the stream they're
+// applied to.
+
+template <typename T>
+class AsyncStream
+{
+public:
+  using type = T;
+  using Chunk = std::vector<T>;
+  // Called with the most elements wanted, and the continuation to pass them to.
+  using Puller = UniqueFunction<void (size_t, ContinuationT<Chunk>)>;
+
+  explicit AsyncStream(Puller p)
+    : m_pull(std::make_shared<Puller>(std::move(p)))
+  {}
+
+  AsyncStream(AsyncStream&&) = default;
+  AsyncStream& operator=(AsyncStream&&) = default;
+  AsyncStream(const AsyncStream&) = delete;
+  AsyncStream& operator=(const AsyncStream&) = delete;
+
+  // Up to max elements, or an empty chunk at the end.
+  auto nextChunk(size_t max) const
+  {
+    return async::makeAsyncOp<Chunk>(
+        [p = m_pull, max = std::max<size_t>(max, 1)] (auto&& cont)
+        {
+          (*p)(max, ContinuationT<Chunk>(std::forward<decltype(cont)>(cont)));
+        });
+  }
+
+  // The next element on the Right, or a Void on the Left at the end.
+  auto next() const
+  {
+    return async::fmap(
+        [] (Chunk c) {
+          return c.empty() ? Either<async::Void, T>(async::Void(), true)
+                           : Either<async::Void, T>(std::move(c.front()));
+        },
+        nextChunk(1));
+  }
+
+  // Each element transformed by f.
+  template <typename F,
+            typename U = std::decay_t<decltype(std::declval<F&>()(std::declval<T&&>()))>>
+  AsyncStream<U> map(F&& f) &&
+  {
+    using S = Map<std::decay_t<F>>;
+    auto s = std::make_shared<S>(S{ std::move(m_pull), std::forward<F>(f) });
+    return AsyncStream<U>(
+        [s] (size_t n, ContinuationT<std::vector<U>> c) {
+          (*s->up)(n, [s, c = std::move(c)] (Chunk in) mutable {
+              std::vector<U> out;
+              out.reserve(in.size());
+              for (auto& t : in)
+                out.push_back(s->f(std::move(t)));
+              c(std::move(out));
+            });
+        });
+  }
+
+  // Only the elements that satisfy p. Chunks that p empties are skipped.
+  template <typename P>
+  AsyncStream filter(P&& p) &&
+  {
+    using S = Filter<std::decay_t<P>>;
+    auto s = std::make_shared<S>(S{ std::move(m_pull), std::forward<P>(p) });
+    return AsyncStream(
+        [s] (size_t n, ContinuationT<Chunk> c) { S::pull(s, n, std::move(c)); });
+  }
+
+  // At most the first n elements.
+  AsyncStream take(size_t n) &&
+  {
+    auto s = std::make_shared<Take>(Take{ std::move(m_pull), n });
+    return AsyncStream(
+        [s] (size_t max, ContinuationT<Chunk> c) {
+          if (s->remaining == 0)
+            return c(Chunk());
+          (*s->up)(std::min(max, s->remaining),
+                   [s, c = std::move(c)] (Chunk chunk) mutable {
+                     s->remaining -= std::min(s->remaining, chunk.size());
+                     c(std::move(chunk));
+                   });
+        });
+  }
+
+  // Read up to n elements ahead of the consumer. While there's room, the
+  // upstream is kept busy; while the buffer is full, it isn't pulled at all.
+  AsyncStream buffer(size_t n) &&
+  {
+    auto s = std::make_shared<Buffer>(std::move(m_pull), std::max<size_t>(n, 1));
+    return AsyncStream(
+        [s] (size_t max, ContinuationT<Chunk> c) { s->pull(max, std::move(c)); });
+  }
+
+  // the raw pull, for combinators
+  const std::shared_ptr<Puller>& puller() const { return m_pull; }
+
+private:
+  // The operators' state is shared with the continuations of their pulls,
+  // which may outlive the stream.
+  template <typename F>
+  struct Map
+  {
+    std::shared_ptr<Puller> up;
+    F f;
+  };
+
+  struct Take
+  {
+    std::shared_ptr<Puller> up;
+    size_t remaining;
+  };
+
+  template <typename P>
+  struct Filter
+  {
+    static void pull(const std::shared_ptr<Filter>& s, size_t n,
+                     ContinuationT<Chunk> c)
+    {
+      (*s->up)(n, [s, n, c = std::move(c)] (Chunk chunk) mutable {
+          if (chunk.empty())
+            return c(std::move(chunk));
+          chunk.erase(std::remove_if(chunk.begin(), chunk.end(),
+                                     [&s] (const T& t) { return !s->p(t); }),
+                      chunk.end());
+          if (!chunk.empty())
+            return c(std::move(chunk));
+          async::bounce([s, n, c = std::move(c)] () mutable {
+              pull(s, n, std::move(c));
+            });
+        });
+    }
+
+    std::shared_ptr<Puller> up;
+    P p;
+  };
+
+  // The pending consumer, if there is one, is served as soon as elements
+  // arrive. Continuations are called outside the lock.
+  struct Buffer : std::enable_shared_from_this<Buffer>
+  {
+    Buffer(std::shared_ptr<Puller> p, size_t n)
+      : up(std::move(p)), capacity(n)
+    {}
+
+    void pull(size_t max, ContinuationT<Chunk> c)
+    {
+      Chunk out;
+      bool ready = true;
+      {
+        std::lock_guard<std::mutex> g(mutex);
+        if (items.empty() && !ended)
+        {
+          waiter = std::move(c);
+          waiterMax = max;
+          ready = false;
+        }
+        else
+          out = takeLocked(max);
+      }
+      if (ready)
+        c(std::move(out));
+      refill();
+    }
+
+    void refill()
+    {
+      size_t want;
+      {
+        std::lock_guard<std::mutex> g(mutex);
+        if (fetching || ended || items.size() >= capacity)
+          return;
+        fetching = true;
+        want = capacity - items.size();
+      }
+      async::bounce([self = this->shared_from_this(), want] () {
+          (*self->up)(want, [self] (Chunk chunk) { self->arrive(std::move(chunk)); });
+        });
+    }
+
+    void arrive(Chunk chunk)
+    {
+      ContinuationT<Chunk> c;
+      Chunk out;
+      {
+        std::lock_guard<std::mutex> g(mutex);
+        fetching = false;
+        if (chunk.empty())
+          ended = true;
+        for (auto& t : chunk)
+          items.push_back(std::move(t));
+        if (waiter)
+        {
+          c = std::move(waiter);
+          waiter = nullptr;
+          out = takeLocked(waiterMax);
+        }
+      }
+      if (c)
+        c(std::move(out));
+      refill();
+    }
+
+    Chunk takeLocked(size_t max)
+    {
+      Chunk out;
+      size_t n = std::min(max, items.size());
+      out.reserve(n);
+      for (size_t i = 0; i < n; ++i)
+      {
+        out.push_back(std::move(items.front()));
+        items.pop_front();
+      }
+      return out;
+    }
+
+    std::shared_ptr<Puller> up;
+    const size_t capacity;
+
+    std::mutex mutex;
+    std::deque<T> items;
+    bool fetching = false;
+    bool ended = false;
+    ContinuationT<Chunk> waiter;
+    size_t waiterMax = 0;
+  };
+
+  std::shared_ptr<Puller> m_pull;
+};
+
+namespace async
+{
+  namespace detail
+  {
+    // Elements gathered from whichever streams have produced them. Each input
+    // has at most one pull outstanding, and none is pulled until the consumer
+    // has drained what's already gathered.
+    template <typename T>
+    struct MergeState : std::enable_shared_from_this<MergeState<T>>
+    {
+      using Chunk = std::vector<T>;
+      using Puller = typename AsyncStream<T>::Puller;
+
+      struct Input
+      {
+        std::shared_ptr<Puller> pull;
+        bool fetching = false;
+        bool ended = false;
+      };
+
+      explicit MergeState(std::vector<AsyncStream<T>> streams)
+        : live(streams.size())
+      {
+        for (auto& s : streams)
+          inputs.push_back(Input{ s.puller(), false, false });
+      }
+
+      void pull(size_t max, ContinuationT<Chunk> c)
+      {
+        Chunk out;
+        bool ready = true;
+        std::vector<size_t> start;
+        {
+          std::lock_guard<std::mutex> g(mutex);
+          if (items.empty() && live > 0)
+          {
+            waiter = std::move(c);
+            waiterMax = max;
+            ready = false;
+            for (size_t i = 0; i < inputs.size(); ++i)
+              if (!inputs[i].fetching && !inputs[i].ended)
+              {
+                inputs[i].fetching = true;
+                start.push_back(i);
+              }
+          }
+          else
+            out = takeLocked(max);
+        }
+        if (ready)
+          return c(std::move(out));
+        for (size_t i : start)
+          (*inputs[i].pull)(max, [self = this->shared_from_this(), i] (Chunk chunk) {
+              self->arrive(i, std::move(chunk));
+            });
+      }
+
+      void arrive(size_t i, Chunk chunk)
+      {
+        ContinuationT<Chunk> c;
+        Chunk out;
+        {
+          std::lock_guard<std::mutex> g(mutex);
+          inputs[i].fetching = false;
+          if (chunk.empty())
+          {
+            inputs[i].ended = true;
+            --live;
+          }
+          for (auto& t : chunk)
+            items.push_back(std::move(t));
+          if (waiter && (!items.empty() || live == 0))
+          {
+            c = std::move(waiter);
+            waiter = nullptr;
+            out = takeLocked(waiterMax);
+          }
+        }
+        if (c)
+          c(std::move(out));
+      }
+
+      Chunk takeLocked(size_t max)
+      {
+        Chunk out;
+        size_t n = std::min(max, items.size());
+        out.reserve(n);
+        for (size_t j = 0; j < n; ++j)
+        {
+          out.push_back(std::move(items.front()));
+          items.pop_front();
+        }
+        return out;
+      }
+
+      std::vector<Input> inputs;
+      size_t live;
+
+      std::mutex mutex;
+      std::deque<T> items;
+      ContinuationT<Chunk> waiter;
+      size_t waiterMax = 0;
+    };
+
+    template <typename T>
+    struct CollectState
+    {
+      static void step(const std::shared_ptr<CollectState>& s)
+      {
+        bounce([s] () {
+            (*s->up)(s->chunkSize, [s] (std::vector<T> chunk) {
+                if (chunk.empty())
+                  return s->cont(std::move(s->out));
+                for (auto& t : chunk)
+                  s->out.push_back(std::move(t));
+                step(s);
+              });
+          });
+      }
+
+      std::shared_ptr<typename AsyncStream<T>::Puller> up;
+      size_t chunkSize;
+      ContinuationT<std::vector<T>> cont;
+      std::vector<T> out;
+    };
+  }
+
+  // A stream of the elements of a vector.
+  template <typename T>
+  inline AsyncStream<T> stream(std::vector<T> ts)
+  {
+    return AsyncStream<T>(
+        [ts = std::move(ts), pos = size_t(0)]
+        (size_t max, ContinuationT<std::vector<T>> c) mutable {
+          size_t n = std::min(max, ts.size() - pos);
+          std::vector<T> chunk(std::make_move_iterator(ts.begin() + pos),
+                               std::make_move_iterator(ts.begin() + pos + n));
+          pos += n;
+          c(std::move(chunk));
+        });
+  }
+
+  // Interleave streams, in the order their elements arrive. The merged stream
+  // ends when all of them have.
+  template <typename T>
+  inline AsyncStream<T> merge(std::vector<AsyncStream<T>> streams)
+  {
+    auto s = std::make_shared<detail::MergeState<T>>(std::move(streams));
+    return AsyncStream<T>(
+        [s] (size_t max, ContinuationT<std::vector<T>> c) {
+          s->pull(max, std::move(c));
+        });
+  }
+
+  template <typename T>
+  inline AsyncStream<T> merge(AsyncStream<T> a, AsyncStream<T> b)
+  {
+    std::vector<AsyncStream<T>> streams;
+    streams.push_back(std::move(a));
+    streams.push_back(std::move(b));
+    return merge(std::move(streams));
+  }
+
+  // An Async for all of a stream's elements, pulled chunkSize at a time.
+  template <typename T>
+  inline auto collect(AsyncStream<T> s, size_t chunkSize = 64)
+  {
+    return makeAsyncOp<std::vector<T>>(
+        [up = s.puller(), chunkSize = std::max<size_t>(chunkSize, 1)]
+        (auto&& cont) {
+          using S = detail::CollectState<T>;
+          detail::CollectState<T>::step(std::make_shared<S>(S{
+                up, chunkSize,
+                ContinuationT<std::vector<T>>(std::forward<decltype(cont)>(cont)),
+                std::vector<T>() }));
+        });
+  }
+}
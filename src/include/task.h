@@ -0,0 +1,449 @@
+#pragma once
+
+#if !defined(__cpp_impl_coroutine)
+#error "task.h requires C++20 coroutines"
+#endif
+
+#include "async.h"
+
+#include <atomic>
+#include <cassert>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <new>
+#include <optional>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// Coroutine support: any Async can be co_awaited, and Task<T> is a coroutine
+// return type that is itself an Async<T>, so sequential async logic can be
+// written as straight-line code:
+//
+//   Task<char> firstChar(int i)
+//   {
+//     string s = co_await AsyncToString(i);
+//     co_return s[0];
+//   }
+//
+// A Task is lazy: its body starts running when it is given a continuation, and
+// it can only be run once. Its coroutine frame is allocated with the allocator
+// passed after std::allocator_arg as the coroutine's leading arguments, if any,
+// and otherwise from the current MemoryResource:
+//
+//   Task<int> f(std::allocator_arg_t, ResourceAllocator<char> alloc, int x);
+//
+// An exception that escapes a Task's body is rethrown from the co_await of the
+// coroutine awaiting the Task, if there is one. An Async has no way to
+// deliver an exception, so a Task that is run by anything else (a
+// continuation, or a combinator) has nowhere to send it, and std::terminate is
+// called.
+
+template <typename T>
+class Task;
+
+namespace async
+{
+  namespace detail
+  {
+    template <typename T, typename Alloc, typename... Args>
+    struct AllocatedTaskPromise;
+
+    // Where a Task sends an exception that escapes its body: the awaiter of
+    // the coroutine awaiting it.
+    struct TaskErrorSink
+    {
+      void (*fail)(void*, std::exception_ptr);
+      void* awaiter;
+    };
+
+    // Registers an awaiter's sink with what it awaits, if that's a Task.
+    struct TaskErrors
+    {
+      template <typename AA>
+      static void sink(AA&, const TaskErrorSink&) {}
+
+      template <typename T>
+      static void sink(Task<T>& t, const TaskErrorSink& s)
+      {
+        t.m_promise->m_sink = s;
+      }
+    };
+
+    // Where an awaiter keeps the value it is waiting for. A borrowed value
+    // (from an Async<T&&> or Async<const T&>) is only valid while the
+    // continuation runs, which may be before the coroutine resumes, so like
+    // bind, the awaiter takes its own copy (a move, for T&&).
+    template <typename T>
+    struct AwaitResult
+    {
+      using value_type = std::decay_t<T>;
+
+      AwaitResult() = default;
+      AwaitResult(const AwaitResult&) = delete;
+      AwaitResult& operator=(const AwaitResult&) = delete;
+
+      ~AwaitResult()
+      {
+        if (m_set)
+          m_value.destroy();
+      }
+
+      template <typename U>
+      void set(U&& u)
+      {
+        m_value.construct(std::forward<U>(u));
+        m_set = true;
+      }
+
+      value_type get() { return std::move(m_value.get()); }
+
+      Slot<value_type> m_value;
+      bool m_set = false;
+    };
+
+    template <>
+    struct AwaitResult<void>
+    {
+      using value_type = void;
+
+      void set() {}
+      void get() {}
+    };
+
+    // Awaits an Async by passing it a continuation that resumes the coroutine.
+    // If the Async completes before it returns, the coroutine doesn't suspend
+    // at all; otherwise it is resumed, on whichever thread completes the Async,
+    // under the stop token and memory resource that were current when it
+    // suspended. An awaited Task that throws resumes it the same way, to
+    // rethrow the exception.
+    template <typename AA, typename T>
+    struct AsyncAwaiter : AwaitResult<T>
+    {
+      explicit AsyncAwaiter(AA&& aa) : m_async(std::move(aa)) {}
+
+      bool await_ready() const noexcept { return false; }
+
+      bool await_suspend(std::coroutine_handle<> h)
+      {
+        m_handle = h;
+        m_token = currentStopToken();
+        m_resource = currentResource();
+        TaskErrors::sink(m_async, TaskErrorSink{ &AsyncAwaiter::fail, this });
+        m_async([this] (auto&&... t) {
+            this->set(std::forward<decltype(t)>(t)...);
+            arrive();
+          });
+        return !m_done.exchange(true, std::memory_order_acq_rel);
+      }
+
+      typename AwaitResult<T>::value_type await_resume()
+      {
+        if (m_error)
+          std::rethrow_exception(m_error);
+        return this->get();
+      }
+
+      static void fail(void* self, std::exception_ptr e)
+      {
+        AsyncAwaiter* a = static_cast<AsyncAwaiter*>(self);
+        a->m_error = std::move(e);
+        a->arrive();
+      }
+
+      // the second of the Async and await_suspend to finish resumes
+      void arrive()
+      {
+        if (m_done.exchange(true, std::memory_order_acq_rel))
+        {
+          StopScope scope(std::move(m_token));
+          ResourceScope rscope(m_resource);
+          m_handle.resume();
+        }
+      }
+
+      AA m_async;
+      std::coroutine_handle<> m_handle;
+      StopToken m_token;
+      MemoryResource* m_resource = nullptr;
+      std::exception_ptr m_error;
+      std::atomic<bool> m_done{false};
+    };
+
+    // Coroutine frames are allocated with a trailer that records how to free
+    // them, so that frames from different allocators can share one operator
+    // delete.
+    using FrameDeallocator = void (*)(void*, size_t);
+
+    inline size_t frameTrailerOffset(size_t n)
+    {
+      const size_t a = alignof(std::max_align_t);
+      return (n + a - 1) & ~(a - 1);
+    }
+
+    template <typename Alloc>
+    struct FrameAllocator
+    {
+      using Unit = std::max_align_t;
+      using UnitAlloc =
+        typename std::allocator_traits<Alloc>::template rebind_alloc<Unit>;
+
+      struct Trailer
+      {
+        FrameDeallocator dealloc;
+        UnitAlloc alloc;
+      };
+
+      static size_t units(size_t n)
+      {
+        size_t total = frameTrailerOffset(n) + sizeof(Trailer);
+        return (total + sizeof(Unit) - 1) / sizeof(Unit);
+      }
+
+      static Trailer* trailer(void* p, size_t n)
+      {
+        return reinterpret_cast<Trailer*>(
+            static_cast<char*>(p) + frameTrailerOffset(n));
+      }
+
+      static void* allocate(const Alloc& a, size_t n)
+      {
+        UnitAlloc alloc(a);
+        void* p = std::allocator_traits<UnitAlloc>::allocate(alloc, units(n));
+        new (trailer(p, n)) Trailer{ &deallocate, std::move(alloc) };
+        return p;
+      }
+
+      static void deallocate(void* p, size_t n)
+      {
+        Trailer* t = trailer(p, n);
+        UnitAlloc alloc(std::move(t->alloc));
+        t->~Trailer();
+        std::allocator_traits<UnitAlloc>::deallocate(
+            alloc, static_cast<Unit*>(p), units(n));
+      }
+    };
+
+    inline void deallocateFrame(void* p, size_t n)
+    {
+      FrameDeallocator d = *reinterpret_cast<FrameDeallocator*>(
+          static_cast<char*>(p) + frameTrailerOffset(n));
+      d(p, n);
+    }
+
+    struct TaskPromiseBase
+    {
+      static void* operator new(size_t n)
+      {
+        return FrameAllocator<ResourceAllocator<char>>::allocate(
+            ResourceAllocator<char>(currentResource()), n);
+      }
+
+      static void operator delete(void* p, size_t n)
+      {
+        deallocateFrame(p, n);
+      }
+
+      std::suspend_always initial_suspend() noexcept { return {}; }
+
+      void unhandled_exception() noexcept
+      {
+        m_error = std::current_exception();
+      }
+
+      // called instead of finish if the body threw: frees the frame, then
+      // passes the exception on, if there's anywhere to pass it
+      template <typename P>
+      static void fail(std::coroutine_handle<P> h) noexcept
+      {
+        std::exception_ptr e = std::move(h.promise().m_error);
+        TaskErrorSink sink = h.promise().m_sink;
+        h.destroy();
+        if (!sink.fail)
+          std::terminate();
+        sink.fail(sink.awaiter, std::move(e));
+      }
+
+      std::exception_ptr m_error;
+      TaskErrorSink m_sink = { nullptr, nullptr };
+    };
+
+    template <typename T>
+    struct TaskPromiseResult : TaskPromiseBase
+    {
+      template <typename U>
+      void return_value(U&& u) { m_value.emplace(std::forward<U>(u)); }
+
+      // called once the frame is finished with: frees the frame, then passes
+      // the result on
+      template <typename P>
+      static void finish(std::coroutine_handle<P> h)
+      {
+        auto cont = std::move(h.promise().m_cont);
+        T value = std::move(*h.promise().m_value);
+        h.destroy();
+        cont(std::move(value));
+      }
+
+      std::optional<T> m_value;
+    };
+
+    template <>
+    struct TaskPromiseResult<void> : TaskPromiseBase
+    {
+      void return_void() {}
+
+      template <typename P>
+      static void finish(std::coroutine_handle<P> h)
+      {
+        auto cont = std::move(h.promise().m_cont);
+        h.destroy();
+        cont();
+      }
+    };
+
+    struct TaskFinalAwaiter
+    {
+      bool await_ready() const noexcept { return false; }
+
+      template <typename P>
+      void await_suspend(std::coroutine_handle<P> h) noexcept
+      {
+        if (h.promise().m_error)
+          P::fail(h);
+        else
+          P::finish(h);
+      }
+
+      void await_resume() const noexcept {}
+    };
+  }
+}
+
+template <typename T>
+class Task
+{
+public:
+  using type = T;
+
+  struct promise_type : async::detail::TaskPromiseResult<T>
+  {
+    Task get_return_object()
+    {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this),
+                  *this);
+    }
+
+    async::detail::TaskFinalAwaiter final_suspend() noexcept { return {}; }
+
+    ContinuationT<T> m_cont;
+  };
+
+  Task(Task&& other) noexcept
+    : m_handle(std::exchange(other.m_handle, nullptr))
+    , m_promise(other.m_promise)
+  {}
+
+  Task& operator=(Task&& other) noexcept
+  {
+    if (this != &other)
+    {
+      if (m_handle)
+        m_handle.destroy();
+      m_handle = std::exchange(other.m_handle, nullptr);
+      m_promise = other.m_promise;
+    }
+    return *this;
+  }
+
+  // a Task that was never run still owns its frame
+  ~Task()
+  {
+    if (m_handle)
+      m_handle.destroy();
+  }
+
+  // Run the body, which then owns (and frees) its own frame.
+  template <typename C>
+  void operator()(C&& cont)
+  {
+    assert(m_handle && "a Task can only be run once");
+    auto h = std::exchange(m_handle, nullptr);
+    m_promise->m_cont = std::forward<C>(cont);
+    h.resume();
+  }
+
+private:
+  template <typename, typename, typename...>
+  friend struct async::detail::AllocatedTaskPromise;
+  friend struct async::detail::TaskErrors;
+
+  // the handle is on the coroutine's actual promise, which is promise_type or
+  // derived from it
+  Task(std::coroutine_handle<> h, promise_type& p) : m_handle(h), m_promise(&p)
+  {}
+
+  std::coroutine_handle<> m_handle;
+  promise_type* m_promise = nullptr;
+};
+
+namespace async
+{
+  namespace detail
+  {
+    // The promise of a coroutine whose leading arguments are std::allocator_arg
+    // and an allocator (see the specialization of std::coroutine_traits below).
+    // Its operator new isn't a template, and it declares the operator delete
+    // that frees the frame alongside it, so the two pair up.
+    template <typename T, typename Alloc, typename... Args>
+    struct AllocatedTaskPromise : Task<T>::promise_type
+    {
+      static void* operator new(size_t n, std::allocator_arg_t,
+                                const Alloc& a, const Args&...)
+      {
+        return FrameAllocator<Alloc>::allocate(a, n);
+      }
+
+      static void operator delete(void* p, size_t n)
+      {
+        deallocateFrame(p, n);
+      }
+
+      Task<T> get_return_object()
+      {
+        return Task<T>(
+            std::coroutine_handle<AllocatedTaskPromise>::from_promise(*this),
+            *this);
+      }
+    };
+  }
+}
+
+// A coroutine that takes std::allocator_arg and an allocator first allocates
+// its frame with that allocator.
+template <typename T, typename Alloc, typename... Args>
+struct std::coroutine_traits<Task<T>, std::allocator_arg_t, Alloc, Args...>
+{
+  using promise_type =
+    async::detail::AllocatedTaskPromise<T, std::decay_t<Alloc>, Args...>;
+};
+
+namespace async
+{
+  template <typename T>
+  struct FromAsync<Task<T>>
+  {
+    using type = T;
+  };
+}
+
+// co_await on any Async (including a Task).
+template <typename AA,
+          // constraint: AA must be an Async<A>
+          typename A = async::FromAsyncT<AA>>
+inline auto operator co_await(AA&& aa)
+{
+  using D = std::decay_t<AA>;
+  return async::detail::AsyncAwaiter<D, A>(D(std::forward<AA>(aa)));
+}
@@ -0,0 +1,341 @@
+#pragma once
+
+#include "async.h"
+#include "cancellation.h"
+#include "unique_function.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Time: after(d) is an Async<Void> that completes once d has elapsed, and
+// timeout(a, d) races a against it.
+//
+// Timers live on a hierarchical timer wheel (four levels of 64 slots, as in
+// the classic kernel design) served by a dedicated thread. Arming a timer
+// links it into the slot for its expiry; stopping it unlinks it. Both are O(1),
+// so a deadline on every call costs no more than the call's other bookkeeping.
+// A timer is stopped through the stop token it was armed under, which is how
+// the losing branch of a race is told to give up: when the Async in a timeout
+// wins, its timer is simply unlinked.
+//
+// Timer continuations run on the wheel's thread, so anything substantial that
+// follows a timer should hop onto an executor.
+
+namespace async
+{
+  class TimerWheel
+  {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+  private:
+    static const unsigned SLOT_BITS = 6;
+    static const unsigned SLOTS = 1u << SLOT_BITS;
+    static const unsigned LEVELS = 4;
+    static const uint64_t MAX_DELTA = (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+
+    // Slots are circular lists with a sentinel, so that linking and unlinking
+    // are O(1).
+    struct Link
+    {
+      Link* prev = nullptr;
+      Link* next = nullptr;
+    };
+
+    struct Timer : Link
+    {
+      uint64_t expiry = 0;
+      bool armed = false;
+      bool stopped = false;
+      UniqueFunction<void ()> fn;
+      // the wheel's reference, held for as long as the timer is armed
+      std::shared_ptr<Timer> self;
+      StopCallback onStop;
+    };
+
+    struct Slot
+    {
+      Slot() { head.prev = head.next = &head; }
+      bool empty() const { return head.next == &head; }
+      Timer* front() { return static_cast<Timer*>(head.next); }
+
+      Link head;
+    };
+
+  public:
+    explicit TimerWheel(Clock::duration resolution = std::chrono::milliseconds(1))
+      : m_resolution(resolution), m_start(Clock::now())
+    {
+      m_thread = std::thread([this] () { run(); });
+    }
+
+    // Timers still pending when the wheel is destroyed never fire.
+    ~TimerWheel()
+    {
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        m_stopping = true;
+      }
+      m_cv.notify_one();
+      m_thread.join();
+
+      std::vector<std::shared_ptr<Timer>> dropped;
+      for (auto& level : m_slots)
+        for (auto& slot : level)
+          while (!slot.empty())
+          {
+            Timer* t = slot.front();
+            unlink(t);
+            dropped.push_back(std::move(t->self));
+          }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // Call f on the wheel's thread once d has elapsed (to the wheel's
+    // resolution), unless a stop is requested on token first, in which case f
+    // is destroyed without being called.
+    void schedule(Clock::duration d, UniqueFunction<void ()> f,
+                  const StopToken& token = StopToken())
+    {
+      auto t = std::make_shared<Timer>();
+      t->fn = std::move(f);
+      std::weak_ptr<Timer> weak = t;
+      t->onStop = StopCallback(token, [this, weak] () {
+          if (auto s = weak.lock())
+            stop(s.get());
+        });
+
+      // the first tick boundary at or after the deadline
+      uint64_t expiry = static_cast<uint64_t>(
+          (Clock::now() - m_start + d + m_resolution - Clock::duration(1)) /
+          m_resolution);
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        if (t->stopped)
+          return;
+        // an empty wheel may have slept through ticks it didn't process
+        if (m_pending == 0)
+          m_now = ticksSinceStart();
+        t->expiry = std::max(expiry, m_now + 1);
+        t->armed = true;
+        t->self = t;
+        insert(t.get());
+        ++m_pending;
+      }
+      m_cv.notify_one();
+    }
+
+    // the number of armed timers
+    size_t pending() const
+    {
+      std::lock_guard<std::mutex> g(m_mutex);
+      return m_pending;
+    }
+
+  private:
+    // Unlinking drops the wheel's reference, but outside the lock: releasing
+    // the timer may destroy its function, and whatever that owns.
+    void stop(Timer* t)
+    {
+      std::shared_ptr<Timer> self;
+      UniqueFunction<void ()> fn;
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        t->stopped = true;
+        if (!t->armed)
+          return;
+        unlink(t);
+        t->armed = false;
+        --m_pending;
+        fn = std::move(t->fn);
+        self = std::move(t->self);
+      }
+    }
+
+    static void link(Slot& s, Link* t)
+    {
+      t->prev = s.head.prev;
+      t->next = &s.head;
+      s.head.prev->next = t;
+      s.head.prev = t;
+    }
+
+    static void unlink(Link* t)
+    {
+      t->prev->next = t->next;
+      t->next->prev = t->prev;
+      t->prev = t->next = nullptr;
+    }
+
+    // The level is chosen by how far away the expiry is, and the slot by the
+    // expiry's digit at that level. Timers too far away for the wheel are kept
+    // in the top level and placed again when they cascade.
+    void insert(Timer* t)
+    {
+      uint64_t delta = t->expiry > m_now ? t->expiry - m_now : 0;
+      uint64_t when = t->expiry;
+      if (delta > MAX_DELTA)
+      {
+        delta = MAX_DELTA;
+        when = m_now + MAX_DELTA;
+      }
+      unsigned level = 0;
+      while (level + 1 < LEVELS && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1))))
+        ++level;
+      link(m_slots[level][(when >> (SLOT_BITS * level)) & (SLOTS - 1)], t);
+    }
+
+    // Move everything from one slot to where it now belongs.
+    void cascade(unsigned level)
+    {
+      Slot& s = m_slots[level][(m_now >> (SLOT_BITS * level)) & (SLOTS - 1)];
+      while (!s.empty())
+      {
+        Timer* t = s.front();
+        unlink(t);
+        insert(t);
+      }
+    }
+
+    // Advance one tick, collecting what expires.
+    void tick(std::vector<std::shared_ptr<Timer>>& expired)
+    {
+      ++m_now;
+      for (unsigned level = 1; level < LEVELS; ++level)
+      {
+        if ((m_now & ((uint64_t(1) << (SLOT_BITS * level)) - 1)) != 0)
+          break;
+        cascade(level);
+      }
+      Slot& s = m_slots[0][m_now & (SLOTS - 1)];
+      while (!s.empty())
+      {
+        Timer* t = s.front();
+        unlink(t);
+        t->armed = false;
+        --m_pending;
+        expired.push_back(std::move(t->self));
+      }
+    }
+
+    uint64_t ticksSinceStart() const
+    {
+      return static_cast<uint64_t>((Clock::now() - m_start) / m_resolution);
+    }
+
+    void run()
+    {
+      std::vector<std::shared_ptr<Timer>> expired;
+      std::unique_lock<std::mutex> g(m_mutex);
+      while (!m_stopping)
+      {
+        uint64_t target = ticksSinceStart();
+        if (m_pending == 0)
+        {
+          // nothing to cascade: catch up at once, and sleep until armed
+          m_now = target;
+          m_cv.wait(g, [this] () { return m_stopping || m_pending > 0; });
+          continue;
+        }
+
+        while (m_now < target && m_pending > 0)
+          tick(expired);
+        if (m_now < target)
+          m_now = target;
+
+        if (!expired.empty())
+        {
+          g.unlock();
+          for (auto& t : expired)
+          {
+            UniqueFunction<void ()> fn = std::move(t->fn);
+            fn();
+          }
+          expired.clear();
+          g.lock();
+          continue;
+        }
+
+        m_cv.wait_until(g, m_start + m_resolution * (m_now + 1));
+      }
+    }
+
+    Clock::duration m_resolution;
+    Clock::time_point m_start;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::array<std::array<Slot, SLOTS>, LEVELS> m_slots;
+    uint64_t m_now = 0;
+    size_t m_pending = 0;
+    bool m_stopping = false;
+
+    std::thread m_thread;
+  };
+
+  // The wheel that after and timeout use unless they're given another.
+  inline TimerWheel& defaultTimerWheel()
+  {
+    static TimerWheel wheel;
+    return wheel;
+  }
+
+  // An Async<Void> that completes, on the wheel's thread, once d has elapsed.
+  // Its timer is stopped with the stop token it's started under.
+  template <typename Rep, typename Period>
+  inline auto after(TimerWheel& wheel, std::chrono::duration<Rep, Period> d)
+  {
+    return makeAsyncOp<Void>(
+        [w = &wheel, d = std::chrono::duration_cast<TimerWheel::Clock::duration>(d)]
+        (auto&& cont)
+        {
+          StopToken token = currentStopToken();
+          if (token.stopRequested())
+            return;
+          w->schedule(d,
+                      [c = std::forward<decltype(cont)>(cont)] () mutable {
+                        c(Void());
+                      },
+                      token);
+        });
+  }
+
+  template <typename Rep, typename Period>
+  inline auto after(std::chrono::duration<Rep, Period> d)
+  {
+    return after(defaultTimerWheel(), d);
+  }
+
+  // Race an Async against a deadline: the result is a Void on the Left if the
+  // deadline passes first, and the Async's result on the Right otherwise.
+  // Whichever loses is stopped, so a timeout that doesn't fire is unlinked from
+  // the wheel as soon as the Async completes.
+  template <typename AA, typename Rep, typename Period,
+            // constraint: AA must be an Async<A>
+            typename A = FromAsyncT<AA>>
+  inline auto timeout(TimerWheel& wheel, AA&& aa,
+                      std::chrono::duration<Rep, Period> d)
+  {
+    using T = decltype(after(wheel, d));
+    return runRace<T, AA, Void, A>()(after(wheel, d), std::forward<AA>(aa));
+  }
+
+  template <typename AA, typename Rep, typename Period,
+            // constraint: AA must be an Async<A>
+            typename A = FromAsyncT<AA>>
+  inline auto timeout(AA&& aa, std::chrono::duration<Rep, Period> d)
+  {
+    return timeout(defaultTimerWheel(), std::forward<AA>(aa), d);
+  }
+}
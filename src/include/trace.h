@@ -0,0 +1,226 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Tracing: hooks on the execution of an Async graph.
+//
+// The combinators report what they're doing through a trace policy: bind and
+// sequence report the start and completion of each stage they begin, the joins
+// (apply, when_all) report each branch's arrival, and the races (race,
+// when_any) report which branch won and which lost. Each combinator that is
+// started gets a fresh id, and every record carries a timestamp and the thread
+// it happened on.
+//
+// The policy the library uses is chosen at compile time, by defining
+// ASYNC_TRACE_POLICY (in every translation unit alike) before async.h is
+// included. The default, trace::Disabled, does nothing: its hooks are empty,
+// its per-combinator Node is an empty base, and stage() passes continuations
+// through untouched, so the compiled code is as if there were no hooks at all.
+// trace::Enabled passes records to the Sink installed with setSink (if there is
+// one); ChromeTrace is a Sink that writes the Chrome trace format, which
+// Perfetto and chrome://tracing read. traced(name, a), in async.h, marks an
+// Async as a stage of its own, and takes the policy as a template parameter,
+// so one part of a graph can be traced without enabling it everywhere.
+//
+// A policy provides:
+//   Node               constructible from a name; a base of join and race state
+//   stage(name, c)     a continuation that reports its stage's completion,
+//                      having reported its start
+//   arrive(node, i)    branch i of a join has arrived
+//   win(node, i)       branch i of a race has won
+//   lose(node, i)      branch i of a race has completed, and lost
+
+namespace async
+{
+  namespace trace
+  {
+    struct Disabled
+    {
+      struct Node
+      {
+        constexpr explicit Node(const char*) {}
+      };
+
+      template <typename C>
+      static inline C&& stage(const char*, C&& c) { return std::forward<C>(c); }
+
+      static inline void arrive(const Node&, unsigned) {}
+      static inline void win(const Node&, unsigned) {}
+      static inline void lose(const Node&, unsigned) {}
+    };
+
+    enum class Event : uint8_t
+    {
+      STAGE_START,
+      STAGE_COMPLETE,
+      ARRIVE,
+      WIN,
+      LOSE
+    };
+
+    struct Record
+    {
+      using Clock = std::chrono::steady_clock;
+
+      Event event;
+      const char* name;
+      uint64_t id;
+      unsigned branch;
+      Clock::time_point time;
+      std::thread::id thread;
+    };
+
+    // Where records go. It is called on whichever thread the event happens on.
+    class Sink
+    {
+    public:
+      virtual ~Sink() = default;
+      virtual void record(const Record& r) = 0;
+    };
+
+    namespace detail
+    {
+      inline std::atomic<Sink*>& sinkRef()
+      {
+        static std::atomic<Sink*> s{nullptr};
+        return s;
+      }
+
+      inline uint64_t nextId()
+      {
+        static std::atomic<uint64_t> id{0};
+        return id.fetch_add(1, std::memory_order_relaxed) + 1;
+      }
+    }
+
+    // Install a sink (or nullptr, for none). The sink must outlive any
+    // tracing that might use it.
+    inline void setSink(Sink* s)
+    {
+      detail::sinkRef().store(s, std::memory_order_release);
+    }
+
+    struct Enabled
+    {
+      struct Node
+      {
+        explicit Node(const char* n) : name(n), id(detail::nextId()) {}
+
+        const char* name;
+        uint64_t id;
+      };
+
+      static inline void emit(Event e, const Node& n, unsigned branch)
+      {
+        if (Sink* s = detail::sinkRef().load(std::memory_order_acquire))
+          s->record(Record{ e, n.name, n.id, branch, Record::Clock::now(),
+                            std::this_thread::get_id() });
+      }
+
+      template <typename C>
+      static inline auto stage(const char* name, C&& c)
+      {
+        Node n(name);
+        emit(Event::STAGE_START, n, 0);
+        return [n, c = std::forward<C>(c)] (auto&&... t) mutable {
+          emit(Event::STAGE_COMPLETE, n, 0);
+          c(std::forward<decltype(t)>(t)...);
+        };
+      }
+
+      static inline void arrive(const Node& n, unsigned i) { emit(Event::ARRIVE, n, i); }
+      static inline void win(const Node& n, unsigned i) { emit(Event::WIN, n, i); }
+      static inline void lose(const Node& n, unsigned i) { emit(Event::LOSE, n, i); }
+    };
+
+    // Collects records, and writes them out in the Chrome trace event format:
+    // each stage is an async slice from its start to its completion, and
+    // arrivals, wins and losses are instant events on their node's track.
+    class ChromeTrace : public Sink
+    {
+    public:
+      ChromeTrace() : m_start(Record::Clock::now()) {}
+
+      void record(const Record& r) override
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        m_records.push_back(r);
+      }
+
+      std::vector<Record> records() const
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        return m_records;
+      }
+
+      void write(std::ostream& os) const
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        std::map<std::thread::id, size_t> tids;
+        os << "{\"traceEvents\":[";
+        const char* sep = "\n";
+        for (const auto& r : m_records)
+        {
+          size_t tid = tids.emplace(r.thread, tids.size() + 1).first->second;
+          auto us = std::chrono::duration<double, std::micro>(r.time - m_start);
+          os << sep << "{\"name\":\"" << r.name
+             << "\",\"cat\":\"async\",\"ph\":\"" << phase(r.event)
+             << "\",\"id\":" << r.id
+             << ",\"ts\":" << us.count()
+             << ",\"pid\":1,\"tid\":" << tid;
+          if (r.event != Event::STAGE_START && r.event != Event::STAGE_COMPLETE)
+            os << ",\"args\":{\"event\":\"" << eventName(r.event)
+               << "\",\"branch\":" << r.branch << "}";
+          os << "}";
+          sep = ",\n";
+        }
+        os << "\n]}\n";
+      }
+
+    private:
+      static const char* phase(Event e)
+      {
+        switch (e)
+        {
+          case Event::STAGE_START: return "b";
+          case Event::STAGE_COMPLETE: return "e";
+          default: return "n";
+        }
+      }
+
+      static const char* eventName(Event e)
+      {
+        switch (e)
+        {
+          case Event::ARRIVE: return "arrive";
+          case Event::WIN: return "win";
+          case Event::LOSE: return "lose";
+          default: return "";
+        }
+      }
+
+      Record::Clock::time_point m_start;
+      mutable std::mutex m_mutex;
+      std::vector<Record> m_records;
+    };
+  }
+}
+
+#ifndef ASYNC_TRACE_POLICY
+#define ASYNC_TRACE_POLICY async::trace::Disabled
+#endif
+
+namespace async
+{
+  // the policy the combinators report through
+  using TracePolicy = ASYNC_TRACE_POLICY;
+}
@@ -0,0 +1,259 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+//------------------------------------------------------------------------------
+// Counting copies and allocations, for tests and benchmarks.
+//
+// CopyTest is a value type that counts what is done to it: constructions,
+// copies, moves and assignments. Heap allocations are counted by replacing the
+// global operator new and delete, which this header does in the one
+// translation unit of a program that defines ASYNC_TRACK_ALLOCATIONS before
+// including it. The counters are atomic and only ever go up, so a Scope can
+// take a snapshot of them and report what has happened since, on any thread:
+//
+//   tracking::Scope s;
+//   fmap(f, pure(CopyTest()))([] (int) {});
+//   assert(s.copies() == 0 && s.allocations() == 0);
+
+namespace tracking
+{
+  // A snapshot of the counters, or the difference between two.
+  struct Counts
+  {
+    size_t constructs = 0;
+    size_t destructs = 0;
+    size_t copyConstructs = 0;
+    size_t moveConstructs = 0;
+    size_t assignments = 0;
+    size_t moveAssignments = 0;
+    size_t allocations = 0;
+    size_t deallocations = 0;
+
+    size_t copies() const { return copyConstructs + assignments; }
+  };
+
+  inline Counts operator-(const Counts& a, const Counts& b)
+  {
+    Counts c;
+    c.constructs = a.constructs - b.constructs;
+    c.destructs = a.destructs - b.destructs;
+    c.copyConstructs = a.copyConstructs - b.copyConstructs;
+    c.moveConstructs = a.moveConstructs - b.moveConstructs;
+    c.assignments = a.assignments - b.assignments;
+    c.moveAssignments = a.moveAssignments - b.moveAssignments;
+    c.allocations = a.allocations - b.allocations;
+    c.deallocations = a.deallocations - b.deallocations;
+    return c;
+  }
+
+  namespace detail
+  {
+    // Constant-initialized, so that it can be counted on from operator new
+    // before main.
+    struct Counters
+    {
+      std::atomic<size_t> constructs{0};
+      std::atomic<size_t> destructs{0};
+      std::atomic<size_t> copyConstructs{0};
+      std::atomic<size_t> moveConstructs{0};
+      std::atomic<size_t> assignments{0};
+      std::atomic<size_t> moveAssignments{0};
+      std::atomic<size_t> allocations{0};
+      std::atomic<size_t> deallocations{0};
+    };
+
+    inline Counters& counters()
+    {
+      static Counters c;
+      return c;
+    }
+
+    inline void count(std::atomic<size_t>& c)
+    {
+      c.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  inline Counts snapshot()
+  {
+    detail::Counters& c = detail::counters();
+    Counts s;
+    s.constructs = c.constructs.load(std::memory_order_relaxed);
+    s.destructs = c.destructs.load(std::memory_order_relaxed);
+    s.copyConstructs = c.copyConstructs.load(std::memory_order_relaxed);
+    s.moveConstructs = c.moveConstructs.load(std::memory_order_relaxed);
+    s.assignments = c.assignments.load(std::memory_order_relaxed);
+    s.moveAssignments = c.moveAssignments.load(std::memory_order_relaxed);
+    s.allocations = c.allocations.load(std::memory_order_relaxed);
+    s.deallocations = c.deallocations.load(std::memory_order_relaxed);
+    return s;
+  }
+
+  // What has been counted since the scope began. Allocations are only counted
+  // if operator new has been replaced (see above).
+  class Scope
+  {
+  public:
+    Scope() : m_start(snapshot()) {}
+
+    Counts counts() const { return snapshot() - m_start; }
+    size_t copies() const { return counts().copies(); }
+    size_t allocations() const { return counts().allocations; }
+
+  private:
+    Counts m_start;
+  };
+
+  struct CopyTest
+  {
+    CopyTest() { detail::count(detail::counters().constructs); }
+    ~CopyTest() { detail::count(detail::counters().destructs); }
+    CopyTest(const CopyTest&) { detail::count(detail::counters().copyConstructs); }
+    CopyTest(CopyTest&&) { detail::count(detail::counters().moveConstructs); }
+    CopyTest& operator=(const CopyTest&)
+    {
+      detail::count(detail::counters().assignments);
+      return *this;
+    }
+    CopyTest& operator=(CopyTest&&)
+    {
+      detail::count(detail::counters().moveAssignments);
+      return *this;
+    }
+
+    // the counts since the last Reset
+    static Counts Since() { return snapshot() - Baseline(); }
+    static size_t CopyConstructs() { return Since().copyConstructs; }
+
+    static void Reset() { Baseline() = snapshot(); }
+
+    static void Stats()
+    {
+      Counts c = Since();
+      std::cout << c.constructs << " constructs" << std::endl;
+      std::cout << c.destructs << " destructs" << std::endl;
+      std::cout << c.copyConstructs << " copy constructs" << std::endl;
+      std::cout << c.moveConstructs << " move constructs" << std::endl;
+      std::cout << c.assignments << " assignments" << std::endl;
+      std::cout << c.moveAssignments << " move assignments" << std::endl;
+      std::cout << c.allocations << " allocations" << std::endl;
+      Reset();
+    }
+
+    static void ExpectCopies(size_t n)
+    {
+      Counts c = Since();
+      assert(c.copyConstructs <= n);
+      assert(c.assignments <= n);
+      static_cast<void>(c);
+      Reset();
+    }
+
+  private:
+    static Counts& Baseline()
+    {
+      static Counts b;
+      return b;
+    }
+  };
+}
+
+#if defined(ASYNC_TRACK_ALLOCATIONS)
+
+// The replacements are kept out of line: inlined into their callers, they'd
+// let the compiler see malloc and free meet the new and delete expressions
+// they serve, which it takes for a mismatch.
+#if defined(__GNUC__)
+#define ASYNC_TRACKING_NOINLINE __attribute__((noinline))
+#else
+#define ASYNC_TRACKING_NOINLINE
+#endif
+
+ASYNC_TRACKING_NOINLINE void* operator new(std::size_t n)
+{
+  tracking::detail::count(tracking::detail::counters().allocations);
+  if (void* p = std::malloc(n ? n : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+ASYNC_TRACKING_NOINLINE void* operator new[](std::size_t n)
+{
+  return operator new(n);
+}
+
+ASYNC_TRACKING_NOINLINE void operator delete(void* p) noexcept
+{
+  if (p)
+    tracking::detail::count(tracking::detail::counters().deallocations);
+  std::free(p);
+}
+
+ASYNC_TRACKING_NOINLINE void operator delete[](void* p) noexcept
+{
+  operator delete(p);
+}
+
+ASYNC_TRACKING_NOINLINE void operator delete(void* p, std::size_t) noexcept
+{
+  operator delete(p);
+}
+
+ASYNC_TRACKING_NOINLINE void operator delete[](void* p, std::size_t) noexcept
+{
+  operator delete(p);
+}
+
+// Over-aligned types are allocated through the align_val_t overloads, which
+// are counted the same way.
+#if defined(__cpp_aligned_new)
+
+ASYNC_TRACKING_NOINLINE void* operator new(std::size_t n, std::align_val_t a)
+{
+  tracking::detail::count(tracking::detail::counters().allocations);
+  // aligned_alloc takes a multiple of the alignment
+  const std::size_t align = static_cast<std::size_t>(a);
+  const std::size_t size = n ? (n + align - 1) & ~(align - 1) : align;
+  if (void* p = std::aligned_alloc(align, size))
+    return p;
+  throw std::bad_alloc();
+}
+
+ASYNC_TRACKING_NOINLINE void* operator new[](std::size_t n, std::align_val_t a)
+{
+  return operator new(n, a);
+}
+
+ASYNC_TRACKING_NOINLINE void operator delete(void* p,
+                                             std::align_val_t) noexcept
+{
+  operator delete(p);
+}
+
+ASYNC_TRACKING_NOINLINE void operator delete[](void* p,
+                                               std::align_val_t) noexcept
+{
+  operator delete(p);
+}
+
+ASYNC_TRACKING_NOINLINE void operator delete(void* p, std::size_t,
+                                             std::align_val_t) noexcept
+{
+  operator delete(p);
+}
+
+ASYNC_TRACKING_NOINLINE void operator delete[](void* p, std::size_t,
+                                               std::align_val_t) noexcept
+{
+  operator delete(p);
+}
+
+#endif
+
+#endif
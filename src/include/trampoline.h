@@ -0,0 +1,94 @@
+#pragma once
+
+#include "unique_function.h"
+
+#include <cstddef>
+#include <deque>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// Stack safety for long chains of bind and sequence.
+//
+// A chain of binds over Asyncs that complete synchronously (e.g. a loop built
+// from repeated >= over pure values) would otherwise grow the stack with every
+// link. Instead, each link is started through bounce(), which counts how deeply
+// bounces are nested on this thread; past a limit, the link is queued and the
+// stack unwinds to the outermost bounce, which runs the queue. This keeps the
+// stack bounded without capping the length of the chain, and costs only a
+// thread-local counter until the limit is reached. If an exception escapes a
+// bounce, the depth is still restored, and if it escapes the outermost one,
+// whatever was queued beneath it is dropped.
+//
+// The limit can be configured by defining ASYNC_TRAMPOLINE_DEPTH before this
+// header is included.
+
+#ifndef ASYNC_TRAMPOLINE_DEPTH
+#define ASYNC_TRAMPOLINE_DEPTH 64
+#endif
+
+namespace async
+{
+  namespace detail
+  {
+    struct Trampoline
+    {
+      size_t depth = 0;
+      std::deque<UniqueFunction<void ()>> pending;
+    };
+
+    inline Trampoline& trampoline()
+    {
+      thread_local Trampoline t;
+      return t;
+    }
+
+    // One level of nesting. The outermost level leaves the queue empty, even
+    // when it's unwinding.
+    class BounceScope
+    {
+    public:
+      explicit BounceScope(Trampoline& t) : m_t(t) { ++m_t.depth; }
+
+      ~BounceScope()
+      {
+        if (--m_t.depth == 0 && !m_t.pending.empty())
+        {
+          std::deque<UniqueFunction<void ()>> dropped;
+          dropped.swap(m_t.pending);
+        }
+      }
+
+      BounceScope(const BounceScope&) = delete;
+      BounceScope& operator=(const BounceScope&) = delete;
+
+    private:
+      Trampoline& m_t;
+    };
+  }
+
+  // Call f now, unless bounces are already nested too deeply on this thread, in
+  // which case queue it for the outermost bounce to run once the stack has
+  // unwound. Either way, f has run by the time the outermost bounce returns.
+  template <typename F>
+  inline void bounce(F&& f)
+  {
+    detail::Trampoline& t = detail::trampoline();
+    if (t.depth >= ASYNC_TRAMPOLINE_DEPTH)
+    {
+      t.pending.emplace_back(std::forward<F>(f));
+      return;
+    }
+
+    detail::BounceScope scope(t);
+    f();
+    if (t.depth == 1)
+    {
+      while (!t.pending.empty())
+      {
+        UniqueFunction<void ()> g = std::move(t.pending.front());
+        t.pending.pop_front();
+        g();
+      }
+    }
+  }
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include "async.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Mapping an async function over a range, with bounded concurrency.
+//
+// traverse(xs, f, k) calls f on each element of xs, where f returns an Async,
+// and collects the results in order. Unlike when_all over a vector of those
+// Asyncs, at most k of them are in flight at once: the first k are started
+// together, and each one that completes starts the next element. The results
+// are stored in place, in one preallocated vector, as they arrive. for_each
+// does the same but keeps no results, for an f that delivers its own.
+//
+// Elements are started through bounce(), so a range that completes
+// synchronously runs in constant stack space. Each element is started under
+// the stop token and memory resource that were current when the traversal
+// was; once that token is stopped, no more elements are started (and the
+// traversal never completes).
+
+namespace async
+{
+  namespace detail
+  {
+    // The results of a traverse, each stored in place, in the vector that is
+    // delivered, when it arrives.
+    template <typename T>
+    struct TraverseResults
+    {
+      explicit TraverseResults(size_t n) : results(n) {}
+
+      template <typename... U>
+      inline void set(size_t i, U&&... u)
+      {
+        results.set(i, std::forward<U>(u)...);
+      }
+
+      template <typename C>
+      inline void complete(C& cont) { cont(results.release()); }
+
+      RangeResults<T> results;
+    };
+
+    // for_each keeps nothing.
+    struct DiscardResults
+    {
+      explicit DiscardResults(size_t) {}
+
+      template <typename... U>
+      inline void set(size_t, U&&...) {}
+
+      template <typename C>
+      inline void complete(C& cont) { cont(); }
+    };
+
+    // Join state for a traversal: a cursor for the next element to start, and
+    // a countdown of the elements still to complete.
+    template <typename C, typename X, typename F, typename Results>
+    struct TraverseData
+    {
+      TraverseData(C&& c, std::shared_ptr<const std::vector<X>> xs, const F& f)
+        : cont(std::move(c)), inputs(std::move(xs)), fn(f),
+          results(inputs->size()), token(currentStopToken()),
+          resource(currentResource()), next(0), remaining(inputs->size())
+      {}
+
+      static void start(const std::shared_ptr<TraverseData>& pData)
+      {
+        size_t i = pData->next.fetch_add(1, std::memory_order_relaxed);
+        if (i >= pData->inputs->size() || pData->token.stopRequested())
+          return;
+        bounce([pData, i] () {
+            StopScope scope(pData->token);
+            ResourceScope rscope(pData->resource);
+            pData->fn((*pData->inputs)[i])([pData, i] (auto&&... u) {
+                pData->results.set(i, std::forward<decltype(u)>(u)...);
+                if (pData->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                  pData->results.complete(pData->cont);
+                else
+                  start(pData);
+              });
+          });
+      }
+
+      C cont;
+      std::shared_ptr<const std::vector<X>> inputs;
+      F fn;
+      Results results;
+      StopToken token;
+      MemoryResource* resource;
+      std::atomic<size_t> next;
+      std::atomic<size_t> remaining;
+    };
+
+    template <typename Results, typename R, typename X, typename F>
+    inline auto traverseWith(std::vector<X> xs, F&& f, size_t maxInFlight)
+    {
+      using G = std::decay_t<F>;
+      return makeAsyncOp<R>(
+          [xs = std::make_shared<const std::vector<X>>(std::move(xs)),
+           f = std::forward<F>(f), k = std::max<size_t>(maxInFlight, 1)]
+          (auto&& cont)
+          {
+            using C = std::decay_t<decltype(cont)>;
+            using D = TraverseData<C, X, G, Results>;
+            if (xs->empty())
+            {
+              Results none(0);
+              return none.complete(cont);
+            }
+            std::shared_ptr<D> pData =
+              allocateShared<D>(std::forward<decltype(cont)>(cont), xs, f);
+            for (size_t j = 0; j < std::min(k, xs->size()); ++j)
+              D::start(pData);
+          });
+    }
+
+    template <typename X, typename F>
+    using TraverseResultT =
+      IgnoreVoidT<FromAsyncT<decltype(std::declval<F&>()(std::declval<const X&>()))>>;
+  }
+
+  // Map f (which returns an Async<U>) over xs, with at most maxInFlight
+  // Asyncs running at once, collecting the results in order. Async<void>
+  // results are represented as Void.
+  // [x] -> (x -> m u) -> m [u]
+  template <typename X, typename F,
+            // constraint: F must return an Async
+            typename U = detail::TraverseResultT<X, std::decay_t<F>>>
+  inline auto traverse(std::vector<X> xs, F&& f, size_t maxInFlight)
+  {
+    return detail::traverseWith<detail::TraverseResults<U>, std::vector<U>>(
+        std::move(xs), std::forward<F>(f), maxInFlight);
+  }
+
+  // Run f (which returns an Async) on each element of xs, with at most
+  // maxInFlight running at once, discarding the results.
+  // [x] -> (x -> m u) -> m ()
+  template <typename X, typename F,
+            // constraint: F must return an Async
+            typename U = detail::TraverseResultT<X, std::decay_t<F>>>
+  inline auto for_each(std::vector<X> xs, F&& f, size_t maxInFlight)
+  {
+    return detail::traverseWith<detail::DiscardResults, void>(
+        std::move(xs), std::forward<F>(f), maxInFlight);
+  }
+}
@@ -0,0 +1,256 @@
+#pragma once
+
+#include "allocator.h"
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// A move-only, type-erased callable: the replacement for std::function as the
+// representation of Async and Continuation.
+//
+// Callables that fit in the inline buffer (and are nothrow movable, so that
+// moving the wrapper can't throw) are stored in place; anything else is boxed
+// on the heap, or in memory from the current async::MemoryResource if there is
+// one (see allocator.h). Since the wrapper never copies its target, the target
+// may itself be move-only - which means continuations and captured Asyncs can
+// always be moved along rather than copied.
+//
+// The default size of the inline buffer can be configured by defining
+// UNIQUE_FUNCTION_INLINE_SIZE before this header is included.
+
+#ifndef UNIQUE_FUNCTION_INLINE_SIZE
+#define UNIQUE_FUNCTION_INLINE_SIZE (4 * sizeof(void*))
+#endif
+
+template <typename Signature, size_t Size = UNIQUE_FUNCTION_INLINE_SIZE>
+class UniqueFunction;
+
+template <typename R, typename... A, size_t Size>
+class UniqueFunction<R(A...), Size>
+{
+  static_assert(Size >= sizeof(void*),
+                "UniqueFunction's inline buffer must be able to hold a pointer");
+
+  // IsCallable<F>::value is true if an F lvalue can be called with A... and its
+  // result converted to R
+  template <typename F, typename = void>
+  struct IsCallable : std::false_type {};
+
+  template <typename F>
+  struct IsCallable<F, decltype(void(std::declval<F&>()(std::declval<A>()...)))>
+    : std::integral_constant<
+        bool,
+        std::is_void<R>::value ||
+        std::is_convertible<
+          decltype(std::declval<F&>()(std::declval<A>()...)), R>::value>
+  {};
+
+  template <typename F>
+  using IsInline = std::integral_constant<
+    bool,
+    sizeof(F) <= Size &&
+    alignof(std::max_align_t) % alignof(F) == 0 &&
+    std::is_nothrow_move_constructible<F>::value>;
+
+public:
+  UniqueFunction() noexcept = default;
+  UniqueFunction(std::nullptr_t) noexcept {}
+
+  // construct from any callable with a compatible signature
+  template <typename F, typename D = std::decay_t<F>,
+            // constraint: F is not a UniqueFunction of this type (that's the
+            // move constructor), and it is callable with our signature
+            std::enable_if_t<!std::is_same<D, UniqueFunction>::value, int> = 0,
+            std::enable_if_t<IsCallable<D>::value, int> = 0>
+  UniqueFunction(F&& f)
+  {
+    construct<D>(std::forward<F>(f), IsInline<D>());
+  }
+
+  UniqueFunction(UniqueFunction&& other) noexcept
+    : m_vtable(other.m_vtable)
+  {
+    if (m_vtable)
+    {
+      m_vtable->move(&m_storage, &other.m_storage);
+      other.m_vtable = nullptr;
+    }
+  }
+
+  UniqueFunction& operator=(UniqueFunction&& other) noexcept
+  {
+    if (this != &other)
+    {
+      reset();
+      if (other.m_vtable)
+      {
+        other.m_vtable->move(&m_storage, &other.m_storage);
+        m_vtable = other.m_vtable;
+        other.m_vtable = nullptr;
+      }
+    }
+    return *this;
+  }
+
+  UniqueFunction& operator=(std::nullptr_t) noexcept
+  {
+    reset();
+    return *this;
+  }
+
+  UniqueFunction(const UniqueFunction&) = delete;
+  UniqueFunction& operator=(const UniqueFunction&) = delete;
+
+  ~UniqueFunction() { reset(); }
+
+  explicit operator bool() const noexcept { return m_vtable != nullptr; }
+
+  // Like std::function, calling is const but the target is called as
+  // non-const, so mutable lambdas work as expected.
+  R operator()(A... args) const
+  {
+    if (!m_vtable)
+      throw std::bad_function_call();
+    return m_vtable->invoke(&m_storage, std::forward<A>(args)...);
+  }
+
+private:
+  struct VTable
+  {
+    R (*invoke)(void*, A&&...);
+    void (*move)(void* dst, void* src);
+    void (*destroy)(void*);
+  };
+
+  // operations on a callable stored in the inline buffer
+  template <typename F>
+  struct InlineOps
+  {
+    static F* get(void* p) { return static_cast<F*>(p); }
+
+    static R invoke(void* p, A&&... args)
+    {
+      return (*get(p))(std::forward<A>(args)...);
+    }
+
+    static void move(void* dst, void* src)
+    {
+      new (dst) F(std::move(*get(src)));
+      get(src)->~F();
+    }
+
+    static void destroy(void* p) { get(p)->~F(); }
+
+    static const VTable* vtable()
+    {
+      static const VTable v = { &invoke, &move, &destroy };
+      return &v;
+    }
+  };
+
+  // operations on a callable boxed on the heap: the buffer holds the pointer
+  template <typename F>
+  struct HeapOps
+  {
+    static F* get(void* p) { return *static_cast<F**>(p); }
+
+    static R invoke(void* p, A&&... args)
+    {
+      return (*get(p))(std::forward<A>(args)...);
+    }
+
+    static void move(void* dst, void* src) { new (dst) F*(get(src)); }
+
+    static void destroy(void* p) { delete get(p); }
+
+    static const VTable* vtable()
+    {
+      static const VTable v = { &invoke, &move, &destroy };
+      return &v;
+    }
+  };
+
+  // operations on a callable boxed in memory from a MemoryResource: the box
+  // remembers where it came from
+  template <typename F>
+  struct ResourceOps
+  {
+    struct Box
+    {
+      template <typename G>
+      Box(G&& g, async::MemoryResource* r) : f(std::forward<G>(g)), resource(r) {}
+
+      F f;
+      async::MemoryResource* resource;
+    };
+
+    static Box* get(void* p) { return *static_cast<Box**>(p); }
+
+    static R invoke(void* p, A&&... args)
+    {
+      return get(p)->f(std::forward<A>(args)...);
+    }
+
+    static void move(void* dst, void* src) { new (dst) Box*(get(src)); }
+
+    static void destroy(void* p)
+    {
+      Box* b = get(p);
+      async::MemoryResource* r = b->resource;
+      b->~Box();
+      r->deallocate(b, sizeof(Box), alignof(Box));
+    }
+
+    static const VTable* vtable()
+    {
+      static const VTable v = { &invoke, &move, &destroy };
+      return &v;
+    }
+  };
+
+  template <typename D, typename F>
+  void construct(F&& f, std::true_type)
+  {
+    new (&m_storage) D(std::forward<F>(f));
+    m_vtable = InlineOps<D>::vtable();
+  }
+
+  template <typename D, typename F>
+  void construct(F&& f, std::false_type)
+  {
+    if (async::MemoryResource* r = async::currentResource())
+    {
+      using Box = typename ResourceOps<D>::Box;
+      void* p = r->allocate(sizeof(Box), alignof(Box));
+      try
+      {
+        new (&m_storage) Box*(new (p) Box(std::forward<F>(f), r));
+      }
+      catch (...)
+      {
+        r->deallocate(p, sizeof(Box), alignof(Box));
+        throw;
+      }
+      m_vtable = ResourceOps<D>::vtable();
+      return;
+    }
+    new (&m_storage) D*(new D(std::forward<F>(f)));
+    m_vtable = HeapOps<D>::vtable();
+  }
+
+  void reset() noexcept
+  {
+    if (m_vtable)
+    {
+      m_vtable->destroy(&m_storage);
+      m_vtable = nullptr;
+    }
+  }
+
+  const VTable* m_vtable = nullptr;
+  mutable std::aligned_storage_t<Size, alignof(std::max_align_t)> m_storage;
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// Views: a read-only window on contiguous storage that shares ownership of it.
+//
+// A View<T> is a pointer and a length, like a span of const T (or, for
+// View<char>, a string_view), plus a shared_ptr to whatever owns the storage.
+// Copying a View copies the shared_ptr, never the payload, so an Async<View<T>>
+// can go through joins, results and shared Asyncs that store and copy their
+// values, and a buffer produced once is read in place by every consumer.
+// Ownership is explicit: view(c) moves a container into shared storage once,
+// and a View can also be made from an existing shared_ptr to a container, or
+// from any owner and a range that it keeps alive. A subview shares its
+// parent's owner.
+
+namespace async
+{
+  template <typename T>
+  class View
+  {
+  public:
+    using value_type = T;
+    using const_iterator = const T*;
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    View() = default;
+
+    // View the whole of a contiguous container, sharing its ownership.
+    template <typename C,
+              // constraint: C must be contiguous storage of Ts
+              std::enable_if_t<
+                std::is_convertible<
+                  decltype(std::declval<const C&>().data()), const T*>::value,
+                int> = 0>
+    explicit View(std::shared_ptr<C> c)
+      : m_data(c->data())
+      , m_size(c->size())
+      , m_owner(std::move(c))
+    {}
+
+    // View data..data+size, which owner keeps alive.
+    View(std::shared_ptr<const void> owner, const T* data, size_t size)
+      : m_data(data)
+      , m_size(size)
+      , m_owner(std::move(owner))
+    {}
+
+    const T* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    const_iterator begin() const { return m_data; }
+    const_iterator end() const { return m_data + m_size; }
+
+    const T& operator[](size_t i) const
+    {
+      assert(i < m_size);
+      return m_data[i];
+    }
+
+    // The n elements from pos (or as many as there are), like substr.
+    View subview(size_t pos, size_t n = npos) const
+    {
+      assert(pos <= m_size);
+      return View(m_owner, m_data + pos, n < m_size - pos ? n : m_size - pos);
+    }
+
+    const std::shared_ptr<const void>& owner() const { return m_owner; }
+
+  private:
+    const T* m_data = nullptr;
+    size_t m_size = 0;
+    std::shared_ptr<const void> m_owner;
+  };
+
+  template <typename T>
+  constexpr size_t View<T>::npos;
+
+  // Move (or copy, if it's an lvalue) a container into shared storage, and view
+  // all of it.
+  template <typename C>
+  inline View<typename std::decay_t<C>::value_type> view(C&& c)
+  {
+    using T = typename std::decay_t<C>::value_type;
+    return View<T>(std::make_shared<const std::decay_t<C>>(std::forward<C>(c)));
+  }
+
+  inline std::string toString(const View<char>& v)
+  {
+    return std::string(v.data(), v.size());
+  }
+}
@@ -0,0 +1,392 @@
+#pragma once
+
+#include "unique_function.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// A work-stealing executor.
+//
+// Each worker owns a Chase-Lev deque. Work submitted from one of the pool's own
+// threads (which is where the continuations of an Async running on the pool
+// are scheduled from) is pushed onto the bottom of that worker's deque and
+// taken from there LIFO, so a continuation usually runs next on the thread and
+// the cache that produced its input. Idle workers steal from the top of other
+// workers' deques. Work submitted from outside goes onto a shared injection
+// queue.
+//
+// A task on a deque lives in a node, which the worker that runs it keeps on a
+// free list of its own (up to a limit), which only it touches, to queue its
+// next task in; the injection queue holds tasks by value, and a worker moves
+// one it takes into a node of its own. So once the free lists have filled,
+// queueing work doesn't touch the heap for the nodes, wherever the work came
+// from and whoever steals it.
+
+namespace async
+{
+  // The Chase-Lev work-stealing deque ("Dynamic Circular Work-Stealing Deque",
+  // with the memory orderings of Le et al.), holding pointers. Only the owning
+  // thread may push and take; any thread may steal. The elements themselves are
+  // published with release/acquire, so whoever gets a pointer also sees what it
+  // points to.
+  template <typename T>
+  class WorkStealingDeque
+  {
+    static_assert(std::is_pointer<T>::value,
+                  "WorkStealingDeque holds pointers");
+
+    struct Array
+    {
+      explicit Array(int64_t n)
+        : size(n), mask(n - 1), buffer(new std::atomic<T>[n])
+      {}
+
+      T get(int64_t i) const
+      {
+        return buffer[i & mask].load(std::memory_order_acquire);
+      }
+
+      void put(int64_t i, T t)
+      {
+        buffer[i & mask].store(t, std::memory_order_release);
+      }
+
+      int64_t size;
+      int64_t mask;
+      std::unique_ptr<std::atomic<T>[]> buffer;
+    };
+
+  public:
+    explicit WorkStealingDeque(int64_t capacity = 256)
+      : m_top(0), m_bottom(0)
+    {
+      // the capacity must be a power of two
+      int64_t n = 1;
+      while (n < capacity)
+        n <<= 1;
+      m_arrays.emplace_back(new Array(n));
+      m_array.store(m_arrays.back().get(), std::memory_order_relaxed);
+    }
+
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+    // owner only
+    void push(T t)
+    {
+      int64_t b = m_bottom.load(std::memory_order_relaxed);
+      int64_t top = m_top.load(std::memory_order_acquire);
+      Array* a = m_array.load(std::memory_order_relaxed);
+      if (b - top > a->size - 1)
+        a = grow(a, top, b);
+      a->put(b, t);
+      std::atomic_thread_fence(std::memory_order_release);
+      m_bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // owner only: returns nullptr if empty
+    T take()
+    {
+      int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+      Array* a = m_array.load(std::memory_order_relaxed);
+      m_bottom.store(b, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      int64_t top = m_top.load(std::memory_order_relaxed);
+
+      T t = nullptr;
+      if (top <= b)
+      {
+        t = a->get(b);
+        if (top == b)
+        {
+          // the last element: race any stealers for it
+          if (!m_top.compare_exchange_strong(top, top + 1,
+                                             std::memory_order_seq_cst,
+                                             std::memory_order_relaxed))
+            t = nullptr;
+          m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+      }
+      else
+      {
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+      }
+      return t;
+    }
+
+    // any thread: returns nullptr if empty, or if another thread won the race
+    // for the top element
+    T steal()
+    {
+      int64_t top = m_top.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      int64_t b = m_bottom.load(std::memory_order_acquire);
+
+      if (top < b)
+      {
+        Array* a = m_array.load(std::memory_order_acquire);
+        T t = a->get(top);
+        if (!m_top.compare_exchange_strong(top, top + 1,
+                                           std::memory_order_seq_cst,
+                                           std::memory_order_relaxed))
+          return nullptr;
+        return t;
+      }
+      return nullptr;
+    }
+
+    bool empty() const
+    {
+      int64_t b = m_bottom.load(std::memory_order_relaxed);
+      int64_t top = m_top.load(std::memory_order_relaxed);
+      return b <= top;
+    }
+
+  private:
+    // Stealers may still be reading the old array, so it's kept until the
+    // deque is destroyed.
+    Array* grow(Array* a, int64_t top, int64_t b)
+    {
+      m_arrays.emplace_back(new Array(a->size * 2));
+      Array* bigger = m_arrays.back().get();
+      for (int64_t i = top; i < b; ++i)
+        bigger->put(i, a->get(i));
+      m_array.store(bigger, std::memory_order_release);
+      return bigger;
+    }
+
+    std::atomic<int64_t> m_top;
+    std::atomic<int64_t> m_bottom;
+    std::atomic<Array*> m_array;
+    std::vector<std::unique_ptr<Array>> m_arrays;
+  };
+
+  class WorkStealingPool
+  {
+    using Task = UniqueFunction<void ()>;
+
+    static const size_t MAX_FREE = 256;
+
+    // A task, or while it's on a free list, room for one.
+    struct Node
+    {
+      Task& task() { return *reinterpret_cast<Task*>(&storage); }
+
+      std::aligned_storage_t<sizeof(Task), alignof(Task)> storage;
+      Node* next;
+    };
+
+    struct Worker
+    {
+      ~Worker()
+      {
+        while (Node* n = free)
+        {
+          free = n->next;
+          delete n;
+        }
+      }
+
+      WorkStealingDeque<Node*> deque;
+      uint32_t rng;
+      Node* free = nullptr;
+      size_t freeCount = 0;
+    };
+
+  public:
+    explicit WorkStealingPool(size_t n = std::thread::hardware_concurrency())
+    {
+      if (n == 0)
+        n = 1;
+      for (size_t i = 0; i < n; ++i)
+      {
+        m_workers.emplace_back(new Worker());
+        m_workers.back()->rng = static_cast<uint32_t>(i * 2654435761u + 1);
+      }
+      m_threads.reserve(n);
+      for (size_t i = 0; i < n; ++i)
+        m_threads.emplace_back([this, i] () { run(i); });
+    }
+
+    // Work still queued when the pool is destroyed is run before the threads
+    // are joined.
+    ~WorkStealingPool()
+    {
+      m_stopping.store(true);
+      wakeAll();
+      for (auto& t : m_threads)
+        t.join();
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    void execute(Task f)
+    {
+      if (Worker* w = currentWorker())
+      {
+        Node* t = allocate(*w);
+        new (&t->storage) Task(std::move(f));
+        w->deque.push(t);
+      }
+      else
+      {
+        std::lock_guard<std::mutex> g(m_injectMutex);
+        m_inject.push_back(std::move(f));
+      }
+      notify();
+    }
+
+    size_t size() const { return m_threads.size(); }
+
+  private:
+    struct Current
+    {
+      WorkStealingPool* pool;
+      Worker* worker;
+    };
+
+    static Current& current()
+    {
+      thread_local Current c = { nullptr, nullptr };
+      return c;
+    }
+
+    Worker* currentWorker()
+    {
+      Current& c = current();
+      return c.pool == this ? c.worker : nullptr;
+    }
+
+    static Node* allocate(Worker& w)
+    {
+      if (!w.free)
+        return new Node;
+      Node* n = w.free;
+      w.free = n->next;
+      --w.freeCount;
+      return n;
+    }
+
+    static void recycle(Worker& w, Node* n)
+    {
+      n->task().~Task();
+      if (w.freeCount == MAX_FREE)
+      {
+        delete n;
+        return;
+      }
+      n->next = w.free;
+      w.free = n;
+      ++w.freeCount;
+    }
+
+    Node* findWork(size_t self)
+    {
+      Worker& w = *m_workers[self];
+      if (Node* t = w.deque.take())
+        return t;
+
+      {
+        std::lock_guard<std::mutex> g(m_injectMutex);
+        if (!m_inject.empty())
+        {
+          Node* t = allocate(w);
+          new (&t->storage) Task(std::move(m_inject.front()));
+          m_inject.pop_front();
+          return t;
+        }
+      }
+
+      // steal, starting from a random victim
+      size_t n = m_workers.size();
+      w.rng ^= w.rng << 13;
+      w.rng ^= w.rng >> 17;
+      w.rng ^= w.rng << 5;
+      size_t start = w.rng % n;
+      for (size_t i = 0; i < n; ++i)
+      {
+        size_t victim = (start + i) % n;
+        if (victim == self)
+          continue;
+        if (Node* t = m_workers[victim]->deque.steal())
+          return t;
+      }
+      return nullptr;
+    }
+
+    bool anyWork()
+    {
+      for (auto& w : m_workers)
+        if (!w->deque.empty())
+          return true;
+      std::lock_guard<std::mutex> g(m_injectMutex);
+      return !m_inject.empty();
+    }
+
+    // Sleeping uses an epoch: submitters bump it and then wake a sleeper if
+    // there are any; a worker only sleeps if the epoch hasn't moved since
+    // before it last looked for work.
+    void notify()
+    {
+      m_epoch.fetch_add(1);
+      if (m_sleepers.load() > 0)
+      {
+        std::lock_guard<std::mutex> g(m_sleepMutex);
+        m_sleepCv.notify_one();
+      }
+    }
+
+    void wakeAll()
+    {
+      m_epoch.fetch_add(1);
+      std::lock_guard<std::mutex> g(m_sleepMutex);
+      m_sleepCv.notify_all();
+    }
+
+    void run(size_t self)
+    {
+      current() = { this, m_workers[self].get() };
+      for (;;)
+      {
+        uint64_t epoch = m_epoch.load();
+        if (Node* t = findWork(self))
+        {
+          t->task()();
+          recycle(*m_workers[self], t);
+          continue;
+        }
+        if (m_stopping.load() && !anyWork())
+          break;
+
+        std::unique_lock<std::mutex> g(m_sleepMutex);
+        m_sleepers.fetch_add(1);
+        m_sleepCv.wait(g, [this, epoch] () {
+            return m_epoch.load() != epoch || m_stopping.load(); });
+        m_sleepers.fetch_sub(1);
+      }
+      current() = { nullptr, nullptr };
+    }
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::mutex m_injectMutex;
+    std::deque<Task> m_inject;
+
+    std::atomic<uint64_t> m_epoch{0};
+    std::atomic<int> m_sleepers{0};
+    std::atomic<bool> m_stopping{false};
+    std::mutex m_sleepMutex;
+    std::condition_variable m_sleepCv;
+
+    std::vector<std::thread> m_threads;
+  };
+}
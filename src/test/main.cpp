@@ -1,8 +1,36 @@
 #include <async.h>
-
+#include <batcher.h>
+#include <executor.h>
+#include <memoize.h>
+#include <plan.h>
+#include <result.h>
+#include <shared_async.h>
+#include <stream.h>
+#include <timer.h>
+#define ASYNC_TRACK_ALLOCATIONS
+#include <tracking.h>
+#include <traverse.h>
+#include <view.h>
+#include <work_stealing_pool.h>
+#if defined(__cpp_impl_coroutine)
+#include <task.h>
+#endif
+#if defined(__linux__)
+#include <reactor.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#endif
+
+#include <array>
+#include <sstream>
+#include <stdexcept>
 #include <cassert>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 using namespace std;
 using namespace async;
@@ -30,15 +58,16 @@ char FirstChar(string s)
 
 void testFmap()
 {
-  Async<short> i = pure(123);
+  // Asyncs are move-only, so each test gets its own
+  auto i = [] () -> Async<short> { return pure(123); };
 
   // identity
   {
-    auto a = fmap(&id<int>, i);
+    auto a = fmap(&id<int>, i());
     char result_a;
     a([&result_a] (char c) { result_a = c; });
 
-    auto b = id(i);
+    auto b = id(i());
     char result_b;
     b([&result_b] (char c) { result_b = c; });
 
@@ -47,8 +76,8 @@ void testFmap()
 
   // composition
   {
-    auto a = fmap(ToString, i);
-    auto b = fmap(FirstChar, a);
+    auto a = fmap(ToString, i());
+    auto b = fmap(FirstChar, std::move(a));
 
     char result;
     b([&result] (char c) { result = c; });
@@ -57,11 +86,32 @@ void testFmap()
 
   // lambdas
   {
-    auto a = fmap([] (int n) { return to_string(n); }, i);
+    auto a = fmap([] (int n) { return to_string(n); }, i());
     string result;
     a([&result] (const string& s) { result = s; });
     assert(result == "123");
   }
+
+  // invoking an op gives up what it captured, but invoking it as const leaves
+  // it as built, so the same op can be invoked again
+  {
+    auto a = fmap([] (const string& s) { return s.size(); },
+                  pure(string(40, 'x')));
+    const auto& ca = a;
+    size_t r1 = 0;
+    size_t r2 = 0;
+    ca([&r1] (size_t n) { r1 = n; });
+    ca([&r2] (size_t n) { r2 = n; });
+    assert(r1 == 40 && r2 == 40);
+
+    auto p = pure(string(40, 'x'));
+    const auto& cp = p;
+    string s1;
+    string s2;
+    cp([&s1] (string s) { s1 = std::move(s); });
+    cp([&s2] (string s) { s2 = std::move(s); });
+    assert(s1.size() == 40 && s2.size() == 40);
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -77,8 +127,8 @@ void testApply()
   // regular functions
   {
     auto x = fmap(add, pure(1));
-    auto y = apply(x, pure(2));
-    auto z = apply(y, pure(3));
+    auto y = async::apply(std::move(x), pure(2));
+    auto z = async::apply(std::move(y), pure(3));
     int result;
     z([&result] (int i) { result = i; });
     assert(result == 6);
@@ -87,12 +137,30 @@ void testApply()
   // lambdas
   {
     auto x = fmap([] (int x, int y, int z) { return x + y + z; }, pure(1));
-    auto y = apply(x, pure(2));
-    auto z = apply(y, pure(3));
+    auto y = async::apply(std::move(x), pure(2));
+    auto z = async::apply(std::move(y), pure(3));
     int result;
     z([&result] (int i) { result = i; });
     assert(result == 6);
   }
+  // partially applied functions are concrete closures, not erased ones
+  {
+    auto x = fmap(add, pure(1));
+    auto y = async::apply(std::move(x), pure(2));
+    static_assert(std::is_trivially_copyable<FromAsyncT<decltype(x)>>::value &&
+                  std::is_trivially_copyable<FromAsyncT<decltype(y)>>::value,
+                  "partial application shouldn't erase the function");
+  }
+
+  // so bound arguments can be move-only
+  {
+    auto x = fmap([] (std::unique_ptr<int> p, int y) { return *p + y; },
+                  pure(std::make_unique<int>(1)));
+    auto y = async::apply(std::move(x), pure(2));
+    int result;
+    y([&result] (int i) { result = i; });
+    assert(result == 3);
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -100,12 +168,12 @@ void testApply()
 
 Async<string> AsyncToString(int i)
 {
-  return [i] (std::function<void (string)> f) { f(to_string(i)); };
+  return [i] (ContinuationT<string> f) { f(to_string(i)); };
 }
 
 Async<char> AsyncFirstChar(string s)
 {
-  return [s] (std::function<void (char)> f) { f(s[0]); };
+  return [s] (ContinuationT<char> f) { f(s[0]); };
 }
 
 void testBind()
@@ -121,17 +189,17 @@ void testBind()
   // lambdas
   {
     auto a = pure(123) >= [] (int i) -> Async<string> {
-      return [i] (std::function<void (string)> f) { f(to_string(i)); }; };
+      return [i] (ContinuationT<string> f) { f(to_string(i)); }; };
     string result;
     a([&result] (const string& s) { result = s; });
     assert(result == "123");
   }
 
-  // lvalue bind
+  // moved lvalue bind
   {
     auto a = pure(123);
-    auto b = a >= AsyncToString;
-    auto c = b >= AsyncFirstChar;
+    auto b = std::move(a) >= AsyncToString;
+    auto c = std::move(b) >= AsyncFirstChar;
     c([] (char) {});
   }
 }
@@ -141,17 +209,17 @@ void testBind()
 
 Async<char> AsyncChar()
 {
-  return [] (std::function<void (char)> f) { f('A'); };
+  return [] (ContinuationT<char> f) { f('A'); };
 }
 
 Async<void> AsyncVoid()
 {
-  return [] (std::function<void ()> f) { f(); };
+  return [] (ContinuationT<void> f) { f(); };
 }
 
 Async<void> AsyncIntToVoid(int)
 {
-  return [] (std::function<void ()> f) { f(); };
+  return [] (ContinuationT<void> f) { f(); };
 }
 
 void testSequence()
@@ -187,25 +255,87 @@ void testSequence()
   // lambdas
   {
     auto a = AsyncChar() > [] () -> Async<void> {
-      return [] (std::function<void ()> f) { f(); }; };
+      return [] (ContinuationT<void> f) { f(); }; };
     a([] () {});
   }
 
-  // lvalue sequence
+  // moved lvalue sequence
   {
     auto a = pure(123);
-    auto b = a > AsyncChar;
+    auto b = std::move(a) > AsyncChar;
     b([] (char) {});
   }
 }
 
+//------------------------------------------------------------------------------
+// Stack safety: loops built from bind and sequence
+
+Async<int> countDown(int n)
+{
+  if (n == 0)
+    return pure(0);
+  return pure(n - 1) >= countDown;
+}
+
+Async<void> repeat(int n, int& count)
+{
+  if (n == 0)
+    return AsyncVoid();
+  return AsyncVoid() > [n, &count] () { ++count; return repeat(n - 1, count); };
+}
+
+void testStackSafety()
+{
+  {
+    auto a = countDown(1000000);
+    int result = -1;
+    a([&result] (int i) { result = i; });
+    assert(result == 0);
+  }
+
+  {
+    int count = 0;
+    auto a = repeat(1000000, count);
+    a([] () {});
+    assert(count == 1000000);
+  }
+
+  // an exception thrown from deep in a chain leaves the trampoline as it was
+  {
+    int depth = 0;
+    std::function<void ()> deeper = [&] () {
+      if (++depth == 1000)
+        throw std::runtime_error("deep");
+      bounce(deeper);
+    };
+    bool threw = false;
+    try
+    {
+      bounce(deeper);
+    }
+    catch (const std::runtime_error&)
+    {
+      threw = true;
+    }
+    assert(threw);
+
+    bool ran = false;
+    bounce([&ran] () { ran = true; });
+    assert(ran);
+    auto b = countDown(1000);
+    int result = -1;
+    b([&result] (int i) { result = i; });
+    assert(result == 0);
+  }
+}
+
 //------------------------------------------------------------------------------
 // AND
 
 template <typename T>
 Async<T> AsyncFirst(const std::pair<T,T>& p)
 {
-  return [p] (std::function<void (T)> f) { f(p.first); };
+  return [p] (ContinuationT<T> f) { f(p.first); };
 }
 
 void testAnd()
@@ -240,19 +370,19 @@ void testAnd()
     a([] (const std::pair<Void,Void>&) {});
   }
 
-  // lvalues (two non-voids)
+  // moved lvalues (two non-voids)
   {
     auto a1 = AsyncChar();
     auto a2 = AsyncChar();
-    auto a = a1 && a2;
+    auto a = std::move(a1) && std::move(a2);
     a([] (std::pair<char,char>) {});
   }
 
-  // lvalues (two voids)
+  // moved lvalues (two voids)
   {
     auto a1 = AsyncVoid();
     auto a2 = AsyncVoid();
-    auto a = a1 && a2;
+    auto a = std::move(a1) && std::move(a2);
     a([] (std::pair<Void,Void>) {});
   }
 
@@ -271,7 +401,7 @@ void testAnd()
 template <typename T>
 Async<T> AsyncEither(const Either<T,T>& e)
 {
-  return [e] (std::function<void (T)> f) { f(e.isRight() ? e.m_right : e.m_left); };
+  return [e] (ContinuationT<T> f) { f(e.isRight() ? e.m_right : e.m_left); };
 }
 
 
@@ -301,19 +431,19 @@ void testOr()
     a([] (const Either<Void,Void>&) {});
   }
 
-  // lvalues (two non-voids)
+  // moved lvalues (two non-voids)
   {
     auto a1 = AsyncChar();
     auto a2 = AsyncChar();
-    auto a = a1 || a2;
+    auto a = std::move(a1) || std::move(a2);
     a([] (Either<char,char>) {});
   }
 
-  // lvalues (two voids)
+  // moved lvalues (two voids)
   {
     auto a1 = AsyncVoid();
     auto a2 = AsyncVoid();
-    auto a = a1 || a2;
+    auto a = std::move(a1) || std::move(a2);
     a([] (Either<Void,Void>) {});
   }
 
@@ -327,63 +457,2042 @@ void testOr()
 }
 
 //------------------------------------------------------------------------------
-// Performance tests: number of copies
+// Move-only Asyncs and continuations
+
+void testMoveOnly()
+{
+  // a move-only value through pure and fmap
+  {
+    auto a = fmap([] (std::unique_ptr<int> p) { return *p; },
+                  pure(std::make_unique<int>(42)));
+    int result = 0;
+    a([&result] (int i) { result = i; });
+    assert(result == 42);
+  }
+
+  // a continuation with a move-only capture
+  {
+    auto p = std::make_unique<int>(1);
+    int result = 0;
+    auto a = pure(41);
+    a([p = std::move(p), &result] (int i) { result = i + *p; });
+    assert(result == 42);
+  }
+
+  // small callables are stored inline, large ones on the heap; both survive
+  // being moved
+  {
+    char big[128] = { 'A' };
+    UniqueFunction<char ()> f1 = [] () { return 'A'; };
+    UniqueFunction<char ()> f2 = [big] () { return big[0]; };
+    auto g1 = std::move(f1);
+    auto g2 = std::move(f2);
+    assert(!f1 && !f2);
+    assert(g1() == 'A' && g2() == 'A');
+  }
+}
+
+//------------------------------------------------------------------------------
+// Static pipelines
+
+void testStatic()
+{
+  // a fixed-shape pipeline is one concrete type...
+  {
+    auto a = fmap(FirstChar, fmap(ToString, pure(123)));
+    static_assert(!std::is_same<decltype(a), Async<char>>::value,
+                  "combinators should not erase");
+    static_assert(std::is_same<FromAsyncT<decltype(a)>, char>::value,
+                  "fmap should produce an AsyncOp of the mapped type");
+    char result;
+    a([&result] (char c) { result = c; });
+    assert(result == '1');
+  }
+
+  // ...which is erased on request
+  {
+    Async<char> a = (pure(123) >= AsyncToString >= AsyncFirstChar).erase();
+    char result;
+    a([&result] (char c) { result = c; });
+    assert(result == '1');
+  }
+
+  // or by storing it
+  {
+    Async<std::pair<char,char>> a = AsyncChar() && AsyncChar();
+    std::pair<char,char> result;
+    a([&result] (const std::pair<char,char>& p) { result = p; });
+    assert(result.first == 'A' && result.second == 'A');
+  }
+
+  // an erased Async composes with static ones
+  {
+    Async<int> a = pure(123);
+    auto b = fmap(ToString, std::move(a)) >= AsyncFirstChar;
+    char result;
+    b([&result] (char c) { result = c; });
+    assert(result == '1');
+  }
+
+  // consecutive fmaps fuse into one stage over the original source
+  {
+    auto src = pure(123);
+    auto a = fmap(FirstChar, fmap(ToString, src));
+    static_assert(std::is_same<decltype(a.m_impl.aa), decltype(src)>::value,
+                  "fmap over fmap should fuse");
+    char result;
+    a([&result] (char c) { result = c; });
+    assert(result == '1');
+
+    // fusing with an lvalue copies it, leaving it intact
+    auto b = fmap(ToString, src);
+    auto c = fmap(FirstChar, b);
+    string s;
+    b([&s] (const string& t) { s = t; });
+    c([&result] (char ch) { result = ch; });
+    assert(s == "123" && result == '1');
+  }
+
+  // but not when the outer function returns a reference, which could be to
+  // the inner one's result
+  {
+    auto inner = fmap(ToString, pure(123));
+    auto a = fmap([] (const string& t) -> const string& { return t; }, inner);
+    static_assert(std::is_same<decltype(a.m_impl.aa), decltype(inner)>::value,
+                  "fmap returning a reference shouldn't fuse");
+    string s;
+    a([&s] (const string& t) { s = t; });
+    assert(s == "123");
+  }
+}
+
+//------------------------------------------------------------------------------
+// Concurrency: Asyncs that complete on other threads
+
+// Makes Asyncs that deliver their values from new threads, and joins the
+// threads when it goes out of scope.
+struct Threads
+{
+  ~Threads()
+  {
+    for (auto& t : m_threads)
+      t.join();
+  }
+
+  template <typename T>
+  Async<T> deliver(T t)
+  {
+    return [this, t] (ContinuationT<T> c) {
+      std::lock_guard<std::mutex> g(m_mutex);
+      m_threads.emplace_back([t, c = std::move(c)] () { c(t); });
+    };
+  }
+
+  std::mutex m_mutex;
+  std::vector<std::thread> m_threads;
+};
+
+void testConcurrentApply()
+{
+  for (int n = 0; n < 100; ++n)
+  {
+    std::atomic<int> result(0);
+    {
+      Threads threads;
+      auto a = async::apply(fmap([] (int x, int y) { return x + y; },
+                          threads.deliver(1)),
+                     threads.deliver(2));
+      a([&result] (int i) { result = i; });
+    }
+    assert(result == 3);
+  }
+}
+
+void testConcurrentRace()
+{
+  for (int n = 0; n < 100; ++n)
+  {
+    std::atomic<int> calls(0);
+    {
+      Threads threads;
+      auto a = threads.deliver(1) || threads.deliver('A');
+      a([&calls] (const Either<int,char>&) { ++calls; });
+    }
+    assert(calls == 1);
+  }
+}
+
+void testWhenAll()
+{
+  // variadic, with a void
+  {
+    auto a = when_all(pure(1), AsyncChar(), AsyncVoid(), pure(string("abc")));
+    std::tuple<int, char, Void, string> result;
+    a([&result] (std::tuple<int, char, Void, string> t) { result = std::move(t); });
+    assert(std::get<0>(result) == 1);
+    assert(std::get<1>(result) == 'A');
+    assert(std::get<3>(result) == "abc");
+  }
+
+  // range
+  {
+    std::vector<Async<int>> v;
+    for (int i = 0; i < 10; ++i)
+      v.push_back(pure(i));
+    auto a = when_all(std::move(v));
+    std::vector<int> result;
+    a([&result] (std::vector<int> r) { result = std::move(r); });
+    assert(result.size() == 10);
+    for (int i = 0; i < 10; ++i)
+      assert(result[i] == i);
+  }
+
+  // ranges of results that can't be written in place
+  {
+    std::vector<Async<bool>> v;
+    for (int i = 0; i < 10; ++i)
+      v.push_back(pure(i % 3 == 0));
+    auto a = when_all(std::move(v));
+    int count = 0;
+    a([&count] (std::vector<bool> r) {
+        for (bool b : r)
+          count += b;
+      });
+    assert(count == 4);
+
+    int x = 1;
+    int y = 2;
+    std::vector<Async<std::reference_wrapper<int>>> w;
+    w.push_back(pure(std::ref(x)));
+    w.push_back(pure(std::ref(y)));
+    auto b = when_all(std::move(w));
+    int sum = 0;
+    b([&sum] (std::vector<std::reference_wrapper<int>> r) {
+        sum = r[0] + r[1];
+      });
+    assert(sum == 3);
+  }
+
+  // empty range
+  {
+    auto a = when_all(std::vector<Async<int>>());
+    bool called = false;
+    a([&called] (std::vector<int> r) { called = r.empty(); });
+    assert(called);
+  }
+
+  // concurrent arrivals
+  for (int n = 0; n < 20; ++n)
+  {
+    std::atomic<int> sum(0);
+    std::atomic<int> tupleSum(0);
+    {
+      Threads threads;
+      std::vector<Async<int>> v;
+      for (int i = 0; i < 64; ++i)
+        v.push_back(threads.deliver(i));
+      auto a = when_all(std::move(v));
+      a([&sum] (std::vector<int> r) {
+          int total = 0;
+          for (size_t i = 0; i < r.size(); ++i)
+            total += (r[i] == static_cast<int>(i)) ? r[i] : -1000;
+          sum = total;
+        });
+
+      auto b = when_all(threads.deliver(1), threads.deliver(2), threads.deliver(3));
+      b([&tupleSum] (std::tuple<int, int, int> t) {
+          tupleSum = std::get<0>(t) + std::get<1>(t) + std::get<2>(t);
+        });
+    }
+    assert(sum == 63 * 64 / 2);
+    assert(tupleSum == 6);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Cancellation
+
+// An Async that never completes by itself, but notes when it's told to stop.
+struct Cancellable
+{
+  Async<int> get()
+  {
+    return [this] (ContinuationT<int> c) {
+      m_pending = std::move(c);
+      m_callback = StopCallback(currentStopToken(), [this] () { m_cancelled = true; });
+    };
+  }
+
+  ContinuationT<int> m_pending;
+  StopCallback m_callback;
+  bool m_cancelled = false;
+};
+
+void testCancel()
+{
+  // the loser of a race is told to stop when the winner completes
+  {
+    Cancellable slow;
+    auto a = slow.get() || pure('A');
+    bool done = false;
+    a([&done] (const Either<int,char>& e) { done = e.isRight(); });
+    assert(done && slow.m_cancelled);
+  }
+
+  // if the first side wins immediately, the second isn't started
+  {
+    Cancellable slow;
+    auto a = pure('A') || slow.get();
+    a([] (const Either<char,int>&) {});
+    assert(!slow.m_pending);
+  }
+
+  // a cancelled branch doesn't start its next stage
+  {
+    Cancellable slow;
+    bool started = false;
+    auto loser = slow.get() >= [&started] (int i) { started = true; return pure(i); };
+    auto a = std::move(loser) || pure(1);
+    a([] (const Either<int,int>&) {});
+    slow.m_pending(42);
+    assert(!started);
+  }
+
+  // the winner's downstream stages aren't cancelled
+  {
+    auto a = (pure(1) || zero<int>()) >= [] (const Either<int,int>& e) {
+      return pure(e.m_left + 1); };
+    int result = 0;
+    a([&result] (int i) { result = i; });
+    assert(result == 2);
+  }
+
+  // nested races: when the outer race is won, the inner losers are stopped
+  {
+    Cancellable slow;
+    auto inner = slow.get() || zero<int>();
+    auto a = std::move(inner) || pure(1);
+    a([] (const Either<Either<int,int>,int>&) {});
+    assert(slow.m_cancelled);
+  }
+
+  // outside a race, nothing is ever stopped
+  {
+    Cancellable slow;
+    auto a = slow.get();
+    a([] (int) {});
+    assert(!currentStopToken().stopPossible());
+    assert(!slow.m_cancelled);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Racing many Asyncs
+
+// Throws when it's copied, if it's told to.
+struct ThrowOnCopy
+{
+  explicit ThrowOnCopy(bool t) : m_throw(t) {}
+  ThrowOnCopy(const ThrowOnCopy& other) : m_throw(other.m_throw)
+  {
+    if (m_throw)
+      throw std::runtime_error("copy");
+  }
+  ThrowOnCopy(ThrowOnCopy&&) = default;
+  ThrowOnCopy& operator=(const ThrowOnCopy&) = default;
+  ThrowOnCopy& operator=(ThrowOnCopy&&) = default;
+
+  bool m_throw;
+};
+
+// Throws when it's moved, if it's told to.
+struct ThrowOnMove
+{
+  explicit ThrowOnMove(bool t) : m_throw(t) {}
+  ThrowOnMove(const ThrowOnMove&) = default;
+  ThrowOnMove(ThrowOnMove&& other) : m_throw(other.m_throw)
+  {
+    if (m_throw)
+      throw std::runtime_error("move");
+  }
+  ThrowOnMove& operator=(const ThrowOnMove&) = default;
+  ThrowOnMove& operator=(ThrowOnMove&&) = default;
+
+  bool m_throw;
+};
+
+void testWhenAny()
+{
+  // an assignment that throws leaves the target as it was
+  {
+    OneOf<string, ThrowOnCopy> a(InPlaceIndex<0>(), "abc");
+    const OneOf<string, ThrowOnCopy> b(InPlaceIndex<1>(), true);
+    bool threw = false;
+    try
+    {
+      a = b;
+    }
+    catch (const std::runtime_error&)
+    {
+      threw = true;
+    }
+    assert(threw);
+    assert(a.index() == 0 && a.get<0>() == "abc");
+    a = OneOf<string, ThrowOnCopy>(InPlaceIndex<1>(), false);
+    assert(a.index() == 1);
+  }
+
+  // variadic: the first to complete wins, tagged with its index
+  {
+    Cancellable slow;
+    auto a = when_any(slow.get(), AsyncVoid(), pure(string("abc")));
+    size_t index = 99;
+    a([&index] (const OneOf<int, Void, string>& r) { index = r.index(); });
+    assert(index == 1);
+    assert(slow.m_cancelled);
+  }
+
+  // later branches aren't started once there's a winner
+  {
+    Cancellable slow;
+    auto a = when_any(pure(string("abc")), slow.get());
+    string result;
+    a([&result] (OneOf<string, int> r) { result = std::move(r).get<0>(); });
+    assert(result == "abc");
+    assert(!slow.m_pending);
+  }
+
+  // range
+  {
+    Cancellable slow1;
+    Cancellable slow2;
+    std::vector<Async<int>> v;
+    v.push_back(slow1.get());
+    v.push_back(pure(42));
+    v.push_back(slow2.get());
+    auto a = when_any(std::move(v));
+    std::pair<size_t, int> result;
+    a([&result] (std::pair<size_t, int> r) { result = r; });
+    assert(result.first == 1 && result.second == 42);
+    assert(slow1.m_cancelled && !slow2.m_pending);
+  }
+
+  // concurrent completions: exactly one winner
+  for (int n = 0; n < 50; ++n)
+  {
+    std::atomic<int> calls(0);
+    {
+      Threads threads;
+      std::vector<Async<int>> v;
+      for (int i = 0; i < 5; ++i)
+        v.push_back(threads.deliver(i));
+      auto a = when_any(std::move(v));
+      a([&calls] (std::pair<size_t, int> r) {
+          assert(static_cast<int>(r.first) == r.second);
+          ++calls;
+        });
+      auto b = when_any(threads.deliver(1), threads.deliver('A'), threads.deliver(2));
+      b([&calls] (const OneOf<int, char, int>&) { ++calls; });
+    }
+    assert(calls == 2);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Executors
+
+void testExecutors()
+{
+  const auto mainThread = std::this_thread::get_id();
+
+  // the inline executor runs continuations where they are
+  {
+    InlineExecutor ex;
+    auto a = via(ex, pure(1));
+    std::thread::id where;
+    a([&where] (int) { where = std::this_thread::get_id(); });
+    assert(where == mainThread);
+  }
+
+  // via delivers the result, and runs everything downstream, on the executor
+  {
+    std::thread::id where;
+    int result = 0;
+    {
+      ThreadPool pool(2);
+      auto a = fmap(ToString, via(pool, pure(123))) >= AsyncFirstChar;
+      a([&where, &result] (char c) {
+          where = std::this_thread::get_id();
+          result = c;
+        });
+    }
+    assert(where != mainThread);
+    assert(result == '1');
+  }
+
+  // on hops part way through a chain, including for void Asyncs
+  {
+    std::thread::id where1;
+    std::thread::id where2;
+    {
+      ThreadPool pool(1);
+      auto a = (on(pool) > [&where1] () {
+          where1 = std::this_thread::get_id();
+          return pure(1); })
+        > [&pool] () { return via(pool, AsyncVoid()); };
+      a([&where2] () { where2 = std::this_thread::get_id(); });
+    }
+    assert(where1 != mainThread);
+    assert(where2 != mainThread);
+  }
+
+  // many concurrent joins on a pool
+  {
+    std::atomic<int> sum(0);
+    {
+      ThreadPool pool(4);
+      for (int i = 0; i < 100; ++i)
+      {
+        auto a = when_all(via(pool, pure(i)), via(pool, pure(i)));
+        a([&sum] (std::tuple<int, int> t) { sum += std::get<0>(t) + std::get<1>(t); });
+      }
+    }
+    assert(sum == 99 * 100);
+  }
+}
+
+void testWorkStealingDeque()
+{
+  int values[1000];
+  WorkStealingDeque<int*> d(4);
+
+  // the owner takes LIFO, thieves steal FIFO, and the deque grows as needed
+  for (int i = 0; i < 1000; ++i)
+    d.push(&values[i]);
+  assert(d.steal() == &values[0]);
+  assert(d.take() == &values[999]);
+  assert(d.steal() == &values[1]);
+  for (int i = 998; i >= 2; --i)
+    assert(d.take() == &values[i]);
+  assert(d.empty());
+  assert(d.take() == nullptr);
+  assert(d.steal() == nullptr);
+
+  // concurrent thieves: every element is had exactly once
+  std::atomic<int> seen[1000];
+  for (auto& s : seen)
+    s = 0;
+  for (int i = 0; i < 1000; ++i)
+    d.push(&values[i]);
+  std::vector<std::thread> thieves;
+  for (int t = 0; t < 3; ++t)
+  {
+    thieves.emplace_back([&d, &seen, &values] () {
+        for (int misses = 0; misses < 1000; )
+        {
+          if (int* p = d.steal())
+            ++seen[p - values];
+          else
+            ++misses;
+        }
+      });
+  }
+  while (int* p = d.take())
+    ++seen[p - values];
+  for (auto& t : thieves)
+    t.join();
+  for (auto& s : seen)
+    assert(s == 1);
+}
+
+// Fan out recursively on the pool, summing 1..n
+void fanOut(WorkStealingPool& pool, int lo, int hi, std::atomic<int>& sum)
+{
+  if (hi - lo <= 4)
+  {
+    for (int i = lo; i <= hi; ++i)
+      sum += i;
+    return;
+  }
+  int mid = (lo + hi) / 2;
+  auto a = when_all(via(pool, pure(lo)), via(pool, pure(hi)));
+  a([&pool, &sum, mid] (std::tuple<int, int> t) {
+      fanOut(pool, std::get<0>(t), mid, sum);
+      fanOut(pool, mid + 1, std::get<1>(t), sum);
+    });
+}
+
+// Queues itself again, from the pool's thread, until it's done.
+struct Resubmit
+{
+  void operator()() const
+  {
+    if (--*left > 0)
+      pool->execute(*this);
+  }
+
+  WorkStealingPool* pool;
+  std::atomic<int>* left;
+};
+
+void testWorkStealingPool()
+{
+  const auto mainThread = std::this_thread::get_id();
+
+  {
+    std::thread::id where;
+    int result = 0;
+    {
+      WorkStealingPool pool(2);
+      auto a = fmap(ToString, via(pool, pure(123))) >= AsyncFirstChar;
+      a([&where, &result] (char c) {
+          where = std::this_thread::get_id();
+          result = c;
+        });
+    }
+    assert(where != mainThread);
+    assert(result == '1');
+  }
+
+  {
+    std::atomic<int> sum(0);
+    {
+      WorkStealingPool pool(4);
+      auto a = on(pool) > [&pool, &sum] () {
+        fanOut(pool, 1, 1000, sum);
+        return pure(0);
+      };
+      a([] (int) {});
+    }
+    assert(sum == 1000 * 1001 / 2);
+  }
+
+  // once a worker's free list has filled, it queues work without allocating
+  {
+    WorkStealingPool pool(1);
+    std::atomic<int> left(0);
+    auto chain = [&pool, &left] () {
+      left = 100;
+      pool.execute(Resubmit{ &pool, &left });
+      while (left.load() > 0)
+        std::this_thread::yield();
+    };
+    chain();
+    tracking::Scope s;
+    chain();
+    // all but, now and then, a block of the injection queue's
+    assert(s.allocations() <= 1);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Timers
+
+// Wait (for a while) for something another thread will do.
+template <typename P>
+bool eventually(P p)
+{
+  for (int i = 0; i < 2000 && !p(); ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  return p();
+}
+
+void testTimers()
+{
+  using namespace std::chrono;
+  TimerWheel wheel;
+
+  // after completes once its time has passed
+  {
+    std::atomic<bool> done(false);
+    auto start = steady_clock::now();
+    steady_clock::time_point fired;
+    auto a = after(wheel, milliseconds(20));
+    a([&done, &fired] (Void) { fired = steady_clock::now(); done = true; });
+    assert(eventually([&done] { return done.load(); }));
+    assert(fired - start >= milliseconds(20));
+  }
+
+  // timers fire in order, including across levels of the wheel
+  {
+    std::mutex m;
+    std::vector<int> order;
+    for (int ms : { 150, 5, 70, 1 })
+    {
+      auto a = after(wheel, milliseconds(ms));
+      a([&m, &order, ms] (Void) {
+          std::lock_guard<std::mutex> g(m);
+          order.push_back(ms);
+        });
+    }
+    assert(eventually([&m, &order] {
+          std::lock_guard<std::mutex> g(m);
+          return order.size() == 4; }));
+    assert(order == std::vector<int>({ 1, 5, 70, 150 }));
+  }
+
+  // a timeout that doesn't fire is unlinked as soon as its Async completes
+  {
+    Either<Void, int> result(Void(), true);
+    auto a = timeout(wheel, pure(42), seconds(10));
+    a([&result] (Either<Void, int> e) { result = std::move(e); });
+    assert(result.isRight() && result.m_right == 42);
+    assert(wheel.pending() == 0);
+  }
+
+  // a timeout that fires stops its Async
+  {
+    Cancellable c;
+    std::atomic<bool> timedOut(false);
+    auto a = timeout(wheel, c.get(), milliseconds(5));
+    a([&timedOut] (Either<Void, int> e) { timedOut = !e.isRight(); });
+    assert(eventually([&timedOut] { return timedOut.load(); }));
+    assert(c.m_cancelled);
+  }
+
+  // stopping a timer unlinks it
+  {
+    StopSource source;
+    bool fired = false;
+    {
+      StopScope scope(source.token());
+      auto a = after(wheel, hours(1));
+      a([&fired] (Void) { fired = true; });
+    }
+    assert(wheel.pending() == 1);
+    source.requestStop();
+    assert(wheel.pending() == 0);
+    assert(!fired);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Sharing
+
+void testShare()
+{
+  // upstream runs once, on first use, however many consumers there are
+  {
+    int runs = 0;
+    auto s = share(Async<string>([&runs] (ContinuationT<string> c) {
+          ++runs;
+          c("shared");
+        }));
+    assert(runs == 0);
+
+    const string* first = nullptr;
+    const string* second = nullptr;
+    s([&first] (const string& v) { first = &v; });
+    s([&second] (const string& v) { second = &v; });
+    assert(runs == 1);
+
+    // late subscribers get the cached value by reference; continuations that
+    // want their own value get a copy
+    assert(first == second);
+    string copy;
+    s([&copy] (string&& v) { copy = std::move(v); });
+    assert(copy == "shared");
+    assert(*first == "shared");
+  }
+
+  // shared Asyncs compose, and copies of the handle share one execution
+  {
+    int runs = 0;
+    auto s = share(fmap([&runs] (int i) { ++runs; return i * 2; }, pure(21)));
+    auto t = s;
+    auto a = when_all(s, t, fmap(ToString, s));
+    std::tuple<int, int, string> result;
+    a([&result] (std::tuple<int, int, string> r) { result = std::move(r); });
+    assert(runs == 1);
+    assert(result == std::make_tuple(42, 42, string("42")));
+
+    int bound = 0;
+    auto b = s >= [] (int i) { return pure(i + 1); };
+    b([&bound] (int i) { bound = i; });
+    assert(bound == 43);
+  }
+
+  // void, too
+  {
+    int runs = 0;
+    int calls = 0;
+    auto s = share(Async<void>([&runs] (ContinuationT<void> c) { ++runs; c(); }));
+    s([&calls] () { ++calls; });
+    s([&calls] () { ++calls; });
+    assert(runs == 1);
+    assert(calls == 2);
+  }
+
+  // the upstream doesn't live in the resource current where it's shared, so
+  // it can be started after that resource is gone
+  {
+    std::array<char, 100> big{};
+    auto s = [big] () {
+      Arena arena;
+      ResourceScope scope(&arena);
+      auto shared = share(fmap([big] (int i) { return i + int(big.size()); },
+                               pure(1)));
+      assert(arena.bytesAllocated() == 0);
+      return shared;
+    }();
+    int result = 0;
+    s([&result] (int i) { result = i; });
+    assert(result == 101);
+  }
+
+  // subscribers queued from many threads while upstream is in flight
+  for (int n = 0; n < 20; ++n)
+  {
+    std::atomic<int> sum(0);
+    {
+      Threads threads;
+      auto s = share(threads.deliver(1));
+      std::vector<std::thread> subscribers;
+      for (int i = 0; i < 4; ++i)
+        subscribers.emplace_back([s, &sum] () {
+            for (int j = 0; j < 25; ++j)
+              s([&sum] (int v) { sum += v; });
+          });
+      for (auto& t : subscribers)
+        t.join();
+    }
+    assert(sum == 100);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Batching
+
+// Runs work inline, counting it.
+struct CountingExecutor
+{
+  template <typename F>
+  void execute(F&& f)
+  {
+    ++count;
+    f();
+  }
+
+  std::atomic<int> count{0};
+};
+
+// A bulk loader that doubles its keys, and records the batches it's given.
+struct Doubler
+{
+  Async<std::vector<int>> operator()(std::vector<int> keys) const
+  {
+    {
+      std::lock_guard<std::mutex> g(*m);
+      batches->push_back(keys);
+    }
+    for (auto& k : keys)
+      k *= 2;
+    return pure(std::move(keys));
+  }
+
+  std::shared_ptr<std::mutex> m = std::make_shared<std::mutex>();
+  std::shared_ptr<std::vector<std::vector<int>>> batches =
+    std::make_shared<std::vector<std::vector<int>>>();
+};
+
+void testBatcher()
+{
+  using namespace std::chrono;
+  TimerWheel wheel;
+  CountingExecutor ex;
+
+  // a full batch is sent at once, and its values go back to their requesters
+  {
+    Doubler d;
+    Batcher<int, int> b(ex, d, 3, hours(1), wheel);
+    std::vector<int> results(3, 0);
+    for (int i = 0; i < 3; ++i)
+    {
+      auto a = b.load(i + 1);
+      a([&results, i] (int v) { results[i] = v; });
+      assert(d.batches->size() == (i < 2 ? 0u : 1u));
+    }
+    assert(*d.batches == std::vector<std::vector<int>>({ { 1, 2, 3 } }));
+    assert(results == std::vector<int>({ 2, 4, 6 }));
+    // and its window's timer is stopped
+    assert(wheel.pending() == 0);
+  }
+
+  // the size cap splits batches
+  {
+    Doubler d;
+    Batcher<int, int> b(ex, d, 2, hours(1), wheel);
+    int sum = 0;
+    for (int i = 1; i <= 5; ++i)
+      b.load(i)([&sum] (int v) { sum += v; });
+    assert(d.batches->size() == 2);
+    b.flush();
+    assert(*d.batches == std::vector<std::vector<int>>({ { 1, 2 }, { 3, 4 }, { 5 } }));
+    assert(sum == 30);
+  }
+
+  // a partial batch is sent when its window closes, on the executor
+  {
+    Doubler d;
+    CountingExecutor windows;
+    Batcher<int, int> b(windows, d, 100, milliseconds(5), wheel);
+    std::atomic<int> sum(0);
+    for (int i = 1; i <= 4; ++i)
+      b.load(i)([&sum] (int v) { sum += v; });
+    assert(eventually([&sum] { return sum == 20; }));
+    assert(d.batches->size() == 1);
+    assert(windows.count == 1);
+  }
+
+  // independent lookups in a graph become one round trip
+  {
+    Doubler d;
+    Batcher<int, int> b(ex, d, 3, hours(1), wheel);
+    auto lookup = [&b] (int k) { return b.load(k); };
+    auto a = when_all(b.load(1), pure(2) >= lookup, fmap(ToString, b.load(3)));
+    std::tuple<int, int, string> result;
+    a([&result] (std::tuple<int, int, string> r) { result = std::move(r); });
+    assert(d.batches->size() == 1);
+    assert(result == std::make_tuple(2, 4, string("6")));
+  }
+
+  // an open batch is sent when the Batcher is destroyed
+  {
+    Doubler d;
+    int v = 0;
+    {
+      Batcher<int, int> b(ex, d, 10, hours(1), wheel);
+      b.load(21)([&v] (int i) { v = i; });
+    }
+    assert(v == 42);
+    assert(wheel.pending() == 0);
+  }
+
+  // requests from many threads
+  {
+    Doubler d;
+    std::atomic<int> sum(0);
+    {
+      Batcher<int, int> b(ex, d, 8, milliseconds(1), wheel);
+      std::vector<std::thread> threads;
+      for (int t = 0; t < 4; ++t)
+        threads.emplace_back([&b, &sum] () {
+            for (int i = 0; i < 25; ++i)
+              b.load(1)([&sum] (int v) { sum += v; });
+          });
+      for (auto& t : threads)
+        t.join();
+    }
+    assert(sum == 200);
+    assert(d.batches->size() < 100);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Traversal
+
+// Asyncs that complete only when they're told to, in the order they started.
+struct Deferred
+{
+  Async<int> get(int i)
+  {
+    return [this, i] (ContinuationT<int> c) {
+      pending.push_back([i, c = std::move(c)] () { c(i * 10); });
+      maxInFlight = std::max(maxInFlight, pending.size() - completed);
+    };
+  }
+
+  void completeNext() { pending[completed++](); }
+
+  std::vector<UniqueFunction<void ()>> pending;
+  size_t completed = 0;
+  size_t maxInFlight = 0;
+};
+
+void testTraverse()
+{
+  // results are collected in order
+  {
+    auto a = traverse(std::vector<int>{ 1, 2, 3 }, [] (int i) { return pure(ToString(i)); }, 2);
+    std::vector<string> result;
+    a([&result] (std::vector<string> v) { result = std::move(v); });
+    assert(result == std::vector<string>({ "1", "2", "3" }));
+  }
+
+  // at most k are in flight, and each completion starts the next
+  {
+    Deferred d;
+    auto a = traverse(std::vector<int>{ 1, 2, 3, 4, 5 },
+                      [&d] (int i) { return d.get(i); }, 2);
+    std::vector<int> result;
+    a([&result] (std::vector<int> v) { result = std::move(v); });
+    assert(d.pending.size() == 2);
+    d.completeNext();
+    assert(d.pending.size() == 3);
+    while (d.completed < d.pending.size())
+      d.completeNext();
+    assert(d.maxInFlight == 2);
+    assert(result == std::vector<int>({ 10, 20, 30, 40, 50 }));
+  }
+
+  // an empty range completes at once
+  {
+    bool called = false;
+    auto a = traverse(std::vector<int>(), [] (int i) { return pure(i); }, 4);
+    a([&called] (std::vector<int> v) { called = v.empty(); });
+    assert(called);
+  }
+
+  // a long synchronous range runs in constant stack space
+  {
+    std::vector<int> xs(100000);
+    for (size_t i = 0; i < xs.size(); ++i)
+      xs[i] = static_cast<int>(i);
+    auto a = traverse(std::move(xs), [] (int i) { return pure(i + 1); }, 8);
+    long long sum = 0;
+    a([&sum] (std::vector<int> v) {
+        for (int i : v)
+          sum += i;
+      });
+    assert(sum == 100000LL * 100001 / 2);
+  }
+
+  // once stopped, a traversal starts nothing more
+  {
+    Deferred d;
+    StopSource source;
+    bool called = false;
+    {
+      StopScope scope(source.token());
+      auto a = traverse(std::vector<int>{ 1, 2, 3 },
+                        [&d] (int i) { return d.get(i); }, 1);
+      a([&called] (std::vector<int>) { called = true; });
+    }
+    source.requestStop();
+    d.completeNext();
+    assert(d.pending.size() == 1);
+    assert(!called);
+  }
+
+  // for_each, on a pool
+  {
+    std::atomic<int> sum(0);
+    std::atomic<int> inFlight(0);
+    std::atomic<int> maxInFlight(0);
+    std::atomic<bool> done(false);
+    {
+      ThreadPool pool(4);
+      std::vector<int> xs(200, 1);
+      auto a = for_each(std::move(xs), [&] (int i) {
+          int n = ++inFlight;
+          int m = maxInFlight;
+          while (n > m && !maxInFlight.compare_exchange_weak(m, n)) {}
+          return via(pool, pure(i)) >= [&] (int j) {
+            sum += j;
+            --inFlight;
+            return AsyncVoid();
+          };
+        }, 3);
+      a([&done] () { done = true; });
+      assert(eventually([&done] { return done.load(); }));
+    }
+    assert(sum == 200);
+    assert(maxInFlight <= 3);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Streams
+
+// A stream source that answers pulls only when it's told to.
+struct ManualSource
+{
+  struct Request
+  {
+    size_t max;
+    ContinuationT<std::vector<int>> cont;
+  };
+
+  AsyncStream<int> stream()
+  {
+    return AsyncStream<int>([this] (size_t max, ContinuationT<std::vector<int>> c) {
+        requests.push_back(Request{ max, std::move(c) });
+      });
+  }
+
+  std::vector<Request> requests;
+};
+
+void testStreams()
+{
+  auto range = [] (int n) {
+    std::vector<int> v;
+    for (int i = 1; i <= n; ++i)
+      v.push_back(i);
+    return v;
+  };
+
+  // map, filter and take compose
+  {
+    auto s = stream(range(10))
+      .map([] (int i) { return i * 2; })
+      .filter([] (int i) { return i % 3 == 0; })
+      .map(ToString)
+      .take(2);
+    std::vector<string> result;
+    collect(std::move(s))([&result] (std::vector<string> v) { result = std::move(v); });
+    assert(result == std::vector<string>({ "6", "12" }));
+  }
+
+  // elements come a chunk at a time, and next() takes just one
+  {
+    auto s = stream(range(10));
+    std::vector<int> chunk;
+    s.nextChunk(4)([&chunk] (std::vector<int> v) { chunk = std::move(v); });
+    assert(chunk == std::vector<int>({ 1, 2, 3, 4 }));
+
+    auto t = stream(range(1));
+    Either<Void, int> e(Void(), true);
+    t.next()([&e] (Either<Void, int> x) { e = std::move(x); });
+    assert(e.isRight() && e.m_right == 1);
+    t.next()([&e] (Either<Void, int> x) { e = std::move(x); });
+    assert(!e.isRight());
+  }
+
+  // one continuation call per chunk, not per element
+  {
+    int pulls = 0;
+    auto s = stream(range(1000));
+    auto counted = AsyncStream<int>(
+        [up = s.puller(), &pulls] (size_t max, ContinuationT<std::vector<int>> c) {
+          ++pulls;
+          (*up)(max, std::move(c));
+        });
+    size_t n = 0;
+    collect(std::move(counted), 100)([&n] (std::vector<int> v) { n = v.size(); });
+    assert(n == 1000);
+    assert(pulls == 11);
+  }
+
+  // a long synchronous stream runs in constant stack space
+  {
+    auto s = stream(range(100000)).filter([] (int i) { return i % 2 == 0; });
+    size_t n = 0;
+    collect(std::move(s), 1)([&n] (std::vector<int> v) { n = v.size(); });
+    assert(n == 50000);
+  }
+
+  // buffer reads ahead as far as it has room, and no further
+  {
+    ManualSource src;
+    auto s = src.stream().buffer(4);
+    std::vector<int> got;
+    auto sink = [&got] (std::vector<int> v) { got = std::move(v); };
+
+    s.nextChunk(1)(sink);
+    assert(src.requests.size() == 1 && src.requests[0].max == 4);
+    src.requests[0].cont(std::vector<int>{ 1, 2, 3, 4 });
+    assert(got == std::vector<int>({ 1 }));
+    // one element was taken, so there's room for one more
+    assert(src.requests.size() == 2 && src.requests[1].max == 1);
+
+    s.nextChunk(10)(sink);
+    assert(got == std::vector<int>({ 2, 3, 4 }));
+    assert(src.requests.size() == 2);
+    src.requests[1].cont(std::vector<int>());
+    s.nextChunk(10)(sink);
+    assert(got.empty());
+  }
+
+  // merge interleaves streams, and ends when they all have
+  {
+    ManualSource a;
+    ManualSource b;
+    auto s = merge(a.stream(), b.stream());
+    std::vector<int> got;
+    auto sink = [&got] (std::vector<int> v) { got = std::move(v); };
+
+    s.nextChunk(8)(sink);
+    assert(a.requests.size() == 1 && b.requests.size() == 1);
+    b.requests[0].cont(std::vector<int>{ 7 });
+    assert(got == std::vector<int>({ 7 }));
+    a.requests[0].cont(std::vector<int>{ 1, 2 });
+    s.nextChunk(8)(sink);
+    assert(got == std::vector<int>({ 1, 2 }));
+
+    got = { -1 };
+    s.nextChunk(8)(sink);
+    a.requests[1].cont(std::vector<int>());
+    assert(got == std::vector<int>({ -1 }));
+    b.requests[1].cont(std::vector<int>());
+    assert(got.empty());
+  }
+
+  // merging streams that deliver on other threads
+  {
+    std::atomic<int> sum(0);
+    std::atomic<bool> done(false);
+    {
+      ThreadPool pool(4);
+      std::vector<AsyncStream<int>> streams;
+      for (int i = 0; i < 4; ++i)
+        streams.push_back(AsyncStream<int>(
+            [&pool, s = std::make_shared<AsyncStream<int>>(stream(range(100)))]
+            (size_t max, ContinuationT<std::vector<int>> c) {
+              via(pool, s->nextChunk(max))(std::move(c));
+            }).buffer(8));
+      collect(merge(std::move(streams)), 16)([&sum, &done] (std::vector<int> v) {
+          for (int i : v)
+            sum += i;
+          done = true;
+        });
+      assert(eventually([&done] { return done.load(); }));
+    }
+    assert(sum == 4 * 5050);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Errors
+
+void testResults()
+{
+  using R = Either<string, int>;
+  auto sink = [] (R& r) { return [&r] (R x) { r = std::move(x); }; };
+
+  // values flow through fmap and bind; errors skip them
+  {
+    R r(string(), true);
+    auto a = result::bind(result::fmap([] (int i) { return i * 2; },
+                                       result::success<string>(2)),
+                          [] (int i) { return result::success<string>(i + 1); });
+    a(sink(r));
+    assert(r.isRight() && r.m_right == 5);
+
+    bool called = false;
+    auto b = result::bind(result::failure<int>(string("bad")),
+                          [&called] (int i) {
+                            called = true;
+                            return result::success<string>(i);
+                          });
+    b(sink(r));
+    assert(!r.isRight() && r.m_left == "bad");
+    assert(!called);
+  }
+
+  // recover handles errors, and only errors
+  {
+    R r(string(), true);
+    auto a = result::recover(result::failure<int>(string("bad")), [] (string e) {
+        return result::success<string>(static_cast<int>(e.size()));
+      });
+    a(sink(r));
+    assert(r.isRight() && r.m_right == 3);
+
+    auto b = result::recover(result::success<string>(7), [] (string) {
+        return result::success<string>(0);
+      });
+    b(sink(r));
+    assert(r.isRight() && r.m_right == 7);
+  }
+
+  // retry until success, or until the attempts run out
+  {
+    int calls = 0;
+    auto flaky = [&calls] () -> AsyncResult<int, string> {
+      if (++calls < 3)
+        return result::failure<int>(string("again"));
+      return result::success<string>(calls);
+    };
+    R r(string(), true);
+    result::retry(flaky, 5)(sink(r));
+    assert(r.isRight() && r.m_right == 3 && calls == 3);
+
+    calls = 0;
+    result::retry(flaky, 2)(sink(r));
+    assert(!r.isRight() && r.m_left == "again" && calls == 2);
+
+    // a long run of synchronous failures runs in constant stack space
+    int n = 0;
+    auto never = [&n] () { ++n; return result::failure<int>(string("no")); };
+    result::retry(never, 100000)(sink(r));
+    assert(n == 100000 && !r.isRight());
+  }
+
+  // when_all collects values...
+  {
+    Either<string, std::tuple<int, string>> r(string(), true);
+    auto a = result::when_all(result::success<string>(1),
+                              result::fmap(ToString, result::success<string>(2)));
+    a([&r] (Either<string, std::tuple<int, string>> x) { r = std::move(x); });
+    assert(r.isRight() && r.m_right == std::make_tuple(1, string("2")));
+  }
+
+  // ...and fails fast, stopping the branches still running
+  {
+    Cancellable slow;
+    Either<string, std::tuple<int, int>> r(string(), true);
+    bool done = false;
+    auto a = result::when_all(fmap([] (int i) { return R(i); }, slow.get()),
+                              result::failure<int>(string("bad")));
+    a([&r, &done] (Either<string, std::tuple<int, int>> x) {
+        r = std::move(x);
+        done = true;
+      });
+    assert(done && !r.isRight() && r.m_left == "bad");
+    assert(slow.m_cancelled);
+  }
+
+  // a range fails fast too, without starting the rest
+  {
+    int started = 0;
+    std::vector<Async<R>> asyncs;
+    for (int i = 0; i < 5; ++i)
+      asyncs.push_back([&started, i] (ContinuationT<R> c) {
+          ++started;
+          c(i == 1 ? R(string("bad"), true) : R(i));
+        });
+    Either<string, std::vector<int>> r(std::vector<int>{});
+    result::when_all(std::move(asyncs))(
+        [&r] (Either<string, std::vector<int>> x) { r = std::move(x); });
+    assert(!r.isRight() && r.m_left == "bad");
+    assert(started == 2);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Tracing
 
-struct CopyTest
+void testTracing()
 {
-  CopyTest() { ++s_constructCount; }
-  ~CopyTest() { ++s_destructCount; }
-  CopyTest(const CopyTest& other) { ++s_copyConstructCount; }
-  CopyTest(CopyTest&& other) { ++s_moveConstructCount; }
-  CopyTest& operator=(const CopyTest& other) { ++s_assignmentCount; return *this; }
-  CopyTest& operator=(CopyTest&& other) { ++s_moveAssignmentCount; return *this; }
+  // disabled tracing adds nothing to the combinators' state
+  static_assert(std::is_empty<trace::Disabled::Node>::value,
+                "a disabled trace node must be empty");
+
+  trace::ChromeTrace sink;
+  trace::setSink(&sink);
+
+  // a traced stage runs from its start to its completion
+  {
+    Cancellable c;
+    auto a = traced<trace::Enabled>("lookup", fmap(ToString, c.get()));
+    string result;
+    a([&result] (string s) { result = std::move(s); });
+    assert(sink.records().size() == 1);
+    c.m_pending(42);
+    assert(result == "42");
+
+    auto records = sink.records();
+    assert(records.size() == 2);
+    assert(records[0].event == trace::Event::STAGE_START);
+    assert(records[1].event == trace::Event::STAGE_COMPLETE);
+    assert(records[0].id == records[1].id);
+    assert(string(records[1].name) == "lookup");
+    assert(records[0].time <= records[1].time);
+  }
 
-  static int s_constructCount;
-  static int s_destructCount;
-  static int s_copyConstructCount;
-  static int s_moveConstructCount;
-  static int s_assignmentCount;
-  static int s_moveAssignmentCount;
+  // each run of a stage is a slice of its own, on the thread it ends on
+  {
+    Threads threads;
+    auto a = traced<trace::Enabled>("remote", threads.deliver(1));
+    std::atomic<int> done(0);
+    a([&done] (int) { ++done; });
+    a([&done] (int) { ++done; });
+    assert(eventually([&done] { return done == 2; }));
+  }
+  {
+    auto records = sink.records();
+    assert(records.size() == 6);
+    assert(records[2].id != records[3].id);
+    assert(records[5].thread != std::this_thread::get_id());
+  }
 
-  static void Reset()
+  // the export is Chrome's trace event format
   {
-    s_constructCount = 0;
-    s_destructCount = 0;
-    s_copyConstructCount = 0;
-    s_moveConstructCount = 0;
-    s_assignmentCount = 0;
-    s_moveAssignmentCount = 0;
+    std::ostringstream os;
+    sink.write(os);
+    string json = os.str();
+    assert(json.find("{\"traceEvents\":[") == 0);
+    assert(json.find("\"name\":\"lookup\",\"cat\":\"async\",\"ph\":\"b\"") != string::npos);
+    assert(json.find("\"ph\":\"e\"") != string::npos);
+  }
+
+  // nothing is recorded without a sink
+  trace::setSink(nullptr);
+  traced<trace::Enabled>("unseen", pure(1))([] (int) {});
+  assert(sink.records().size() == 6);
+}
+
+#if defined(__linux__)
+//------------------------------------------------------------------------------
+// I/O
+
+using IoBytes = Either<std::error_code, size_t>;
+
+void testReactor(Reactor::Backend backend)
+{
+  Reactor r(backend);
+
+  // a write, then a read, through a pipe
+  {
+    int fds[2];
+    assert(::pipe(fds) == 0);
+    char buf[16] = {};
+    std::atomic<size_t> n(0);
+    auto a = result::bind(async::write(r, fds[1], "hello", 5),
+                          [&] (size_t) { return async::read(r, fds[0], buf, sizeof(buf)); });
+    a([&n] (IoBytes e) { n = e.isRight() ? e.m_right : 0; });
+    assert(eventually([&n] { return n.load() == 5; }));
+    assert(std::string(buf, 5) == "hello");
+    ::close(fds[0]);
+    ::close(fds[1]);
+  }
+
+  // an error is an error_code on the Left
+  {
+    char c;
+    std::atomic<int> err(0);
+    async::read(r, -1, &c, 1)([&err] (IoBytes e) {
+        err = e.isRight() ? 0 : e.m_left.value();
+      });
+    assert(eventually([&err] { return err.load() == EBADF; }));
+  }
+
+  // a batch of reads goes to the kernel at once
+  {
+    std::array<std::array<int, 2>, 4> pipes;
+    std::array<char, 4> bufs = {};
+    for (auto& p : pipes)
+    {
+      assert(::pipe(p.data()) == 0);
+      assert(::write(p[1], "x", 1) == 1);
+    }
+    assert(eventually([&r] { return r.pending() == 0; }));
+    size_t before = r.submissions();
+    std::atomic<bool> done(false);
+    auto a = batched(when_all(async::read(r, pipes[0][0], &bufs[0], 1),
+                              async::read(r, pipes[1][0], &bufs[1], 1),
+                              async::read(r, pipes[2][0], &bufs[2], 1),
+                              async::read(r, pipes[3][0], &bufs[3], 1)));
+    a([&done] (std::tuple<IoBytes, IoBytes, IoBytes, IoBytes>) { done = true; });
+    assert(eventually([&done] { return done.load(); }));
+    assert(r.submissions() - before == 1);
+    assert(std::string(bufs.data(), 4) == "xxxx");
+    for (auto& p : pipes)
+    {
+      ::close(p[0]);
+      ::close(p[1]);
+    }
+  }
+
+  // a stopped read retires without calling its continuation
+  {
+    int fds[2];
+    assert(::pipe(fds) == 0);
+    char c;
+    bool called = false;
+    StopSource s;
+    {
+      StopScope scope(s.token());
+      async::read(r, fds[0], &c, 1)([&called] (IoBytes) { called = true; });
+    }
+    assert(eventually([&r] { return r.pending() == 1; }));
+    s.requestStop();
+    assert(eventually([&r] { return r.pending() == 0; }));
+    assert(!called);
+    ::close(fds[0]);
+    ::close(fds[1]);
+  }
+
+  // accepting and connecting over loopback (non-blocking sockets for epoll)
+  {
+    int flags = SOCK_STREAM | SOCK_CLOEXEC;
+    if (r.backend() == Reactor::Backend::EPOLL)
+      flags |= SOCK_NONBLOCK;
+    int l = ::socket(AF_INET, flags, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    assert(::bind(l, reinterpret_cast<sockaddr*>(&addr), len) == 0);
+    assert(::listen(l, 4) == 0);
+    assert(::getsockname(l, reinterpret_cast<sockaddr*>(&addr), &len) == 0);
+    int c = ::socket(AF_INET, flags, 0);
+
+    std::atomic<int> accepted(-1);
+    std::atomic<bool> connected(false);
+    auto a = async::accept(r, l) && async::connect(r, c, reinterpret_cast<sockaddr*>(&addr), len);
+    a([&] (std::pair<Either<std::error_code, int>, Either<std::error_code, Void>> p) {
+        accepted = p.first.isRight() ? p.first.m_right : -1;
+        connected = p.second.isRight();
+      });
+    assert(eventually([&] { return accepted.load() >= 0 && connected.load(); }));
+    ::close(accepted);
+    ::close(c);
+    ::close(l);
+  }
+
+  // a write from a view keeps its storage alive
+  {
+    int fds[2];
+    assert(::pipe(fds) == 0);
+    std::weak_ptr<const void> owner;
+    std::atomic<size_t> n(0);
+    {
+      auto v = view(std::string("payload"));
+      owner = v.owner();
+      async::write(r, fds[1], v)([&n] (IoBytes e) { n = e.isRight() ? e.m_right : 0; });
+    }
+    assert(eventually([&n] { return n.load() == 7; }));
+    assert(eventually([&owner] { return owner.expired(); }));
+    ::close(fds[0]);
+    ::close(fds[1]);
+  }
+
+  // completions can be dispatched on an executor
+  {
+    CountingExecutor ex;
+    Reactor dispatching(ex, backend);
+    int fds[2];
+    assert(::pipe(fds) == 0);
+    std::atomic<bool> done(false);
+    async::write(dispatching, fds[1], "x", 1)([&done] (IoBytes) { done = true; });
+    assert(eventually([&done] { return done.load(); }));
+    assert(ex.count == 1);
+    ::close(fds[0]);
+    ::close(fds[1]);
+  }
+
+  // operations still pending when the reactor goes are dropped
+  {
+    int fds[2];
+    assert(::pipe(fds) == 0);
+    char c;
+    bool called = false;
+    {
+      Reactor doomed(backend);
+      async::read(doomed, fds[0], &c, 1)([&called] (IoBytes) { called = true; });
+      assert(eventually([&doomed] { return doomed.pending() == 1; }));
+    }
+    assert(!called);
+    ::close(fds[0]);
+    ::close(fds[1]);
+  }
+}
+
+void testReactors()
+{
+  testReactor(Reactor::Backend::EPOLL);
+  testReactor(Reactor::Backend::AUTO);
+}
+#endif
+
+//------------------------------------------------------------------------------
+// Memoization
+
+void testMemoize()
+{
+  // concurrent callers for a key share one upstream call, and later ones hit
+  {
+    Deferred d;
+    int calls = 0;
+    auto m = memoize([&] (int i) { ++calls; return d.get(i); }, 4);
+    int r1 = 0;
+    int r2 = 0;
+    m(1)([&r1] (int i) { r1 = i; });
+    m(1)([&r2] (int i) { r2 = i; });
+    assert(calls == 1 && d.pending.size() == 1);
+    d.completeNext();
+    assert(r1 == 10 && r2 == 10);
+
+    int r3 = 0;
+    m(1)([&r3] (int i) { r3 = i; });
+    assert(r3 == 10 && calls == 1);
+    assert(m.hits() == 2 && m.misses() == 1);
+
+    // an erased key is fetched again
+    m.erase(1);
+    assert(m.size() == 0);
+    m(1)([] (int) {});
+    assert(calls == 2);
+  }
+
+  // CLOCK eviction passes over entries that have been hit since the last sweep
+  {
+    int calls = 0;
+    auto m = memoize([&calls] (int i) { ++calls; return pure(i); }, 2, 1);
+    m(1)([] (int) {});
+    m(2)([] (int) {});
+    m(1)([] (int) {});
+    m(3)([] (int) {});
+    assert(m.size() == 2 && calls == 3);
+    m(1)([] (int) {});
+    assert(calls == 3);
+    m(2)([] (int) {});
+    assert(calls == 4);
+  }
+
+  // however many shards are asked for, the cache keeps to its capacity
+  {
+    auto m = memoize([] (int i) { return pure(i); }, 4);
+    for (int i = 0; i < 100; ++i)
+      m(i)([] (int) {});
+    assert(m.size() <= 4);
+
+    auto n = memoize([] (int i) { return pure(i); }, 10, 4);
+    for (int i = 0; i < 100; ++i)
+      n(i)([] (int) {});
+    assert(n.size() <= 10);
+  }
+
+  // a memoized function is a bind stage like any other
+  {
+    auto m = memoize(AsyncToString, 8);
+    string result;
+    auto a = pure(42) >= m;
+    a([&result] (const string& s) { result = s; });
+    assert(result == "42");
+  }
+
+  // each key's upstream runs once, however many threads ask for it
+  {
+    std::atomic<int> calls(0);
+    auto m = memoize([&calls] (int i) {
+        return fmap([&calls] (int j) { ++calls; return j * 2; }, pure(i));
+      }, 64);
+    ThreadPool pool(4);
+    std::atomic<int> sum(0);
+    std::atomic<int> done(0);
+    for (int n = 0; n < 400; ++n)
+      via(pool, pure(n % 8))([&, m] (int k) {
+          m(k)([&] (int v) {
+              sum += v;
+              ++done;
+            });
+        });
+    assert(eventually([&done] { return done.load() == 400; }));
+    assert(calls == 8);
+    assert(sum == 50 * 2 * (0 + 1 + 2 + 3 + 4 + 5 + 6 + 7));
+  }
+
+  // a miss under a memory resource doesn't leave the cached Async in it
+  {
+    std::array<char, 100> big{};
+    auto m = memoize([big] (int i) -> Async<int> {
+        return fmap([big] (int j) { return j + int(big.size()); }, pure(i));
+      }, 4);
+    {
+      Arena arena;
+      ResourceScope scope(&arena);
+      m(1);
+      assert(arena.bytesAllocated() == 0);
+    }
+    int result = 0;
+    m(1)([&result] (int i) { result = i; });
+    assert(result == 101);
   }
+}
+
+//------------------------------------------------------------------------------
+// Plans: graphs built once and run many times
+
+void testPlans()
+{
+  // every run sees the graph as it was built, even the values pure moves out
+  {
+    auto plan = prepare(fmap(FirstChar, pure(string("hello"))));
+    string result;
+    plan([&result] (char c) { result += c; });
+    plan([&result] (char c) { result += c; });
+    assert(result == "hh");
+  }
+
+  // runs that overlap have their own join state
+  {
+    Deferred d;
+    auto get = [&d] (int i) {
+      return makeAsyncOp<int>([&d, i] (auto&& c) { d.get(i)(std::move(c)); });
+    };
+    auto plan = prepare(async::apply(fmap([] (int x, int y) { return x + y; },
+                                          get(1)), get(2)));
+    int r1 = 0;
+    int r2 = 0;
+    plan([&r1] (int i) { r1 = i; });
+    plan([&r2] (int i) { r2 = i; });
+    assert(d.pending.size() == 4);
+    d.completeNext();
+    d.completeNext();
+    assert(r1 == 30 && r2 == 0);
+    d.completeNext();
+    d.completeNext();
+    assert(r2 == 30);
+    // what the runs left behind came from the plan's pool
+    d.pending.clear();
+  }
+
+  // a run invokes the graph in place, without copying what it captured
+  {
+    auto op = makeAsyncOp<int>([c = tracking::CopyTest()] (auto&& k) { k(1); });
+    auto plan = prepare(when_all(std::move(op), pure(2)));
+    int result = 0;
+    tracking::Scope s;
+    plan([&result] (std::tuple<int, int> t) { result = std::get<0>(t) + std::get<1>(t); });
+    plan([&result] (std::tuple<int, int> t) { result += std::get<0>(t) + std::get<1>(t); });
+    assert(result == 6);
+    assert(s.copies() == 0);
+  }
+
+  // from any number of threads at once
+  {
+    auto plan = prepare(when_all(pure(1), pure(2)) && pure(3));
+    std::atomic<int> sum(0);
+    std::atomic<int> done(0);
+    {
+      ThreadPool pool(4);
+      for (int n = 0; n < 200; ++n)
+        via(pool, pure(n))([&, plan] (int) {
+            plan([&] (std::pair<std::tuple<int, int>, int> p) {
+                sum += std::get<0>(p.first) + std::get<1>(p.first) + p.second;
+                ++done;
+              });
+          });
+      assert(eventually([&done] { return done.load() == 200; }));
+    }
+    assert(sum == 200 * 6);
+  }
+
+  // once its pool has seen a run, a plan runs without touching the heap
+  {
+    auto plan = prepare(when_all(pure(1), pure(2)) && pure(3));
+    std::array<char, 100> big{};
+    int result = 0;
+    auto run = [&] () {
+      plan([&result, big] (std::pair<std::tuple<int, int>, int> p) {
+          result = std::get<0>(p.first) + p.second + int(big.size());
+        });
+    };
+    run();
+    size_t blocks = plan.pool().blocksAllocated();
+    assert(blocks > 0);
+
+    tracking::Scope s;
+    run();
+    run();
+    assert(result == 104);
+    assert(s.allocations() == 0);
+    assert(plan.pool().blocksAllocated() == blocks);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Memory resources
+
+// Counts allocations, passing them on to an arena.
+struct CountingResource : MemoryResource
+{
+  void* allocate(size_t bytes, size_t align) override
+  {
+    ++allocations;
+    return arena.allocate(bytes, align);
+  }
+
+  void deallocate(void* p, size_t bytes, size_t align) override
+  {
+    ++deallocations;
+    arena.deallocate(p, bytes, align);
+  }
+
+  Arena arena;
+  std::atomic<int> allocations{0};
+  std::atomic<int> deallocations{0};
+};
+
+void testAllocators()
+{
+  // an arena hands out aligned memory, growing as needed
+  {
+    Arena arena(64);
+    for (size_t align = 1; align <= 64; align *= 2)
+    {
+      void* p = arena.allocate(40, align);
+      assert(reinterpret_cast<uintptr_t>(p) % align == 0);
+    }
+    void* big = arena.allocate(1000, 8);
+    assert(big != nullptr);
+    assert(arena.bytesAllocated() == 7 * 40 + 1000);
+  }
+
+  // a pool recycles what's given back to it, by size class
+  {
+    Pool pool;
+    void* p = pool.allocate(24, 8);
+    pool.deallocate(p, 24, 8);
+    void* q = pool.allocate(32, 8);
+    void* r = pool.allocate(24, 8);
+    assert(q == p && r != p);
+    assert(pool.blocksAllocated() == 2);
+    pool.deallocate(q, 32, 8);
+    pool.deallocate(r, 24, 8);
+
+    void* aligned = pool.allocate(40, 64);
+    assert(reinterpret_cast<uintptr_t>(aligned) % 64 == 0);
+    pool.deallocate(aligned, 40, 64);
+    void* big = pool.allocate(10000, 8);
+    pool.deallocate(big, 10000, 8);
+    assert(pool.blocksAllocated() == 2);
+  }
+
+  // join state comes from the current resource
+  {
+    CountingResource r;
+    int result = 0;
+    auto a = with_allocator(r, async::apply(fmap([] (int x, int y) { return x + y; },
+                                                 pure(1)), pure(2)));
+    a([&result] (int i) { result = i; });
+    assert(result == 3);
+    assert(r.allocations == 1);
+
+    auto b = with_allocator(r, when_all(pure(1), pure(2)) || zero<int>());
+    b([] (const Either<std::tuple<int, int>, int>&) {});
+    assert(r.allocations == 3);
+  }
+
+  // and so do boxed continuations, which give their memory back
+  {
+    CountingResource r;
+    {
+      ResourceScope scope(&r);
+      std::array<char, 100> big{};
+      UniqueFunction<int ()> f = [big] () { return big.size(); };
+      assert(f() == 100);
+    }
+    assert(r.allocations == 1);
+    assert(r.deallocations == 1);
+    assert(currentResource() == nullptr);
+  }
+
+  // bind reinstates the resource for stages started on other threads
+  {
+    CountingResource r;
+    std::atomic<int> result(0);
+    {
+      ThreadPool pool(2);
+      auto a = with_allocator(r, via(pool, pure(1)) >= [&r] (int i) {
+          assert(currentResource() == &r);
+          return when_all(pure(i), pure(i + 1));
+        });
+      a([&result] (std::tuple<int, int> t) {
+          result = std::get<0>(t) + std::get<1>(t);
+        });
+    }
+    assert(result == 3);
+    assert(r.allocations >= 1);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Coroutines
+
+#if defined(__cpp_impl_coroutine)
+
+Task<char> firstCharOf(int i)
+{
+  string s = co_await AsyncToString(i);
+  char c = co_await AsyncFirstChar(s);
+  co_return c;
+}
+
+Task<int> sumOf(ThreadPool& pool, int n)
+{
+  int sum = 0;
+  for (int i = 1; i <= n; ++i)
+    sum += co_await via(pool, pure(i));
+  co_return sum;
+}
+
+Task<void> store(int& result)
+{
+  result = co_await firstCharOf(456);
+  co_await AsyncVoid();
+}
+
+// awaiting a borrowed value takes a copy of it
+Task<size_t> lengthOf(string s)
+{
+  Async<const string&> a = pure(std::move(s));
+  string t = co_await std::move(a);
+  co_return t.size();
+}
+
+// Counts the frames it allocates.
+template <typename T>
+struct CountingAllocator
+{
+  using value_type = T;
 
-  static void Stats()
+  explicit CountingAllocator(int* count) : m_count(count) {}
+  template <typename U>
+  CountingAllocator(const CountingAllocator<U>& other) : m_count(other.m_count) {}
+
+  T* allocate(size_t n)
   {
-    cout << s_constructCount << " constructs" << endl;
-    cout << s_destructCount << " destructs" << endl;
-    cout << s_copyConstructCount << " copy constructs" << endl;
-    cout << s_moveConstructCount << " move constructs" << endl;
-    cout << s_assignmentCount << " assignments" << endl;
-    cout << s_moveAssignmentCount << " move assignments" << endl;
-    Reset();
+    ++*m_count;
+    return std::allocator<T>().allocate(n);
   }
 
-  static void ExpectCopies(int n)
+  void deallocate(T* p, size_t n)
   {
-    assert(s_copyConstructCount <= n);
-    assert(s_assignmentCount <= n);
-    Reset();
+    --*m_count;
+    std::allocator<T>().deallocate(p, n);
   }
+
+  int* m_count;
 };
 
-int CopyTest::s_constructCount;
-int CopyTest::s_destructCount;
-int CopyTest::s_copyConstructCount;
-int CopyTest::s_moveConstructCount;
-int CopyTest::s_assignmentCount;
-int CopyTest::s_moveAssignmentCount;
+Task<int> allocated(std::allocator_arg_t, CountingAllocator<char>, int x)
+{
+  co_return co_await pure(x) + 1;
+}
+
+// throws, once what it awaits has arrived
+Task<int> throwsAfter(Async<int> a)
+{
+  int i = co_await std::move(a);
+  if (i > 0)
+    throw std::runtime_error("task");
+  co_return i;
+}
+
+Task<string> catches(Async<int> a)
+{
+  try
+  {
+    co_return to_string(co_await throwsAfter(std::move(a)));
+  }
+  catch (const std::runtime_error& e)
+  {
+    co_return e.what();
+  }
+}
+
+void testCoroutines()
+{
+  // a Task is an Async
+  {
+    char result = 0;
+    auto a = firstCharOf(123);
+    a([&result] (char c) { result = c; });
+    assert(result == '1');
+  }
+
+  // and erases to one, and composes with the combinators
+  {
+    Async<char> a = firstCharOf(123);
+    auto b = fmap([] (char c) { return c + 1; }, std::move(a));
+    int result = 0;
+    b([&result] (int i) { result = i; });
+    assert(result == '2');
+  }
+
+  // awaiting Tasks, and void
+  {
+    int result = 0;
+    bool done = false;
+    Async<void> a = store(result);
+    a([&done] () { done = true; });
+    assert(done);
+    assert(result == '4');
+  }
+
+  {
+    size_t result = 0;
+    auto a = lengthOf("hello");
+    a([&result] (size_t n) { result = n; });
+    assert(result == 5);
+  }
+
+  // awaiting Asyncs that complete on other threads
+  for (int n = 0; n < 10; ++n)
+  {
+    std::atomic<int> result(0);
+    {
+      ThreadPool pool(2);
+      auto a = sumOf(pool, 10);
+      a([&result] (int i) { result = i; });
+    }
+    assert(result == 55);
+  }
+
+  // an exception that escapes a Task is rethrown where it's awaited, whether
+  // it's thrown while the Task is being started, or once it's been resumed on
+  // another thread
+  {
+    string result;
+    auto a = catches(pure(1));
+    a([&result] (string s) { result = std::move(s); });
+    assert(result == "task");
+
+    auto b = catches(pure(0));
+    b([&result] (string s) { result = std::move(s); });
+    assert(result == "0");
+  }
+
+  for (int n = 0; n < 10; ++n)
+  {
+    std::atomic<bool> done(false);
+    string result;
+    {
+      ThreadPool pool(2);
+      auto a = catches(via(pool, pure(1)));
+      a([&] (string s) {
+          result = std::move(s);
+          done = true;
+        });
+      while (!done)
+        std::this_thread::yield();
+    }
+    assert(result == "task");
+  }
+
+  // a Task that is never run frees its frame; frames can come from an
+  // allocator
+  {
+    int frames = 0;
+    {
+      auto a = allocated(std::allocator_arg, CountingAllocator<char>(&frames), 1);
+      assert(frames == 1);
+    }
+    assert(frames == 0);
+
+    int result = 0;
+    auto a = allocated(std::allocator_arg, CountingAllocator<char>(&frames), 1);
+    a([&result] (int i) { result = i; });
+    assert(result == 2);
+    assert(frames == 0);
+  }
+
+  // or from the current resource
+  {
+    CountingResource r;
+    {
+      ResourceScope scope(&r);
+      auto a = firstCharOf(1);
+    }
+    assert(r.allocations == 1);
+    assert(r.deallocations == 1);
+  }
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Performance tests: number of copies
+
+using tracking::CopyTest;
 
 Async<CopyTest> AsyncCopyTest()
 {
-  return [] (std::function<void (CopyTest)> f) { f(CopyTest()); };
+  return [] (ContinuationT<CopyTest> f) { f(CopyTest()); };
 }
 
 CopyTest CopyTestId(const CopyTest& c)
@@ -393,9 +2502,17 @@ CopyTest CopyTestId(const CopyTest& c)
 
 int NumCopies(const CopyTest& c)
 {
-  return c.s_copyConstructCount;
+  return static_cast<int>(CopyTest::CopyConstructs());
 }
 
+// A function that carries a CopyTest, so that copies of it are counted.
+struct CountingFn
+{
+  int operator()(int i) const { return i; }
+
+  CopyTest c;
+};
+
 void testCopiesFmap()
 {
   CopyTest::Reset();
@@ -413,7 +2530,7 @@ void testCopiesFmap()
 
   {
     auto a = AsyncCopyTest();
-    auto b = fmap(NumCopies, a);
+    auto b = fmap(NumCopies, std::move(a));
     b([] (int i) {});
     CopyTest::ExpectCopies(0);
   }
@@ -426,11 +2543,28 @@ void testCopiesFmap()
 
   {
     auto a = AsyncCopyTest();
-    auto b = fmap(NumCopies, fmap(CopyTestId, a));
+    auto b = fmap(NumCopies, fmap(CopyTestId, std::move(a)));
     b([] (int i) {});
     // CopyTestId copies its argument
     CopyTest::ExpectCopies(1);
   }
+
+  // invoking an fmap moves its function, even when stages are fused, unless
+  // it's invoked as const, when it copies it so that it can be invoked again
+  {
+    auto a = fmap(CountingFn(), pure(1));
+    const auto& ca = a;
+    ca([] (int) {});
+    CopyTest::ExpectCopies(1);
+    a([] (int) {});
+    CopyTest::ExpectCopies(0);
+
+    auto b = fmap(CountingFn(), fmap(CountingFn(), pure(1)));
+    int result = 0;
+    std::move(b)([&result] (int i) { result = i; });
+    assert(result == 1);
+    CopyTest::ExpectCopies(0);
+  }
 }
 
 void testCopiesPure()
@@ -454,14 +2588,19 @@ void testCopiesPure()
   }
 }
 
-int AddCopies2(const CopyTest& c1, const CopyTest& c2)
+int AddCopies2(const CopyTest&, const CopyTest&)
+{
+  return static_cast<int>(2 * CopyTest::CopyConstructs());
+}
+
+int AddCopies3(const CopyTest&, const CopyTest&, const CopyTest&)
 {
-  return c1.s_copyConstructCount + c2.s_copyConstructCount;
+  return static_cast<int>(3 * CopyTest::CopyConstructs());
 }
 
-int AddCopies3(const CopyTest& c1, const CopyTest& c2, const CopyTest& c3)
+int TakeTwo(CopyTest, CopyTest)
 {
-  return c1.s_copyConstructCount + c2.s_copyConstructCount + c3.s_copyConstructCount;
+  return 0;
 }
 
 void testCopiesApply()
@@ -470,7 +2609,7 @@ void testCopiesApply()
 
   // rvalues
   {
-    auto b = apply(fmap(AddCopies2, pure(CopyTest())), pure(CopyTest()));
+    auto b = async::apply(fmap(AddCopies2, pure(CopyTest())), pure(CopyTest()));
     b([] (int) {});
     CopyTest::ExpectCopies(0);
   }
@@ -479,53 +2618,84 @@ void testCopiesApply()
   {
     auto a1 = pure(CopyTest());
     auto a2 = pure(CopyTest());
-    auto b = apply(fmap(AddCopies2, std::move(a1)), std::move(a2));
+    auto b = async::apply(fmap(AddCopies2, std::move(a1)), std::move(a2));
     b([] (int) {});
     CopyTest::ExpectCopies(0);
   }
 
-  // 1 lvalue
+  // 1 moved lvalue
   {
     auto a = pure(CopyTest());
-    auto b = apply(fmap(AddCopies2, a), pure(CopyTest()));
+    auto b = async::apply(fmap(AddCopies2, std::move(a)), pure(CopyTest()));
     b([] (int) {});
-    CopyTest::ExpectCopies(1);
+    CopyTest::ExpectCopies(0);
   }
 
-  // 2 lvalues
+  // 2 lvalues (static pipelines are copyable, and copy their captures)
   {
     auto a = pure(CopyTest());
-    auto b = apply(fmap(AddCopies2, a), a);
+    auto b = async::apply(fmap(AddCopies2, a), a);
     b([] (int) {});
     CopyTest::ExpectCopies(2);
   }
 
   // n-ary apply (rvalues)
   {
-    auto b = apply(apply(fmap(AddCopies3, pure(CopyTest())), pure(CopyTest())), pure(CopyTest()));
+    auto b = async::apply(async::apply(fmap(AddCopies3, pure(CopyTest())), pure(CopyTest())), pure(CopyTest()));
     b([] (int) {});
     CopyTest::ExpectCopies(0);
   }
 
-  // n-ary apply (lvalues)
+  // n-ary apply (moved lvalues)
   {
-    auto a = pure(CopyTest());
-    auto b = apply(apply(fmap(AddCopies3, a), a), a);
+    auto a1 = pure(CopyTest());
+    auto a2 = pure(CopyTest());
+    auto a3 = pure(CopyTest());
+    auto b = async::apply(async::apply(fmap(AddCopies3, std::move(a1)), std::move(a2)), std::move(a3));
     b([] (int) {});
-    CopyTest::ExpectCopies(3);
+    CopyTest::ExpectCopies(0);
+  }
+
+  // a partial application forwards the remaining arguments: the only moves
+  // are into the function's own by-value parameters
+  {
+    auto f = function_traits<decltype(&TakeTwo)>::apply(TakeTwo, CopyTest());
+    CopyTest c;
+    tracking::Scope s;
+    f(std::move(c));
+    assert(s.counts().moveConstructs == 2 && s.copies() == 0);
   }
 }
 
 Async<int> AsyncNumCopies(const CopyTest& c)
 {
-  int i = c.s_copyConstructCount;
-  return [i] (std::function<void (int)> f) { f(i); };
+  int i = static_cast<int>(CopyTest::CopyConstructs());
+  return [i] (ContinuationT<int> f) { f(i); };
 }
 
+// A bind stage that counts its copies.
+struct CountingBindFn
+{
+  Async<int> operator()(int i) const { return pure(i); }
+
+  CopyTest c;
+};
+
 void testCopiesBind()
 {
   CopyTest::Reset();
 
+  // the function is moved through the stage, unless it's invoked as const
+  {
+    auto a = pure(1) >= CountingBindFn();
+    CopyTest::ExpectCopies(0);
+    const auto& ca = a;
+    ca([] (int) {});
+    CopyTest::ExpectCopies(1);
+    a([] (int) {});
+    CopyTest::ExpectCopies(0);
+  }
+
   // rvalue
   {
     auto a = pure(CopyTest()) >= AsyncNumCopies;
@@ -533,12 +2703,12 @@ void testCopiesBind()
     CopyTest::ExpectCopies(0);
   }
 
-  // lvalue
+  // moved lvalue
   {
     auto a = pure(CopyTest());
-    auto b = a >= AsyncNumCopies;
+    auto b = std::move(a) >= AsyncNumCopies;
     b([] (int i) {});
-    CopyTest::ExpectCopies(1);
+    CopyTest::ExpectCopies(0);
   }
 }
 
@@ -553,22 +2723,29 @@ void testCopiesAnd()
     CopyTest::ExpectCopies(0);
   }
 
-  // lvalues
+  // moved lvalues
   {
     auto a1 = pure(CopyTest());
     auto a2 = pure(CopyTest());
-    auto a = a1 && a2;
+    auto a = std::move(a1) && std::move(a2);
     a([] (const std::pair<CopyTest,CopyTest>&) {});
-    CopyTest::ExpectCopies(2);
+    CopyTest::ExpectCopies(0);
   }
 
-  // lvalues (voids)
+  // moved lvalues (voids)
   {
     auto a1 = pure(CopyTest()) > AsyncVoid;
     auto a2 = pure(CopyTest()) > AsyncVoid;
-    auto a = a1 && a2;
+    auto a = std::move(a1) && std::move(a2);
     a([] (const std::pair<Void,Void>&) {});
-    CopyTest::ExpectCopies(2);
+    CopyTest::ExpectCopies(0);
+  }
+
+  // when_all (rvalues)
+  {
+    auto a = when_all(pure(CopyTest()), pure(CopyTest()), pure(CopyTest()));
+    a([] (const std::tuple<CopyTest,CopyTest,CopyTest>&) {});
+    CopyTest::ExpectCopies(0);
   }
 }
 
@@ -582,22 +2759,36 @@ void testCopiesOr()
     CopyTest::ExpectCopies(0);
   }
 
-  // lvalues
+  // moved lvalues
   {
     auto a1 = pure(CopyTest());
     auto a2 = pure(CopyTest());
-    auto a = a1 || a2;
+    auto a = std::move(a1) || std::move(a2);
     a([] (const Either<CopyTest,CopyTest>&) {});
-    CopyTest::ExpectCopies(2);
+    CopyTest::ExpectCopies(0);
   }
 
-  // lvalues (voids)
+  // moved lvalues (voids)
   {
     auto a1 = pure(CopyTest()) > AsyncVoid;
     auto a2 = pure(CopyTest()) > AsyncVoid;
-    auto a = a1 || a2;
+    auto a = std::move(a1) || std::move(a2);
     a([] (const Either<Void,Void>&) {});
-    CopyTest::ExpectCopies(2);
+    CopyTest::ExpectCopies(0);
+  }
+
+  // the result is moved into a continuation that takes it by value
+  {
+    auto a = pure(CopyTest()) || zero<CopyTest>();
+    a([] (Either<CopyTest,CopyTest>) {});
+    CopyTest::ExpectCopies(0);
+  }
+
+  // including through erasure
+  {
+    Async<Either<CopyTest,CopyTest>> a = zero<CopyTest>() || AsyncCopyTest();
+    a([] (Either<CopyTest,CopyTest>) {});
+    CopyTest::ExpectCopies(0);
   }
 }
 
@@ -703,6 +2894,231 @@ void testCopiesEither()
     CopyTest::ExpectCopies(1);
   }
 
+  // move construct
+  static_assert(std::is_nothrow_move_constructible<Either<int, string>>::value,
+                "Either should be nothrow movable");
+  {
+    Either<bool, CopyTest> e1{CopyTest()};
+    Either<bool, CopyTest> e2(std::move(e1));
+    Either<CopyTest, bool> e3(CopyTest(), true);
+    Either<CopyTest, bool> e4(std::move(e3));
+    CopyTest::ExpectCopies(0);
+  }
+
+  // trivial alternatives make a trivial, compact Either
+  static_assert(std::is_trivially_copyable<Either<int, int*>>::value,
+                "Either of trivial types should be trivially copyable");
+  static_assert(sizeof(Either<int, int*>) == sizeof(std::pair<bool, int*>),
+                "Either should cost no more than a bool and the payload");
+  static_assert(sizeof(Either<Void, Void>) == 1,
+                "Either of empty types should be just the tag");
+  static_assert(!std::is_trivially_copyable<Either<string, int>>::value,
+                "Either of non-trivial types can't be trivially copyable");
+  {
+    Either<Void, Void> e1(Void(), true);
+    Either<Void, Void> e2{Void()};
+    e2 = e1;
+    assert(!e2.isRight());
+    Either<int, int*> e3(1, true);
+    Either<int, int*> e4 = e3;
+    assert(!e4.isRight() && e4.m_left == 1);
+  }
+
+  // fmap and bind move an rvalue's payload through...
+  {
+    Either<bool, CopyTest> e1{CopyTest()};
+    auto e2 = either::fmap([] (CopyTest&& c) { return std::move(c); },
+                           std::move(e1));
+    assert(e2.isRight());
+    auto e3 = either::bind([] (CopyTest&& c) {
+        return Either<bool, CopyTest>(std::move(c)); }, std::move(e2));
+    assert(e3.isRight());
+    auto e4 = std::move(e3) >= [] (CopyTest&& c) {
+      return Either<bool, CopyTest>(std::move(c)); };
+    assert(e4.isRight());
+    CopyTest::ExpectCopies(0);
+  }
+
+  // ...on either side
+  {
+    Either<CopyTest, bool> e1(CopyTest(), true);
+    auto e2 = either::fmap([] (bool b) { return !b; }, std::move(e1));
+    assert(!e2.isRight());
+    auto e3 = either::bind([] (bool b) {
+        return Either<CopyTest, bool>(!b); }, std::move(e2));
+    assert(!e3.isRight());
+    auto e4 = std::move(e3) > [] () { return Either<CopyTest, int>(1); };
+    assert(!e4.isRight());
+    CopyTest::ExpectCopies(0);
+  }
+
+  // and copy an lvalue's
+  {
+    Either<bool, CopyTest> e1{CopyTest()};
+    auto e2 = either::fmap([] (const CopyTest& c) { return c; }, e1);
+    assert(e2.isRight());
+    CopyTest::ExpectCopies(1);
+  }
+
+  // an assignment that throws leaves the target as it was
+  {
+    Either<string, ThrowOnCopy> e1(string("abc"), true);
+    const Either<string, ThrowOnCopy> e2{ThrowOnCopy(true)};
+    bool threw = false;
+    try
+    {
+      e1 = e2;
+    }
+    catch (const std::runtime_error&)
+    {
+      threw = true;
+    }
+    assert(threw);
+    assert(!e1.isRight() && e1.m_left == "abc");
+    e1 = Either<string, ThrowOnCopy>{ThrowOnCopy(false)};
+    assert(e1.isRight());
+  }
+
+  // a move, too
+  {
+    Either<string, ThrowOnMove> e1(string("abc"), true);
+    const ThrowOnMove t(true);
+    Either<string, ThrowOnMove> e2{t};
+    bool threw = false;
+    try
+    {
+      e1 = std::move(e2);
+    }
+    catch (const std::runtime_error&)
+    {
+      threw = true;
+    }
+    assert(threw);
+    assert(!e1.isRight() && e1.m_left == "abc");
+  }
+}
+
+//------------------------------------------------------------------------------
+// Performance tests: number of allocations
+
+void testAllocations()
+{
+#if defined(__cpp_aligned_new)
+  // over-aligned allocations are counted too
+  {
+    struct alignas(64) Line { char bytes[64]; };
+    tracking::Scope s;
+    auto p = std::make_unique<Line>();
+    assert(reinterpret_cast<uintptr_t>(p.get()) % 64 == 0);
+    p.reset();
+    assert(s.allocations() == 1 && s.counts().deallocations == 1);
+  }
+#endif
+
+  // the static combinators allocate nothing and copy nothing
+  {
+    tracking::Scope s;
+    auto a = fmap(NumCopies, pure(CopyTest()));
+    a([] (int) {});
+    assert(s.allocations() == 0 && s.copies() == 0);
+  }
+
+  {
+    tracking::Scope s;
+    auto a = (pure(CopyTest()) >= AsyncNumCopies) > [] () { return pure(1); };
+    a([] (int) {});
+    assert(s.allocations() == 0 && s.copies() == 0);
+  }
+
+  // a join allocates its state once, however many branches it has
+  {
+    tracking::Scope s;
+    auto a = when_all(pure(1), pure(2), fmap(NumCopies, pure(CopyTest())));
+    a([] (std::tuple<int, int, int>) {});
+    assert(s.allocations() == 1 && s.copies() == 0);
+  }
+
+  // and nothing at all from the heap given an arena
+  {
+    Arena arena;
+    tracking::Scope s;
+    auto a = with_allocator(arena, when_all(pure(1), pure(2)) && pure(3));
+    a([] (std::pair<std::tuple<int, int>, int>) {});
+    assert(s.allocations() == 0);
+    assert(s.counts().deallocations == 0);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Performance tests: borrowed values and views
+
+const CopyTest& Borrow(const CopyTest& c)
+{
+  return c;
+}
+
+void testBorrowing()
+{
+  // an erased Async<T> moves its value into the continuation...
+  {
+    Async<CopyTest> a = pure(CopyTest());
+    tracking::Scope s;
+    a([] (const CopyTest&) {});
+    assert(s.counts().moveConstructs == 1 && s.copies() == 0);
+  }
+
+  // ...but an Async<T&&> or Async<const T&> lends it
+  {
+    Async<CopyTest&&> a = pure(CopyTest());
+    tracking::Scope s;
+    a([] (CopyTest&&) {});
+    assert(s.counts().moveConstructs == 0 && s.copies() == 0);
+  }
+
+  // through erased fmap stages, including one that projects a reference
+  {
+    Async<const CopyTest&> a = pure(CopyTest());
+    Async<const CopyTest&> b = fmap(Borrow, std::move(a));
+    Async<int> c = fmap([] (const CopyTest&) { return 1; }, std::move(b));
+    tracking::Scope s;
+    int r = 0;
+    c([&r] (int i) { r = i; });
+    assert(r == 1);
+    assert(s.counts().moveConstructs == 0 && s.copies() == 0);
+  }
+
+  // bind takes its own copy of a borrowed value, by moving it
+  {
+    Async<CopyTest&&> a = pure(CopyTest());
+    auto b = std::move(a) >= AsyncNumCopies;
+    tracking::Scope s;
+    b([] (int) {});
+    assert(s.counts().moveConstructs == 1 && s.copies() == 0);
+  }
+
+  // a view shares its payload through a join, which copies it
+  {
+    std::vector<char> payload(65536, 'x');
+    const char* p = payload.data();
+    auto v = view(std::move(payload));
+    View<char> whole;
+    View<char> part;
+    auto a = when_all(pure(v), pure(v.subview(1024, 16)));
+    a([&] (std::tuple<View<char>, View<char>> t) {
+        whole = std::get<0>(t);
+        part = std::get<1>(t);
+      });
+    assert(whole.data() == p && whole.size() == 65536);
+    assert(part.data() == p + 1024 && part.size() == 16);
+    assert(part.owner() == v.owner());
+  }
+
+  {
+    auto v = view(std::string("hello"));
+    assert(toString(v.subview(1, 3)) == "ell");
+    assert(toString(v.subview(3)) == "lo");
+    assert(v.subview(5).empty());
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -712,8 +3128,35 @@ int main(int argc, char* argv[])
   testApply();
   testBind();
   testSequence();
+  testStackSafety();
   testAnd();
   testOr();
+  testMoveOnly();
+  testStatic();
+  testConcurrentApply();
+  testConcurrentRace();
+  testWhenAll();
+  testCancel();
+  testWhenAny();
+  testExecutors();
+  testWorkStealingDeque();
+  testWorkStealingPool();
+  testShare();
+  testTimers();
+  testBatcher();
+  testTraverse();
+  testStreams();
+  testResults();
+  testTracing();
+  testMemoize();
+  testPlans();
+#if defined(__linux__)
+  testReactors();
+#endif
+  testAllocators();
+#if defined(__cpp_impl_coroutine)
+  testCoroutines();
+#endif
 
   testCopiesFmap();
   testCopiesPure();
@@ -724,5 +3167,8 @@ int main(int argc, char* argv[])
 
   testCopiesEither();
 
+  testAllocations();
+  testBorrowing();
+
   return 0;
 }